@@ -0,0 +1,59 @@
+// BlackWhite microbenchmark: the previous float scalar loop against BMP::BlackWhite
+// g++ -std=c++11 -O2 -pthread -I.. blackwhite.cpp -o blackwhite && ./blackwhite [width] [height] [iterations]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include "bmp.h"
+
+// Reference implementation, one pixel at a time with float weights
+static void black_white_float(uint8_t *data, const uint32_t width, const uint32_t height, const uint32_t channels,
+                              const float r = 0.33, const float g = 0.33, const float b = 0.33) {
+    for (uint32_t y = 0; y < height; ++y) {
+        for (uint32_t x = 0; x < width; ++x) {
+            uint32_t pos = channels * (y * width + x);
+            uint8_t grey = data[pos + 0] * b + data[pos + 1] * g + data[pos + 2] * r;
+            data[pos + 0] = grey;
+            data[pos + 1] = grey;
+            data[pos + 2] = grey;
+        }
+    }
+}
+
+template <typename F>
+static double time_ms(const int iterations, F f) {
+    f(); // Warm up
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        f();
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+int main(int argc, char **argv) {
+    const int32_t width = argc > 1 ? atoi(argv[1]) : 4001;
+    const int32_t height = argc > 2 ? atoi(argv[2]) : 3000;
+    const int iterations = argc > 3 ? atoi(argv[3]) : 10;
+
+    for (int has_alpha = 0; has_alpha < 2; ++has_alpha) {
+        BMP image(width, height, has_alpha);
+        std::vector<uint8_t> pixels(width * height * image.Channels());
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            pixels[i] = rand();
+        }
+        for (int32_t y = 0; y < height; ++y) {
+            for (int32_t x = 0; x < width; ++x) {
+                const uint8_t *px = &pixels[image.Channels() * (y * width + x)];
+                image.setPixel(x, y, Color(px[2], px[1], px[0], image.Channels() == 4 ? px[3] : 255));
+            }
+        }
+
+        double scalar = time_ms(iterations, [&] { black_white_float(pixels.data(), width, height, image.Channels()); });
+        double kernel = time_ms(iterations, [&] { image.BlackWhite(); });
+        double mpix = (double)width * height / 1e6;
+
+        printf("%dx%d %u channels: scalar %.2f ms (%.0f MPix/s), BlackWhite %.2f ms (%.0f MPix/s), x%.1f\n",
+               width, height, image.Channels(), scalar, mpix / scalar * 1e3, kernel, mpix / kernel * 1e3, scalar / kernel);
+    }
+    return 0;
+}
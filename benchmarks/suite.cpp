@@ -0,0 +1,247 @@
+// Benchmark suite (Google Benchmark): I/O, effects and drawing on 256 to 16384 pixels square images,
+// 24 and 32 bits, with an even width and an odd one (width + 1) whose rows go through the padding path.
+// g++ -std=c++11 -O2 -pthread -I.. suite.cpp -lbenchmark -o suite && ./suite --benchmark_filter=size:1024/
+// The 16384 images take 1 GB each at 32 bits, leave them out with --benchmark_filter when memory is short.
+// Built with -DBMP_INSTRUMENT, the totals of BMPInstrumentation are printed after the run.
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <cstdlib>
+#include "bmp.h"
+
+static const char *TempFile = "suite.bmp";
+
+// Arguments of every benchmark: size, channels and 1 for the odd width
+static void image_args(benchmark::internal::Benchmark *b) {
+    b->ArgNames({ "size", "channels", "odd" });
+    b->ArgsProduct({ { 256, 1024, 4096, 16384 }, { 3, 4 }, { 0, 1 } });
+    b->Unit(benchmark::kMillisecond);
+}
+
+// Random pixels, the same ones for each run
+static BMP make_image(const benchmark::State& state) {
+    const int32_t size = (int32_t)state.range(0);
+    BMP image(size + (int32_t)state.range(2), size, state.range(1) == 4);
+    uint32_t seed = 12345;
+    for (int32_t y = 0; y < image.height(); ++y) {
+        uint8_t *row = image.row_data(y);
+        for (uint32_t i = 0; i < image.width() * image.Channels(); ++i) {
+            seed = seed * 1664525 + 1013904223;
+            row[i] = (uint8_t)(seed >> 24);
+        }
+    }
+    return image;
+}
+
+// Bytes, items (pixels) and MPix per second of the iterations run on image
+static void set_counters(benchmark::State& state, const BMP& image) {
+    const int64_t pixels = (int64_t)image.width() * image.height();
+    state.SetBytesProcessed(state.iterations() * pixels * image.Channels());
+    state.SetItemsProcessed(state.iterations() * pixels);
+    state.counters["MPix"] = benchmark::Counter((double)state.iterations() * pixels / 1e6, benchmark::Counter::kIsRate);
+}
+
+/// I/O
+
+static void BM_Write(benchmark::State& state) {
+    BMP image = make_image(state);
+    std::vector<uint8_t> scratch;
+    for (auto _ : state) {
+        image.write(TempFile, scratch);
+    }
+    set_counters(state, image);
+    remove(TempFile);
+}
+BENCHMARK(BM_Write)->Apply(image_args);
+
+static void BM_Read(benchmark::State& state) {
+    BMP image = make_image(state);
+    image.write(TempFile);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(image.read(TempFile));
+    }
+    set_counters(state, image);
+    remove(TempFile);
+}
+BENCHMARK(BM_Read)->Apply(image_args);
+
+static void BM_Encode(benchmark::State& state) {
+    BMP image = make_image(state);
+    std::vector<uint8_t> file(image.encoded_size());
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(image.encode_into(file.data(), file.size()));
+    }
+    set_counters(state, image);
+}
+BENCHMARK(BM_Encode)->Apply(image_args);
+
+static void BM_Decode(benchmark::State& state) {
+    BMP image = make_image(state);
+    std::vector<uint8_t> file;
+    image.encode(file);
+    for (auto _ : state) {
+        BMP decoded = BMP::decode(file.data(), file.size());
+        benchmark::DoNotOptimize(decoded.row_data(0));
+    }
+    set_counters(state, image);
+}
+BENCHMARK(BM_Decode)->Apply(image_args);
+
+/// Effects
+
+static void BM_BlackWhite(benchmark::State& state) {
+    BMP image = make_image(state);
+    for (auto _ : state) {
+        image.BlackWhite();
+    }
+    set_counters(state, image);
+}
+BENCHMARK(BM_BlackWhite)->Apply(image_args);
+
+static void BM_FlipX(benchmark::State& state) {
+    BMP image = make_image(state);
+    for (auto _ : state) {
+        image.FlipX();
+    }
+    set_counters(state, image);
+}
+BENCHMARK(BM_FlipX)->Apply(image_args);
+
+static void BM_FlipY(benchmark::State& state) {
+    BMP image = make_image(state);
+    for (auto _ : state) {
+        image.FlipY();
+    }
+    set_counters(state, image);
+}
+BENCHMARK(BM_FlipY)->Apply(image_args);
+
+static void BM_Rotate90(benchmark::State& state) {
+    BMP image = make_image(state);
+    for (auto _ : state) {
+        image.Rotate90();
+    }
+    set_counters(state, image);
+}
+BENCHMARK(BM_Rotate90)->Apply(image_args);
+
+// Halving, counted on the source pixels
+static void BM_Resize(benchmark::State& state) {
+    BMP image = make_image(state);
+    for (auto _ : state) {
+        BMP resized = image.Resize(image.width() / 2, image.height() / 2);
+        benchmark::DoNotOptimize(resized.row_data(0));
+    }
+    set_counters(state, image);
+}
+BENCHMARK(BM_Resize)->Apply(image_args);
+
+static void BM_GaussianBlur(benchmark::State& state) {
+    BMP image = make_image(state);
+    for (auto _ : state) {
+        image.GaussianBlur(2.0f);
+    }
+    set_counters(state, image);
+}
+BENCHMARK(BM_GaussianBlur)->Apply(image_args);
+
+static void BM_ApplyLUT(benchmark::State& state) {
+    BMP image = make_image(state);
+    std::array<uint8_t, 256> lut;
+    for (int v = 0; v < 256; ++v) {
+        lut[v] = (uint8_t)(255 - v);
+    }
+    for (auto _ : state) {
+        image.ApplyLUT(lut);
+    }
+    set_counters(state, image);
+}
+BENCHMARK(BM_ApplyLUT)->Apply(image_args);
+
+static void BM_Histogram(benchmark::State& state) {
+    BMP image = make_image(state);
+    for (auto _ : state) {
+        BMPHistogram histogram = image.Histogram();
+        benchmark::DoNotOptimize(histogram.pixels);
+    }
+    set_counters(state, image);
+}
+BENCHMARK(BM_Histogram)->Apply(image_args);
+
+/// Drawing, the shapes cross the whole image so the counters are per image pixel
+
+static void BM_DrawLine(benchmark::State& state) {
+    BMP image = make_image(state);
+    bmpDrawer drawer(&image);
+    const int32_t w = image.width(), h = image.height();
+    for (auto _ : state) {
+        for (int32_t i = 0; i < 16; ++i) {
+            drawer.drawLine(0, h * i / 16, w - 1, h - 1 - h * i / 16, Color(255, 0, 0));
+        }
+    }
+    set_counters(state, image);
+}
+BENCHMARK(BM_DrawLine)->Apply(image_args);
+
+static void BM_DrawLineAA(benchmark::State& state) {
+    BMP image = make_image(state);
+    bmpDrawer drawer(&image);
+    const int32_t w = image.width(), h = image.height();
+    for (auto _ : state) {
+        for (int32_t i = 0; i < 16; ++i) {
+            drawer.drawLineAA(0, h * i / 16, w - 1, h - 1 - h * i / 16, Color(255, 0, 0, 128));
+        }
+    }
+    set_counters(state, image);
+}
+BENCHMARK(BM_DrawLineAA)->Apply(image_args);
+
+static void BM_FillCircle(benchmark::State& state) {
+    BMP image = make_image(state);
+    bmpDrawer drawer(&image);
+    for (auto _ : state) {
+        drawer.fillCircle(image.width() / 2, image.height() / 2, image.height() / 2, Color(0, 255, 0));
+    }
+    set_counters(state, image);
+}
+BENCHMARK(BM_FillCircle)->Apply(image_args);
+
+// A 5 pointed star, self-intersecting so the fill rule matters
+static void BM_FillPolygon(benchmark::State& state) {
+    BMP image = make_image(state);
+    bmpDrawer drawer(&image);
+    const double radius = image.height() / 2.0;
+    std::vector<Point> star;
+    for (int i = 0; i < 5; ++i) {
+        const double a = M_PI / 2 + i * 4 * M_PI / 5;
+        star.push_back(Point((uint32_t)(image.width() / 2.0 + radius * cos(a)), (uint32_t)(radius - radius * sin(a))));
+    }
+    for (auto _ : state) {
+        drawer.fillPolygon(star, Color(0, 0, 255), FillRule::EvenOdd);
+    }
+    set_counters(state, image);
+}
+BENCHMARK(BM_FillPolygon)->Apply(image_args);
+
+// Totals gathered by BMPInstrumentation during the run, there are none without BMP_INSTRUMENT
+static void print_instrumentation() {
+    std::map<std::string, BMPOpStats> totals = BMPInstrumentation::instance().totals();
+    if (totals.empty()) {
+        return;
+    }
+    printf("\n%-20s %10s %12s %10s %10s\n", "operation", "calls", "seconds", "MPix/s", "MB/s");
+    for (const auto& op : totals) {
+        printf("%-20s %10llu %12.3f %10.0f %10.0f\n", op.first.c_str(), (unsigned long long)op.second.calls,
+               op.second.nanoseconds / 1e9, op.second.mpix_per_second(), op.second.mb_per_second());
+    }
+}
+
+int main(int argc, char **argv) {
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    print_instrumentation();
+    return 0;
+}
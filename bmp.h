@@ -1,9 +1,50 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
 #include <vector>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#endif
+
 #pragma pack(push, 1)
 struct BMPFileHeader {
     uint16_t file_type{ 0x4D42 };          // File type always BM which is 0x4D42 (stored as hex uint16_t in little endian)
@@ -21,7 +62,7 @@ struct BMPInfoHeader {
                                              //       (if negative, top-down, with origin in upper left corner)
     uint16_t planes{ 1 };                    // No. of planes for the target device, this is always 1
     uint16_t bit_count{ 0 };                 // No. of bits per pixel
-    uint32_t compression{ 0 };               // 0 or 3 - uncompressed. THIS PROGRAM CONSIDERS ONLY UNCOMPRESSED BMP images
+    uint32_t compression{ 0 };               // 0 or 3 - uncompressed, 1 - RLE8, 2 - RLE4 (decoded on read, see BMPIndexed)
     uint32_t size_image{ 0 };                // 0 - for uncompressed images
     int32_t x_pixels_per_meter{ 0 };
     int32_t y_pixels_per_meter{ 0 };
@@ -111,424 +152,6085 @@ struct pixel {
     }
 };
 
-// BMP class
-class BMP {
-    public:
-        BMP(const char *fname) {
-            read(fname);
-        }
+// Rect Struct
+struct Rect {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
 
-        BMP(int32_t width, int32_t height, bool has_alpha = true) {
-            if (width <= 0 || height <= 0) {
-                std::cerr << "The image width and height must be positive numbers.\n";
-            }
+    Rect(const uint32_t x, const uint32_t y, const uint32_t width, const uint32_t height) {
+        this->x = x;
+        this->y = y;
+        this->width = width;
+        this->height = height;
+    }
+};
 
-            bmp_info_header.width = width;
-            bmp_info_header.height = height;
-            if (has_alpha) {
-                bmp_info_header.size = sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
-                file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
+// How BMP::write puts the file on disk
+enum class WriteHint {
+    Default,
+    NoCache         // Bulk exports: keep the file out of the page cache
+};
 
-                bmp_info_header.bit_count = 32;
-                bmp_info_header.compression = 3;
-                row_stride = width * 4;
-                data.resize(row_stride * height);
-                file_header.file_size = file_header.offset_data + data.size();
-            }
-            else {
-                bmp_info_header.size = sizeof(BMPInfoHeader);
-                file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
+// How BMP::blit puts the source pixels on the image
+enum class BlendMode {
+    Copy,           // Replace the pixels
+    AlphaOver,      // Source over the image with the source alpha
+    Additive        // Add the source times its alpha, saturated
+};
 
-                bmp_info_header.bit_count = 24;
-                bmp_info_header.compression = 0;
-                row_stride = width * 3;
-                data.resize(row_stride * height);
+// How the filters read the pixels past the edges
+enum class BorderMode {
+    Clamp,          // The edge pixel repeated
+    Mirror          // Reflected around the edge pixel, which is not repeated
+};
 
-                uint32_t new_stride = make_stride_aligned(4);
-                file_header.file_size = file_header.offset_data + data.size() + bmp_info_header.height * (new_stride - row_stride);
+// How BMP::Resize weighs the source pixels
+enum class Filter {
+    Box,            // Average of the pixels under the destination pixel, the fast path for 2x and 4x
+    Bilinear,       // Triangle of one destination pixel on each side
+    Lanczos         // Lanczos with 3 lobes, sharpest, can ring on hard edges
+};
+
+// How BMP holds its pixels in memory
+enum class PixelLayout {
+    Interleaved,    // BGR(A) pixels one after the other, as in the file
+    Planar          // One plane per channel (B, G, R, A), each row starting on 64 bytes
+};
+
+// Counts of each value per channel, from BMP::Histogram. The channels are in the byte order
+// of the pixels: blue, green, red and alpha (all zero for 24 bits images).
+struct BMPHistogram {
+    uint64_t count[4][256] = {};
+    uint64_t pixels{ 0 };
+
+    uint8_t min(const uint32_t channel) const {
+        for (int v = 0; v < 256; ++v) {
+            if (count[channel][v]) {
+                return (uint8_t)v;
             }
+        }
+        return 0;
+    }
 
-            channels = bmp_info_header.bit_count / 8;
+    uint8_t max(const uint32_t channel) const {
+        for (int v = 255; v >= 0; --v) {
+            if (count[channel][v]) {
+                return (uint8_t)v;
+            }
         }
-        
-        void read(const char *fname) {
-            std::ifstream inp{ fname, std::ios_base::binary };
-            if (inp) {
-                inp.read((char*)&file_header, sizeof(file_header));
-                if(file_header.file_type != 0x4D42) {
-                    std::cerr << "Error! Unrecognized file format.\n";
-                }
-                inp.read((char*)&bmp_info_header, sizeof(bmp_info_header));
+        return 0;
+    }
 
-                // The BMPColorHeader is used only for transparent images
-                if(bmp_info_header.bit_count == 32) {
-                    // Check if the file has bit mask color information
-                    if(bmp_info_header.size >= (sizeof(BMPInfoHeader) + sizeof(BMPColorHeader))) {
-                        inp.read((char*)&bmp_color_header, sizeof(bmp_color_header));
-                        // Check if the pixel data is stored as BGRA and if the color space type is sRGB
-                        check_color_header(bmp_color_header);
-                    } else {
-                        std::cerr << "Error! The file \"" << fname << "\" does not seem to contain bit mask information\n";
-                        std::cerr << "Error! Unrecognized file format.\n";
-                    }
-                }
+    double mean(const uint32_t channel) const {
+        uint64_t total = 0;
+        for (int v = 0; v < 256; ++v) {
+            total += count[channel][v] * v;
+        }
+        return pixels ? (double)total / pixels : 0.0;
+    }
 
-                // Jump to the pixel data location
-                inp.seekg(file_header.offset_data, inp.beg);
+    // The lowest value with more than fraction (0 to 1) of the pixels at or below it
+    uint8_t percentile(const uint32_t channel, const double fraction) const {
+        uint64_t sum = 0;
+        for (int v = 0; v < 256; ++v) {
+            sum += count[channel][v];
+            if (sum > fraction * pixels) {
+                return (uint8_t)v;
+            }
+        }
+        return 255;
+    }
+};
 
-                // Adjust the header fields for output.
-                // Some editors will put extra info in the image file, we only save the headers and the data.
-                if(bmp_info_header.bit_count == 32) {
-                    bmp_info_header.size = sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
-                    file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
-                } else {
-                    bmp_info_header.size = sizeof(BMPInfoHeader);
-                    file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
-                }
-                file_header.file_size = file_header.offset_data;
+// Pixel kernels
+// Every kernel has a portable scalar version, the SIMD versions are picked at runtime
+// for the instruction sets the CPU supports (SSE4.1/AVX2 on x86, NEON on ARM).
+namespace bmp_kernels {
+    // Fixed point weights for the grey scale, 1.0 is (1 << GreyShift)
+    const int GreyShift = 14;
 
-                if (bmp_info_header.height < 0) {
-                    std::cerr << "The program can treat only BMP images with the origin in the bottom left corner!\n";
-                }
+    struct GreyWeights {
+        uint16_t r;
+        uint16_t g;
+        uint16_t b;
+    };
 
-                data.resize(bmp_info_header.width * bmp_info_header.height * bmp_info_header.bit_count / 8);
+    template <uint32_t Channels>
+    inline void grey_row_scalar(uint8_t *row, const uint32_t begin, const uint32_t end, const GreyWeights& w) {
+        for (uint32_t x = begin; x < end; ++x) {
+            uint8_t *px = row + Channels * x;
+            uint32_t grey = (px[0] * w.b + px[1] * w.g + px[2] * w.r) >> GreyShift;
+            if (grey > 255) {
+                grey = 255;
+            }
+            px[0] = grey; // blue
+            px[1] = grey; // green
+            px[2] = grey; // red
+        }
+    }
 
-                // Here we check if we need to take into account row padding
-                if (bmp_info_header.width % 4 == 0) {
-                    inp.read((char*)data.data(), data.size());
-                    file_header.file_size += data.size();
-                }
-                else {
-                    row_stride = bmp_info_header.width * bmp_info_header.bit_count / 8;
-                    uint32_t new_stride = make_stride_aligned(4);
-                    std::vector<uint8_t> padding_row(new_stride - row_stride);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BMP_KERNELS_X86
+    // 4 pixels of BGRA widened to 16 bits -> grey value in the low byte of each 32 bits lane
+    __attribute__((target("sse4.1")))
+    inline __m128i grey4_sse41(const __m128i bgra, const __m128i w) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(bgra, zero), w);
+        __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(bgra, zero), w);
+        __m128i sum = _mm_srli_epi32(_mm_hadd_epi32(lo, hi), GreyShift);
+        __m128i grey = _mm_packus_epi32(sum, sum);
+        return _mm_packus_epi16(grey, grey);
+    }
 
-                    for (int y = 0; y < bmp_info_header.height; ++y) {
-                        inp.read((char*)(data.data() + row_stride * y), row_stride);
-                        inp.read((char*)padding_row.data(), padding_row.size());
-                    }
-                    file_header.file_size += data.size() + bmp_info_header.height * padding_row.size();
-                }
+    // Write 16 grey values as 16 BGR pixels (48 bytes)
+    __attribute__((target("sse4.1")))
+    inline void grey3_store16(uint8_t *p, const __m128i grey) {
+        _mm_storeu_si128((__m128i*)p, _mm_shuffle_epi8(grey, _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5)));
+        _mm_storeu_si128((__m128i*)(p + 16), _mm_shuffle_epi8(grey, _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10)));
+        _mm_storeu_si128((__m128i*)(p + 32), _mm_shuffle_epi8(grey, _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15)));
+    }
 
-                channels = bmp_info_header.bit_count / 8;
+    template <uint32_t Channels>
+    __attribute__((target("sse4.1")))
+    inline void grey_row_sse41(uint8_t *row, const uint32_t width, const GreyWeights& w) {
+        const __m128i weights = _mm_setr_epi16(w.b, w.g, w.r, 0, w.b, w.g, w.r, 0);
+        uint32_t x = 0;
+        if (Channels == 4) {
+            const __m128i spread = _mm_setr_epi8(0, 0, 0, -1, 1, 1, 1, -1, 2, 2, 2, -1, 3, 3, 3, -1);
+            const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+            for (; x + 4 <= width; x += 4) {
+                __m128i *p = (__m128i*)(row + 4 * x);
+                __m128i v = _mm_loadu_si128(p);
+                __m128i grey = _mm_shuffle_epi8(grey4_sse41(v, weights), spread);
+                _mm_storeu_si128(p, _mm_or_si128(grey, _mm_and_si128(v, alpha)));
             }
-            else {
-                std::cerr << "Unable to open the input image file.\n";
+        } else {
+            // 16 pixels (48 bytes) per step, read as 4 groups of 12 bytes and written back
+            // as 3 full vectors, so no store overlaps the next loads
+            const __m128i expand = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+            const __m128i expand_last = _mm_setr_epi8(4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15, -1);
+            for (; x + 16 <= width; x += 16) {
+                uint8_t *p = row + 3 * x;
+                __m128i g0 = grey4_sse41(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), expand), weights);
+                __m128i g1 = grey4_sse41(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 12)), expand), weights);
+                __m128i g2 = grey4_sse41(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 24)), expand), weights);
+                __m128i g3 = grey4_sse41(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 32)), expand_last), weights);
+                grey3_store16(p, _mm_unpacklo_epi64(_mm_unpacklo_epi32(g0, g1), _mm_unpacklo_epi32(g2, g3)));
             }
         }
+        grey_row_scalar<Channels>(row, x, width, w);
+    }
 
-        void write(const char *fname) {
-            std::ofstream of{ fname, std::ios_base::binary };
-            if (of) {
-                if (bmp_info_header.bit_count == 32) {
-                    write_headers_and_data(of);
-                }
-                else if (bmp_info_header.bit_count == 24) {
-                    if (bmp_info_header.width % 4 == 0) {
-                        write_headers_and_data(of);
-                    }
-                    else {
-                        uint32_t new_stride = make_stride_aligned(4);
-                        std::vector<uint8_t> padding_row(new_stride - row_stride);
-
-                        write_headers(of);
+    __attribute__((target("avx2")))
+    inline __m256i grey8_avx2(const __m256i bgra, const __m256i w) {
+        __m256i zero = _mm256_setzero_si256();
+        __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(bgra, zero), w);
+        __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(bgra, zero), w);
+        __m256i sum = _mm256_srli_epi32(_mm256_hadd_epi32(lo, hi), GreyShift);
+        __m256i grey = _mm256_packus_epi32(sum, sum);
+        return _mm256_packus_epi16(grey, grey);
+    }
 
-                        for (int y = 0; y < bmp_info_header.height; ++y) {
-                            of.write((const char*)(data.data() + row_stride * y), row_stride);
-                            of.write((const char*)padding_row.data(), padding_row.size());
-                        }
-                    }
-                }
-                else {
-                    std::cerr << "The program can treat only 24 or 32 bits per pixel BMP files\n";
-                }
+    template <uint32_t Channels>
+    __attribute__((target("avx2")))
+    inline void grey_row_avx2(uint8_t *row, const uint32_t width, const GreyWeights& w) {
+        const __m256i weights = _mm256_setr_epi16(w.b, w.g, w.r, 0, w.b, w.g, w.r, 0, w.b, w.g, w.r, 0, w.b, w.g, w.r, 0);
+        uint32_t x = 0;
+        if (Channels == 4) {
+            const __m256i spread = _mm256_setr_epi8(0, 0, 0, -1, 1, 1, 1, -1, 2, 2, 2, -1, 3, 3, 3, -1,
+                                                    0, 0, 0, -1, 1, 1, 1, -1, 2, 2, 2, -1, 3, 3, 3, -1);
+            const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+            for (; x + 8 <= width; x += 8) {
+                __m256i *p = (__m256i*)(row + 4 * x);
+                __m256i v = _mm256_loadu_si256(p);
+                __m256i grey = _mm256_shuffle_epi8(grey8_avx2(v, weights), spread);
+                _mm256_storeu_si256(p, _mm256_or_si256(grey, _mm256_and_si256(v, alpha)));
             }
-            else {
-                std::cerr << "Unable to open the output image file.\n";
+        } else {
+            // 16 pixels (48 bytes) per step, 4 groups of 12 bytes, one per 128 bits lane
+            const __m256i expand = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                                    0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+            const __m256i expand_last = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                                         4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15, -1);
+            const __m256i gather = _mm256_setr_epi32(0, 4, 0, 4, 0, 4, 0, 4);
+            for (; x + 16 <= width; x += 16) {
+                uint8_t *p = row + 3 * x;
+                __m256i v0 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)),
+                                                     _mm_loadu_si128((const __m128i*)(p + 12)), 1);
+                __m256i v1 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(p + 24))),
+                                                     _mm_loadu_si128((const __m128i*)(p + 32)), 1);
+                // Grey values of each lane are in its low 4 bytes, bring the 8 of them together
+                __m256i g0 = _mm256_permutevar8x32_epi32(grey8_avx2(_mm256_shuffle_epi8(v0, expand), weights), gather);
+                __m256i g1 = _mm256_permutevar8x32_epi32(grey8_avx2(_mm256_shuffle_epi8(v1, expand_last), weights), gather);
+                grey3_store16(p, _mm_unpacklo_epi64(_mm256_castsi256_si128(g0), _mm256_castsi256_si128(g1)));
             }
         }
+        grey_row_scalar<Channels>(row, x, width, w);
+    }
+#endif
 
-        int32_t width() const {
-            return bmp_info_header.width;
+#if defined(__ARM_NEON)
+#define BMP_KERNELS_NEON
+    inline uint8x8_t grey8_neon(const uint8x8_t b8, const uint8x8_t g8, const uint8x8_t r8, const GreyWeights& w) {
+        uint16x8_t b = vmovl_u8(b8), g = vmovl_u8(g8), r = vmovl_u8(r8);
+        uint32x4_t lo = vmull_n_u16(vget_low_u16(b), w.b);
+        lo = vmlal_n_u16(lo, vget_low_u16(g), w.g);
+        lo = vmlal_n_u16(lo, vget_low_u16(r), w.r);
+        uint32x4_t hi = vmull_n_u16(vget_high_u16(b), w.b);
+        hi = vmlal_n_u16(hi, vget_high_u16(g), w.g);
+        hi = vmlal_n_u16(hi, vget_high_u16(r), w.r);
+        return vqmovn_u16(vcombine_u16(vqshrn_n_u32(lo, GreyShift), vqshrn_n_u32(hi, GreyShift)));
+    }
+
+    template <uint32_t Channels>
+    inline void grey_row_neon(uint8_t *row, const uint32_t width, const GreyWeights& w) {
+        uint32_t x = 0;
+        if (Channels == 4) {
+            for (; x + 8 <= width; x += 8) {
+                uint8x8x4_t px = vld4_u8(row + 4 * x);
+                uint8x8_t grey = grey8_neon(px.val[0], px.val[1], px.val[2], w);
+                px.val[0] = px.val[1] = px.val[2] = grey;
+                vst4_u8(row + 4 * x, px);
+            }
+        } else {
+            for (; x + 8 <= width; x += 8) {
+                uint8x8x3_t px = vld3_u8(row + 3 * x);
+                uint8x8_t grey = grey8_neon(px.val[0], px.val[1], px.val[2], w);
+                px.val[0] = px.val[1] = px.val[2] = grey;
+                vst3_u8(row + 3 * x, px);
+            }
         }
+        grey_row_scalar<Channels>(row, x, width, w);
+    }
+#endif
 
-        int32_t height() const {
-            return bmp_info_header.height;
+    template <uint32_t Channels>
+    inline void grey_row_portable(uint8_t *row, const uint32_t width, const GreyWeights& w) {
+        grey_row_scalar<Channels>(row, 0, width, w);
+    }
+
+    typedef void (*GreyRowKernel)(uint8_t *row, const uint32_t width, const GreyWeights& w);
+
+    template <uint32_t Channels>
+    inline GreyRowKernel select_grey_row() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return grey_row_avx2<Channels>;
         }
-        
-        uint32_t Channels() const {
-            return channels;
+        if (__builtin_cpu_supports("sse4.1")) {
+            return grey_row_sse41<Channels>;
         }
-        
-        Color getPixel(const uint32_t x, const uint32_t y) const {
-            if (x < 0 || x > (uint32_t)bmp_info_header.width || y < 0 || y > (uint32_t)bmp_info_header.height) {
-                std::cerr << "setPixel error: Pixel is outside!\n";
-            }
+#elif defined(BMP_KERNELS_NEON)
+        return grey_row_neon<Channels>;
+#endif
+        return grey_row_portable<Channels>;
+    }
 
-            uint32_t pos = channels * (y * bmp_info_header.width + x);
-            Color c(data[pos + 2], data[pos + 1], data[pos + 0]);
-            if (channels == 4) {
-                c.alpha = data[pos + 3];
-            }
+    // Grey scale a row of width pixels with the best kernel available
+    template <uint32_t Channels>
+    inline void grey_row(uint8_t *row, const uint32_t width, const GreyWeights& w) {
+        static const GreyRowKernel kernel = select_grey_row<Channels>();
+        kernel(row, width, w);
+    }
 
-            return c;
-        }
+    // Reverse the order of the pixels of a row (FlipX)
 
-        void setPixel(const uint32_t x, const uint32_t y, const Color& c) {
-            if (x < 0 || x > (uint32_t)bmp_info_header.width || y < 0 || y > (uint32_t)bmp_info_header.height) {
-                std::cerr << "setPixel error: Pixel is outside!\n";
+    // Swap the pixels of [begin, end) end to end, for the middle of the row the SIMD loops leave
+    template <uint32_t Channels>
+    inline void reverse_row_scalar(uint8_t *row, uint32_t begin, uint32_t end) {
+        while (end > begin + 1) {
+            --end;
+            uint8_t *px1 = row + Channels * begin;
+            uint8_t *px2 = row + Channels * end;
+            for (uint32_t c = 0; c < Channels; ++c) {
+                uint8_t aux = px1[c];
+                px1[c] = px2[c];
+                px2[c] = aux;
             }
+            ++begin;
+        }
+    }
 
-            uint32_t pos = channels * (y * bmp_info_header.width + x);
-            data[pos + 0] = c.b;
-            data[pos + 1] = c.g;
-            data[pos + 2] = c.r;
-            if (channels == 4) {
-                data[pos + 3] = c.alpha;
+#if defined(BMP_KERNELS_X86)
+    // Shuffle masks reversing 16 BGR pixels held in 3 vectors: output vector k takes
+    // from input vector v the bytes given by masks[k][v] (-1 for the bytes it does not give)
+    struct Reverse3Masks {
+        int8_t masks[3][3][16];
+
+        Reverse3Masks() {
+            for (int k = 0; k < 3; ++k) {
+                for (int v = 0; v < 3; ++v) {
+                    for (int b = 0; b < 16; ++b) {
+                        int pixel = (16 * k + b) / 3;
+                        int in = 3 * (15 - pixel) + (16 * k + b) % 3;
+                        masks[k][v][b] = (in / 16 == v) ? in % 16 : -1;
+                    }
+                }
             }
         }
+    };
 
-        void clear(const uint8_t c) {
-            std::fill(data.begin(),data.end(), c);
+    __attribute__((target("sse4.1")))
+    inline void reverse16x3_sse41(const __m128i *in, __m128i *out, const Reverse3Masks& m) {
+        __m128i v0 = _mm_loadu_si128(in), v1 = _mm_loadu_si128(in + 1), v2 = _mm_loadu_si128(in + 2);
+        for (int k = 0; k < 3; ++k) {
+            out[k] = _mm_or_si128(_mm_shuffle_epi8(v0, _mm_loadu_si128((const __m128i*)m.masks[k][0])),
+                     _mm_or_si128(_mm_shuffle_epi8(v1, _mm_loadu_si128((const __m128i*)m.masks[k][1])),
+                                  _mm_shuffle_epi8(v2, _mm_loadu_si128((const __m128i*)m.masks[k][2]))));
         }
+    }
 
-        void CopyFrom(BMP& image) {
-            if (image.channels == channels && image.height() == bmp_info_header.height && image.width() == bmp_info_header.width) { // Can copy
-                data = image.data;
-            } else {
-                std::cerr << "CopyFrom error!\n";
+    __attribute__((target("sse4.1")))
+    inline void reverse_row3_sse41(uint8_t *row, uint32_t& left, uint32_t& right) {
+        static const Reverse3Masks masks;
+        // 16 pixels (48 bytes) taken from each end per step
+        for (; left + 32 <= right; left += 16, right -= 16) {
+            __m128i *p1 = (__m128i*)(row + 3 * left);
+            __m128i *p2 = (__m128i*)(row + 3 * (right - 16));
+            __m128i r1[3], r2[3];
+            reverse16x3_sse41(p1, r1, masks);
+            reverse16x3_sse41(p2, r2, masks);
+            for (int k = 0; k < 3; ++k) {
+                _mm_storeu_si128(p1 + k, r2[k]);
+                _mm_storeu_si128(p2 + k, r1[k]);
             }
         }
+    }
 
-        /// Effects
-
-        void BlackWhite(const float r = 0.33, const float g = 0.33, const float b = 0.33) {
-            if (r + g + b > 1) {
-                std::cerr << "BlackWhite error: Invalid grey scale\n";
+    template <uint32_t Channels>
+    __attribute__((target("sse4.1")))
+    inline void reverse_row_sse41(uint8_t *row, const uint32_t width) {
+        uint32_t left = 0, right = width;
+        if (Channels == 4) {
+            for (; left + 8 <= right; left += 4, right -= 4) {
+                __m128i *p1 = (__m128i*)(row + 4 * left);
+                __m128i *p2 = (__m128i*)(row + 4 * (right - 4));
+                __m128i v1 = _mm_shuffle_epi32(_mm_loadu_si128(p1), 0x1B);
+                __m128i v2 = _mm_shuffle_epi32(_mm_loadu_si128(p2), 0x1B);
+                _mm_storeu_si128(p1, v2);
+                _mm_storeu_si128(p2, v1);
             }
+        } else {
+            reverse_row3_sse41(row, left, right);
+        }
+        reverse_row_scalar<Channels>(row, left, right);
+    }
 
-            for (uint32_t y = 0; y < bmp_info_header.height; ++y) {
-                for (uint32_t x = 0; x < bmp_info_header.width; ++x) {
-                    uint32_t pos = channels * (y * bmp_info_header.width + x);
-                    uint8_t grey = data[pos + 0] * b + data[pos + 1] * g + data[pos + 2] * r;
-                    data[pos + 0] = grey; // blue
-                    data[pos + 1] = grey; // green
-                    data[pos + 2] = grey; // red
-                }
+    template <uint32_t Channels>
+    __attribute__((target("avx2")))
+    inline void reverse_row_avx2(uint8_t *row, const uint32_t width) {
+        uint32_t left = 0, right = width;
+        if (Channels == 4) {
+            const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+            for (; left + 16 <= right; left += 8, right -= 8) {
+                __m256i *p1 = (__m256i*)(row + 4 * left);
+                __m256i *p2 = (__m256i*)(row + 4 * (right - 8));
+                __m256i v1 = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(p1), reverse);
+                __m256i v2 = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(p2), reverse);
+                _mm256_storeu_si256(p1, v2);
+                _mm256_storeu_si256(p2, v1);
             }
+        } else {
+            // 3 bytes pixels do not split evenly in 256 bits lanes, the 128 bits shuffles are used
+            reverse_row3_sse41(row, left, right);
         }
+        reverse_row_scalar<Channels>(row, left, right);
+    }
+#endif
 
-        void FlipX() {
-            for (uint32_t y = 0; y < (uint32_t)bmp_info_header.height; y++) {
-                for(uint32_t x = 0; x < (uint32_t)bmp_info_header.width/2; x++) {
-                    uint32_t pos1 = channels * (y * bmp_info_header.width + x);
-                    uint32_t pos2 = channels * (y * bmp_info_header.width + bmp_info_header.width - 1 - x);
-                    
-                    // Save color of one of both pixel
-                    Color aux(data[pos1 + 2], data[pos1 + 1], data[pos1 + 0]);
+#if defined(BMP_KERNELS_NEON)
+    inline uint8x16_t reverse16_neon(const uint8x16_t v) {
+        uint8x16_t r = vrev64q_u8(v);
+        return vcombine_u8(vget_high_u8(r), vget_low_u8(r));
+    }
 
-                    // Exchange
-                    data[pos1 + 0] = data[pos2 + 0];
-                    data[pos1 + 1] = data[pos2 + 1];
-                    data[pos1 + 2] = data[pos2 + 2];
+    template <uint32_t Channels>
+    inline void reverse_row_neon(uint8_t *row, const uint32_t width) {
+        uint32_t left = 0, right = width;
+        if (Channels == 4) {
+            for (; left + 8 <= right; left += 4, right -= 4) {
+                uint32_t *p1 = (uint32_t*)(row + 4 * left);
+                uint32_t *p2 = (uint32_t*)(row + 4 * (right - 4));
+                uint32x4_t v1 = vrev64q_u32(vld1q_u32(p1));
+                uint32x4_t v2 = vrev64q_u32(vld1q_u32(p2));
+                vst1q_u32(p1, vcombine_u32(vget_high_u32(v2), vget_low_u32(v2)));
+                vst1q_u32(p2, vcombine_u32(vget_high_u32(v1), vget_low_u32(v1)));
+            }
+        } else {
+            for (; left + 32 <= right; left += 16, right -= 16) {
+                uint8_t *p1 = row + 3 * left;
+                uint8_t *p2 = row + 3 * (right - 16);
+                uint8x16x3_t v1 = vld3q_u8(p1), v2 = vld3q_u8(p2);
+                for (int c = 0; c < 3; ++c) {
+                    uint8x16_t aux = reverse16_neon(v1.val[c]);
+                    v1.val[c] = reverse16_neon(v2.val[c]);
+                    v2.val[c] = aux;
+                }
+                vst3q_u8(p1, v1);
+                vst3q_u8(p2, v2);
+            }
+        }
+        reverse_row_scalar<Channels>(row, left, right);
+    }
+#endif
 
-                    data[pos2 + 0] = aux.b;
-                    data[pos2 + 1] = aux.g;
-                    data[pos2 + 2] = aux.r;
+    template <uint32_t Channels>
+    inline void reverse_row_portable(uint8_t *row, const uint32_t width) {
+        reverse_row_scalar<Channels>(row, 0, width);
+    }
 
+    typedef void (*ReverseRowKernel)(uint8_t *row, const uint32_t width);
 
-                    if (channels == 4) {
-                        aux.alpha = data[pos1 + 3];
-                        data[pos1 + 3] = data[pos2 + 3];
-                        data[pos2 + 3] = aux.alpha;
-                    }
-                }
-            }
+    template <uint32_t Channels>
+    inline ReverseRowKernel select_reverse_row() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return reverse_row_avx2<Channels>;
         }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return reverse_row_sse41<Channels>;
+        }
+#elif defined(BMP_KERNELS_NEON)
+        return reverse_row_neon<Channels>;
+#endif
+        return reverse_row_portable<Channels>;
+    }
 
-        void FlipY() {
-            for (uint32_t x = 0; x < (uint32_t)bmp_info_header.width; x++) {
-                for (uint32_t y = 0; y < (uint32_t)bmp_info_header.height/2; y++) {
-                    uint32_t pos1 = channels * (y * bmp_info_header.width + x);
-                    uint32_t pos2 = channels * ((bmp_info_header.height - 1 - y) * bmp_info_header.width + x);
-                    
-                    // Save color of one of both pixel
-                    Color aux(data[pos1 + 2], data[pos1 + 1], data[pos1 + 0]);
+    // Reverse a row of width pixels with the best kernel available
+    template <uint32_t Channels>
+    inline void reverse_row(uint8_t *row, const uint32_t width) {
+        static const ReverseRowKernel kernel = select_reverse_row<Channels>();
+        kernel(row, width);
+    }
 
-                    // Exchange
-                    data[pos1 + 0] = data[pos2 + 0];
-                    data[pos1 + 1] = data[pos2 + 1];
-                    data[pos1 + 2] = data[pos2 + 2];
+    // Fill a row with one pixel value
 
-                    data[pos2 + 0] = aux.b;
-                    data[pos2 + 1] = aux.g;
-                    data[pos2 + 2] = aux.r;
+    // A block of whole pixels that is also a whole number of vectors (192 = 3 * 64 = 4 * 48),
+    // copied with fixed size memcpy calls the compiler turns into vector stores
+    struct RowPattern {
+        uint8_t block[192];
+        bool uniform;                   // All the bytes of the pixel are the same, memset does the job
+    };
 
+    template <uint32_t Channels>
+    inline RowPattern make_row_pattern(const uint8_t *px) {
+        RowPattern pattern;
+        pattern.uniform = true;
+        for (uint32_t c = 1; c < Channels; ++c) {
+            pattern.uniform = pattern.uniform && px[c] == px[0];
+        }
+        for (uint32_t i = 0; i < sizeof(pattern.block); i += Channels) {
+            memcpy(pattern.block + i, px, Channels);
+        }
+        return pattern;
+    }
 
-                    if (channels == 4) {
-                        aux.alpha = data[pos1 + 3];
-                        data[pos1 + 3] = data[pos2 + 3];
-                        data[pos2 + 3] = aux.alpha;
-                    }
-                }
-            }
+    template <uint32_t Channels>
+    inline void fill_row(uint8_t *dst, const uint32_t count, const RowPattern& pattern) {
+        size_t bytes = (size_t)Channels * count;
+        if (pattern.uniform) {
+            memset(dst, pattern.block[0], bytes);
+            return;
         }
+        size_t i = 0;
+        for (; i + sizeof(pattern.block) <= bytes; i += sizeof(pattern.block)) {
+            memcpy(dst + i, pattern.block, sizeof(pattern.block));
+        }
+        memcpy(dst + i, pattern.block, bytes - i);
+    }
 
-    private:
+    // Blend a constant color over a row: dst = (src * alpha + dst * (255 - alpha)) / 255, rounded.
+    // The pattern holds the color with an alpha byte of 255, so the alpha channel gets the over operator too.
 
-        BMPFileHeader file_header;
-        BMPInfoHeader bmp_info_header;
-        BMPColorHeader bmp_color_header;
-        std::vector<uint8_t> data;
+    inline uint8_t blend_byte(const uint8_t dst, const uint8_t src, const uint32_t alpha) {
+        uint32_t x = src * alpha + dst * (255 - alpha) + 128;
+        return (x + (x >> 8)) >> 8;
+    }
 
-        uint32_t channels;
+    inline void blend_bytes_scalar(uint8_t *dst, const size_t bytes, const uint8_t *src, const uint32_t alpha) {
+        for (size_t i = 0; i < bytes; ++i) {
+            dst[i] = blend_byte(dst[i], src[i], alpha);
+        }
+    }
 
-        const int MaxList = 10;
-        
-        uint32_t row_stride{ 0 };
+    template <uint32_t Channels>
+    inline void blend_pixel(uint8_t *dst, const uint8_t *px, const uint32_t alpha) {
+        blend_bytes_scalar(dst, Channels, px, alpha);
+    }
 
-        void write_headers(std::ofstream &of) {
-            of.write((const char*)&file_header, sizeof(file_header));
-            of.write((const char*)&bmp_info_header, sizeof(bmp_info_header));
-            if(bmp_info_header.bit_count == 32) {
-                of.write((const char*)&bmp_color_header, sizeof(bmp_color_header));
+#if defined(BMP_KERNELS_X86)
+    // 16 bytes, src is the pattern already multiplied by alpha plus 128, in 16 bits
+    __attribute__((target("sse4.1")))
+    inline void blend16_sse41(uint8_t *p, const __m128i src_lo, const __m128i src_hi, const __m128i inv) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i div = _mm_set1_epi16(257);
+        __m128i d = _mm_loadu_si128((const __m128i*)p);
+        __m128i lo = _mm_add_epi16(src_lo, _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inv));
+        __m128i hi = _mm_add_epi16(src_hi, _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inv));
+        _mm_storeu_si128((__m128i*)p, _mm_packus_epi16(_mm_mulhi_epu16(lo, div), _mm_mulhi_epu16(hi, div)));
+    }
+
+    template <uint32_t Channels>
+    __attribute__((target("sse4.1")))
+    inline void blend_row_sse41(uint8_t *dst, const uint32_t count, const RowPattern& pattern, const uint32_t alpha) {
+        const uint32_t vectors = Channels == 4 ? 1 : 3;         // The pattern repeats every 16 or 48 bytes
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i a = _mm_set1_epi16(alpha), round = _mm_set1_epi16(128);
+        const __m128i inv = _mm_set1_epi16(255 - alpha);
+        __m128i src_lo[3], src_hi[3];
+        for (uint32_t v = 0; v < vectors; ++v) {
+            __m128i s = _mm_loadu_si128((const __m128i*)(pattern.block + 16 * v));
+            src_lo[v] = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), a), round);
+            src_hi[v] = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), a), round);
+        }
+        size_t bytes = (size_t)Channels * count, i = 0;
+        for (; i + 16 * vectors <= bytes; i += 16 * vectors) {
+            for (uint32_t v = 0; v < vectors; ++v) {
+                blend16_sse41(dst + i + 16 * v, src_lo[v], src_hi[v], inv);
             }
         }
+        blend_bytes_scalar(dst + i, bytes - i, pattern.block, alpha);
+    }
 
-        void write_headers_and_data(std::ofstream &of) {
-            write_headers(of);
-            of.write((const char*)data.data(), data.size());
-        }
+    __attribute__((target("avx2")))
+    inline void blend32_avx2(uint8_t *p, const __m256i src_lo, const __m256i src_hi, const __m256i inv) {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i div = _mm256_set1_epi16(257);
+        __m256i d = _mm256_loadu_si256((const __m256i*)p);
+        __m256i lo = _mm256_add_epi16(src_lo, _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), inv));
+        __m256i hi = _mm256_add_epi16(src_hi, _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), inv));
+        _mm256_storeu_si256((__m256i*)p, _mm256_packus_epi16(_mm256_mulhi_epu16(lo, div), _mm256_mulhi_epu16(hi, div)));
+    }
 
-        // Add 1 to the row_stride until it is divisible with align_stride
-        uint32_t make_stride_aligned(uint32_t align_stride) {
-            uint32_t new_stride = row_stride;
-            while (new_stride % align_stride != 0) {
-                new_stride++;
+    template <uint32_t Channels>
+    __attribute__((target("avx2")))
+    inline void blend_row_avx2(uint8_t *dst, const uint32_t count, const RowPattern& pattern, const uint32_t alpha) {
+        const uint32_t vectors = Channels == 4 ? 1 : 3;         // The pattern repeats every 32 or 96 bytes
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i a = _mm256_set1_epi16(alpha), round = _mm256_set1_epi16(128);
+        const __m256i inv = _mm256_set1_epi16(255 - alpha);
+        __m256i src_lo[3], src_hi[3];
+        for (uint32_t v = 0; v < vectors; ++v) {
+            __m256i s = _mm256_loadu_si256((const __m256i*)(pattern.block + 32 * v));
+            src_lo[v] = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(s, zero), a), round);
+            src_hi[v] = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(s, zero), a), round);
+        }
+        size_t bytes = (size_t)Channels * count, i = 0;
+        for (; i + 32 * vectors <= bytes; i += 32 * vectors) {
+            for (uint32_t v = 0; v < vectors; ++v) {
+                blend32_avx2(dst + i + 32 * v, src_lo[v], src_hi[v], inv);
             }
-            return new_stride;
         }
+        blend_bytes_scalar(dst + i, bytes - i, pattern.block, alpha);
+    }
+#endif
 
-        // Check if the pixel data is stored as BGRA and if the color space type is sRGB
-        void check_color_header(BMPColorHeader &bmp_color_header) {
-            BMPColorHeader expected_color_header;
-            if(expected_color_header.red_mask != bmp_color_header.red_mask ||
-                expected_color_header.blue_mask != bmp_color_header.blue_mask ||
-                expected_color_header.green_mask != bmp_color_header.green_mask ||
-                expected_color_header.alpha_mask != bmp_color_header.alpha_mask) {
-                    std::cerr << "Unexpected color mask format! The program expects the pixel data to be in the BGRA format\n";
-            }
-            if(expected_color_header.color_space_type != bmp_color_header.color_space_type) {
-                std::cerr << "Unexpected color space type! The program expects sRGB values\n";
+#if defined(BMP_KERNELS_NEON)
+    template <uint32_t Channels>
+    inline void blend_row_neon(uint8_t *dst, const uint32_t count, const RowPattern& pattern, const uint32_t alpha) {
+        const uint32_t vectors = Channels == 4 ? 1 : 3;
+        const uint8x8_t inv = vdup_n_u8(255 - alpha);
+        uint16x8_t src_lo[3], src_hi[3];
+        for (uint32_t v = 0; v < vectors; ++v) {
+            uint8x16_t s = vld1q_u8(pattern.block + 16 * v);
+            src_lo[v] = vaddq_u16(vmull_u8(vget_low_u8(s), vdup_n_u8(alpha)), vdupq_n_u16(128));
+            src_hi[v] = vaddq_u16(vmull_u8(vget_high_u8(s), vdup_n_u8(alpha)), vdupq_n_u16(128));
+        }
+        size_t bytes = (size_t)Channels * count, i = 0;
+        for (; i + 16 * vectors <= bytes; i += 16 * vectors) {
+            for (uint32_t v = 0; v < vectors; ++v) {
+                uint8_t *p = dst + i + 16 * v;
+                uint8x16_t d = vld1q_u8(p);
+                uint16x8_t lo = vmlal_u8(src_lo[v], vget_low_u8(d), inv);
+                uint16x8_t hi = vmlal_u8(src_hi[v], vget_high_u8(d), inv);
+                vst1q_u8(p, vcombine_u8(vshrn_n_u16(vsraq_n_u16(lo, lo, 8), 8), vshrn_n_u16(vsraq_n_u16(hi, hi, 8), 8)));
             }
         }
-};
+        blend_bytes_scalar(dst + i, bytes - i, pattern.block, alpha);
+    }
+#endif
 
-// bmpDrawer class
-class bmpDrawer {
-    public:
-        bmpDrawer(BMP* image_) : image(image_) {}
+    template <uint32_t Channels>
+    inline void blend_row_portable(uint8_t *dst, const uint32_t count, const RowPattern& pattern, const uint32_t alpha) {
+        for (uint32_t x = 0; x < count; ++x) {
+            blend_pixel<Channels>(dst + Channels * x, pattern.block, alpha);
+        }
+    }
 
-        /// Draw on image
+    typedef void (*BlendRowKernel)(uint8_t *dst, const uint32_t count, const RowPattern& pattern, const uint32_t alpha);
 
-        void drawPixel(const uint32_t x, const uint32_t y, const Color& c) {
-            image->setPixel(x,y,c);
+    template <uint32_t Channels>
+    inline BlendRowKernel select_blend_row() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return blend_row_avx2<Channels>;
         }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return blend_row_sse41<Channels>;
+        }
+#elif defined(BMP_KERNELS_NEON)
+        return blend_row_neon<Channels>;
+#endif
+        return blend_row_portable<Channels>;
+    }
 
-        void drawPixel(const pixel& px) {
-            drawPixel(px.x, px.y, px.color);
+    // Blend count pixels of the pattern color with the best kernel available, alpha in [0, 255]
+    template <uint32_t Channels>
+    inline void blend_row(uint8_t *dst, const uint32_t count, const RowPattern& pattern, const uint32_t alpha) {
+        static const BlendRowKernel kernel = select_blend_row<Channels>();
+        if (alpha >= 255) {
+            fill_row<Channels>(dst, count, pattern);
+        } else if (alpha > 0) {
+            kernel(dst, count, pattern, alpha);
         }
+    }
 
-        void drawLine(int32_t x1, int32_t y1, int32_t x2, int32_t y2, const Color& c) {
-            
-            if (x1 == x2 && y1 == y2) { // One pixel
-                drawPixel(x1,y1,c);
-            } else if (y1 == y2) { // Horizontal line
-                if (x1 > x2) {
-                    std::swap(x1,x2);
-                }
-                for (int32_t i = 0; i < (x2 - x1); i++) {
-                    drawPixel(x1 + i, y1, c);
+    // Blit a row of count pixels from Src to Dst channels. A 24 bits source has an alpha of 255.
+    // AlphaOver treats the source as premultiplied on the fly: dst = src * a + dst * (255 - a),
+    // the alpha becomes a + da * (255 - a), both divided by 255 with rounding.
+    // Additive saturates dst + src * a, the alpha becomes da + a.
+    // With premultiplied the colors are already multiplied: src * 255 takes the place of src * a.
+
+    inline uint8_t mul_div255(const uint32_t x, const uint32_t y) {
+        uint32_t t = x * y + 128;
+        return (t + (t >> 8)) >> 8;
+    }
+
+    template <uint32_t Src, uint32_t Dst>
+    inline void blit_row_scalar(uint8_t *dst, const uint8_t *src, const uint32_t begin, const uint32_t end, const BlendMode mode,
+                                const bool premultiplied) {
+        for (uint32_t x = begin; x < end; ++x) {
+            const uint8_t *s = src + Src * x;
+            uint8_t *d = dst + Dst * x;
+            const uint32_t a = Src == 4 ? s[3] : 255;
+            const uint32_t k = premultiplied ? 255 : a;     // Weight of the source colors
+            if (mode == BlendMode::Copy) {
+                d[0] = s[0];
+                d[1] = s[1];
+                d[2] = s[2];
+                if (Dst == 4) {
+                    d[3] = a;
                 }
-            } else if (x1 == x2) { // Vertical line
-                if (y1 > y2) {
-                    std::swap(y1,y2);
+            } else if (mode == BlendMode::AlphaOver) {
+                for (uint32_t c = 0; c < 3; ++c) {
+                    uint32_t t = std::min<uint32_t>(65025, s[c] * k + d[c] * (255 - a)) + 128;
+                    d[c] = (t + (t >> 8)) >> 8;
                 }
-                for (int32_t i = 0; i < (y2 - y1); i++) {
-                    drawPixel(x1, y1 + i, c);
+                if (Dst == 4) {
+                    d[3] = blend_byte(d[3], 255, a);
                 }
             } else {
-                // DDA algorithm
-                int32_t steep = 0;
-                int32_t sx = ((x2 - x1) > 0) ? 1 : -1;
-                int32_t sy    = ((y2 - y1) > 0) ? 1 : -1;
-                int32_t dx    = abs(x2 - x1);
-                int32_t dy    = abs(y2 - y1);
-
-                if (dy > dx)
-                {
-                    std::swap(x1,y1);
-                    std::swap(dx,dy);
-                    std::swap(sx,sy);
-
-                    steep = 1;
+                for (uint32_t c = 0; c < 3; ++c) {
+                    d[c] = std::min<uint32_t>(255, d[c] + mul_div255(s[c], k));
                 }
-
-                int32_t e = 2 * dy - dx;
-
-                for (int32_t i = 0; i < dx; ++i)
-                {
-                    if (steep) {
-                        drawPixel(y1,x1,c);
-                    } else {
-                        drawPixel(x1,y1,c);
-                    }
-                    while (e >= 0)
-                    {
-                        y1 += sy;
-                        e -= (dx << 1);
-                    }
-
-                    x1 += sx;
-                    e  += (dy << 1);
+                if (Dst == 4) {
+                    d[3] = std::min<uint32_t>(255, d[3] + a);
                 }
-
-                drawPixel(x2,y2,c);
             }
         }
+    }
 
-        void drawTriangle(uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2, uint32_t x3, uint32_t y3, const Color& c) {
-            drawLine(x1, y1, x2, y2, c);
-            drawLine(x2, y2, x3, y3, c);
-            drawLine(x3, y3, x1, y1, c);
+#if defined(BMP_KERNELS_X86)
+    // BGRA vectors, with the alpha set to 255 for 3 channels. 4 pixels over 3 channels read 16 bytes.
+    template <uint32_t Channels>
+    __attribute__((target("sse4.1")))
+    inline __m128i load4_sse41(const uint8_t *p) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        if (Channels == 3) {
+            v = _mm_or_si128(_mm_shuffle_epi8(v, _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1)),
+                             _mm_set1_epi32((int)0xff000000));
         }
+        return v;
+    }
 
-        void drawCircle(const uint32_t x_center, const uint32_t y_center, int32_t radius, const Color& c) {
-            int32_t x = 0;
-            int32_t d = (1 - radius) << 1;
-            
-            while(radius >= 0) {
-                drawPixel(x_center + x, y_center + radius, c);
-                drawPixel(x_center + x, y_center - radius, c);
-                drawPixel(x_center - x, y_center + radius, c);
-                drawPixel(x_center - x, y_center - radius, c);
-
-                if ((d + radius) > 0) {
-                    d -= ((--radius) << 1) - 1;
-                }
-                if (x > d) {
-                    d += ((++x) << 1) + 1;
-                }
-            }
-            
+    template <uint32_t Channels>
+    __attribute__((target("sse4.1")))
+    inline void store4_sse41(uint8_t *p, const __m128i v) {
+        if (Channels == 3) {
+            __m128i packed = _mm_shuffle_epi8(v, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+            _mm_storel_epi64((__m128i*)p, packed);
+            uint32_t last = _mm_extract_epi32(packed, 2);
+            memcpy(p + 8, &last, 4);
+        } else {
+            _mm_storeu_si128((__m128i*)p, v);
         }
+    }
 
-        void drawRegion(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h, const Color& c) {
-            for (uint32_t yy = y; yy < y + h; ++yy) {
-                for (uint32_t xx = x; xx < x + w; ++xx) {
-                    drawPixel(xx,yy,c);
-                }
-            }
+    // (x * y + 128) / 255 with rounding on 16 bits lanes
+    __attribute__((target("sse4.1")))
+    inline __m128i div255_sse41(const __m128i x) {
+        return _mm_mulhi_epu16(_mm_add_epi16(x, _mm_set1_epi16(128)), _mm_set1_epi16(257));
+    }
+
+    __attribute__((target("sse4.1")))
+    inline __m128i blit4_sse41(const __m128i s, const __m128i d, const BlendMode mode, const bool premultiplied) {
+        if (mode == BlendMode::Copy) {
+            return s;
+        }
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i alpha_mask = _mm_set1_epi32((int)0xff000000);
+        const __m128i a = _mm_shuffle_epi8(s, _mm_setr_epi8(3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15));
+        const __m128i s1 = _mm_or_si128(s, alpha_mask);        // The alpha lane gets 255 * a
+        const __m128i k = premultiplied ? _mm_or_si128(a, _mm_set1_epi32(0x00ffffff)) : a;
+        __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(s1, zero), _mm_unpacklo_epi8(k, zero));
+        __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(s1, zero), _mm_unpackhi_epi8(k, zero));
+        if (mode == BlendMode::AlphaOver) {
+            const __m128i inv = _mm_xor_si128(a, _mm_set1_epi8(-1));
+            // A premultiplied color past its alpha (after a filter) saturates at 255
+            const __m128i full = _mm_set1_epi16((short)65025);
+            lo = _mm_min_epu16(_mm_adds_epu16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(inv, zero))), full);
+            hi = _mm_min_epu16(_mm_adds_epu16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(inv, zero))), full);
+            return _mm_packus_epi16(div255_sse41(lo), div255_sse41(hi));
+        }
+        return _mm_adds_epu8(d, _mm_packus_epi16(div255_sse41(lo), div255_sse41(hi)));
+    }
+
+    template <uint32_t Src, uint32_t Dst>
+    __attribute__((target("sse4.1")))
+    inline void blit_row_sse41(uint8_t *dst, const uint8_t *src, const uint32_t count, const BlendMode mode, const bool premultiplied) {
+        // 3 channels loads read 4 bytes past the 4 pixels
+        const uint32_t slack = (Src == 3 || Dst == 3) ? 2 : 0;
+        uint32_t x = 0;
+        for (; x + 4 + slack <= count; x += 4) {
+            __m128i s = load4_sse41<Src>(src + Src * x);
+            __m128i d = mode == BlendMode::Copy ? s : load4_sse41<Dst>(dst + Dst * x);
+            store4_sse41<Dst>(dst + Dst * x, blit4_sse41(s, d, mode, premultiplied));
+        }
+        blit_row_scalar<Src, Dst>(dst, src, x, count, mode, premultiplied);
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i div255_avx2(const __m256i x) {
+        return _mm256_mulhi_epu16(_mm256_add_epi16(x, _mm256_set1_epi16(128)), _mm256_set1_epi16(257));
+    }
+
+    // 8 BGRA pixels over 8 BGRA pixels, the common case of sprites and watermarks
+    template <uint32_t Src, uint32_t Dst>
+    __attribute__((target("avx2")))
+    inline void blit_row_avx2(uint8_t *dst, const uint8_t *src, const uint32_t count, const BlendMode mode, const bool premultiplied) {
+        if (Src != 4 || Dst != 4 || mode == BlendMode::Copy) {
+            blit_row_sse41<Src, Dst>(dst, src, count, mode, premultiplied);
+            return;
+        }
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i alpha_mask = _mm256_set1_epi32((int)0xff000000);
+        const __m256i color_mask = _mm256_set1_epi32(0x00ffffff);
+        const __m256i full = _mm256_set1_epi16((short)65025);  // See blit4_sse41
+        const __m256i spread = _mm256_setr_epi8(3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15,
+                                                3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15);
+        uint32_t x = 0;
+        for (; x + 8 <= count; x += 8) {
+            __m256i s = _mm256_loadu_si256((const __m256i*)(src + 4 * x));
+            __m256i d = _mm256_loadu_si256((const __m256i*)(dst + 4 * x));
+            __m256i a = _mm256_shuffle_epi8(s, spread);
+            __m256i s1 = _mm256_or_si256(s, alpha_mask);
+            __m256i k = premultiplied ? _mm256_or_si256(a, color_mask) : a;
+            __m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(s1, zero), _mm256_unpacklo_epi8(k, zero));
+            __m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(s1, zero), _mm256_unpackhi_epi8(k, zero));
+            if (mode == BlendMode::AlphaOver) {
+                __m256i inv = _mm256_xor_si256(a, _mm256_set1_epi8(-1));
+                lo = _mm256_min_epu16(_mm256_adds_epu16(lo, _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(inv, zero))), full);
+                hi = _mm256_min_epu16(_mm256_adds_epu16(hi, _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(inv, zero))), full);
+                d = _mm256_packus_epi16(div255_avx2(lo), div255_avx2(hi));
+            } else {
+                d = _mm256_adds_epu8(d, _mm256_packus_epi16(div255_avx2(lo), div255_avx2(hi)));
+            }
+            _mm256_storeu_si256((__m256i*)(dst + 4 * x), d);
+        }
+        blit_row_sse41<Src, Dst>(dst + 4 * x, src + 4 * x, count - x, mode, premultiplied);
+    }
+#endif
+
+#if defined(BMP_KERNELS_NEON)
+    inline uint8x8_t div255_neon(const uint16x8_t x) {
+        uint16x8_t t = vaddq_u16(x, vdupq_n_u16(128));
+        return vshrn_n_u16(vsraq_n_u16(t, t, 8), 8);
+    }
+
+    template <uint32_t Src, uint32_t Dst>
+    inline void blit_row_neon(uint8_t *dst, const uint8_t *src, const uint32_t count, const BlendMode mode, const bool premultiplied) {
+        uint32_t x = 0;
+        for (; x + 8 <= count; x += 8) {
+            uint8x8_t s[4], d[4];
+            if (Src == 4) {
+                uint8x8x4_t v = vld4_u8(src + 4 * x);
+                s[0] = v.val[0]; s[1] = v.val[1]; s[2] = v.val[2]; s[3] = v.val[3];
+            } else {
+                uint8x8x3_t v = vld3_u8(src + 3 * x);
+                s[0] = v.val[0]; s[1] = v.val[1]; s[2] = v.val[2]; s[3] = vdup_n_u8(255);
+            }
+            if (mode == BlendMode::Copy) {
+                for (int c = 0; c < 4; ++c) {
+                    d[c] = s[c];
+                }
+            } else {
+                if (Dst == 4) {
+                    uint8x8x4_t v = vld4_u8(dst + 4 * x);
+                    d[0] = v.val[0]; d[1] = v.val[1]; d[2] = v.val[2]; d[3] = v.val[3];
+                } else {
+                    uint8x8x3_t v = vld3_u8(dst + 3 * x);
+                    d[0] = v.val[0]; d[1] = v.val[1]; d[2] = v.val[2]; d[3] = vdup_n_u8(255);
+                }
+                uint8x8_t inv = vmvn_u8(s[3]);
+                for (int c = 0; c < 4; ++c) {
+                    uint16x8_t t = vmull_u8(c == 3 ? vdup_n_u8(255) : s[c], c == 3 || !premultiplied ? s[3] : vdup_n_u8(255));
+                    if (mode == BlendMode::AlphaOver) {
+                        d[c] = div255_neon(vminq_u16(vqaddq_u16(t, vmull_u8(d[c], inv)), vdupq_n_u16(65025)));
+                    } else {
+                        d[c] = vqadd_u8(d[c], div255_neon(t));
+                    }
+                }
+            }
+            if (Dst == 4) {
+                uint8x8x4_t v = { { d[0], d[1], d[2], d[3] } };
+                vst4_u8(dst + 4 * x, v);
+            } else {
+                uint8x8x3_t v = { { d[0], d[1], d[2] } };
+                vst3_u8(dst + 3 * x, v);
+            }
+        }
+        blit_row_scalar<Src, Dst>(dst, src, x, count, mode, premultiplied);
+    }
+#endif
+
+    template <uint32_t Src, uint32_t Dst>
+    inline void blit_row_portable(uint8_t *dst, const uint8_t *src, const uint32_t count, const BlendMode mode, const bool premultiplied) {
+        blit_row_scalar<Src, Dst>(dst, src, 0, count, mode, premultiplied);
+    }
+
+    typedef void (*BlitRowKernel)(uint8_t *dst, const uint8_t *src, const uint32_t count, const BlendMode mode, const bool premultiplied);
+
+    template <uint32_t Src, uint32_t Dst>
+    inline BlitRowKernel select_blit_row() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return blit_row_avx2<Src, Dst>;
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return blit_row_sse41<Src, Dst>;
+        }
+#elif defined(BMP_KERNELS_NEON)
+        return blit_row_neon<Src, Dst>;
+#endif
+        return blit_row_portable<Src, Dst>;
+    }
+
+    // Blit count pixels with the best kernel available
+    template <uint32_t Src, uint32_t Dst>
+    inline void blit_row(uint8_t *dst, const uint8_t *src, const uint32_t count, const BlendMode mode, const bool premultiplied = false) {
+        static const BlitRowKernel kernel = select_blit_row<Src, Dst>();
+        if (Src == Dst && (mode == BlendMode::Copy || (Src == 3 && mode == BlendMode::AlphaOver))) {
+            memcpy(dst, src, (size_t)Src * count);
+        } else {
+            kernel(dst, src, count, mode, premultiplied);
+        }
+    }
+
+    // Lookup tables and histograms
+
+    // bytes[c][v] is the new value of v in channel c (B, G, R, A), wide holds the same values
+    // as 32 bits words at 256 * c + v for the gather loads. widen() must follow a change of bytes.
+    struct ChannelTables {
+        uint8_t bytes[4][256];
+        uint32_t wide[4 * 256];
+
+        ChannelTables() {
+            for (int c = 0; c < 4; ++c) {
+                for (int v = 0; v < 256; ++v) {
+                    bytes[c][v] = (uint8_t)v;
+                }
+            }
+            widen();
+        }
+
+        void widen() {
+            for (int c = 0; c < 4; ++c) {
+                for (int v = 0; v < 256; ++v) {
+                    wide[256 * c + v] = bytes[c][v];
+                }
+            }
+        }
+
+        bool identity() const {
+            for (int c = 0; c < 4; ++c) {
+                for (int v = 0; v < 256; ++v) {
+                    if (bytes[c][v] != v) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+    };
+
+    template <uint32_t Channels>
+    inline void lut_row_scalar(uint8_t *row, const uint32_t x0, const uint32_t count, const ChannelTables& t) {
+        for (uint32_t x = x0; x < count; ++x) {
+            uint8_t *px = row + Channels * x;
+            px[0] = t.bytes[0][px[0]];
+            px[1] = t.bytes[1][px[1]];
+            px[2] = t.bytes[2][px[2]];
+            if (Channels == 4) {
+                px[3] = t.bytes[3][px[3]];
+            }
+        }
+    }
+
+#if defined(BMP_KERNELS_X86)
+    // 32 bytes per step: each byte plus the offset of its channel's table indexes a gather,
+    // the 3 bytes pixels cycle through 3 patterns of channel offsets
+    template <uint32_t Channels>
+    __attribute__((target("avx2")))
+    inline void lut_row_avx2(uint8_t *row, const uint32_t count, const ChannelTables& t) {
+        __m256i offsets[3];
+        for (int phase = 0; phase < 3; ++phase) {
+            int32_t o[8];
+            for (int k = 0; k < 8; ++k) {
+                o[k] = 256 * ((phase + k) % Channels);
+            }
+            offsets[phase] = _mm256_loadu_si256((const __m256i*)o);
+        }
+        const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        const size_t bytes = (size_t)Channels * count;
+        size_t i = 0;
+        for (; i + 32 <= bytes; i += 32) {
+            __m256i v[4];
+            for (int j = 0; j < 4; ++j) {
+                __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(row + i + 8 * j)));
+                index = _mm256_add_epi32(index, offsets[Channels == 4 ? 0 : (i + 8 * j) % 3]);
+                v[j] = _mm256_i32gather_epi32((const int*)t.wide, index, 4);
+            }
+            __m256i out = _mm256_packus_epi16(_mm256_packus_epi32(v[0], v[1]), _mm256_packus_epi32(v[2], v[3]));
+            _mm256_storeu_si256((__m256i*)(row + i), _mm256_permutevar8x32_epi32(out, order));
+        }
+        for (; i < bytes; ++i) {
+            row[i] = t.bytes[i % Channels][row[i]];
+        }
+    }
+#endif
+
+    template <uint32_t Channels>
+    inline void lut_row_portable(uint8_t *row, const uint32_t count, const ChannelTables& t) {
+        lut_row_scalar<Channels>(row, 0, count, t);
+    }
+
+    typedef void (*LutRowKernel)(uint8_t *row, const uint32_t count, const ChannelTables& t);
+
+    template <uint32_t Channels>
+    inline LutRowKernel select_lut_row() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return lut_row_avx2<Channels>;
+        }
+#endif
+        return lut_row_portable<Channels>;
+    }
+
+    // Map every byte of a row of count pixels through the table of its channel with the best kernel available
+    template <uint32_t Channels>
+    inline void lut_row(uint8_t *row, const uint32_t count, const ChannelTables& t) {
+        static const LutRowKernel kernel = select_lut_row<Channels>();
+        kernel(row, count, t);
+    }
+
+    // 256 counts and a gap, so that no two tables are a multiple of 4 KB apart: the CPU
+    // would take the stores to one for stores to the other and wait on them
+    const int HistogramStride = 272;
+
+    // Counts of each value per channel, two sets used in turn so that the same value
+    // in two neighbour pixels does not wait on the store of the first count: counts[c][set][v]
+    template <uint32_t Channels>
+    inline void histogram_row(const uint8_t *row, const uint32_t count, uint32_t (*counts)[2][HistogramStride]) {
+        uint32_t x = 0;
+        for (; x + 2 <= count; x += 2, row += 2 * Channels) {
+            for (uint32_t c = 0; c < Channels; ++c) {
+                counts[c][0][row[c]]++;
+                counts[c][1][row[Channels + c]]++;
+            }
+        }
+        if (x < count) {
+            for (uint32_t c = 0; c < Channels; ++c) {
+                counts[c][0][row[c]]++;
+            }
+        }
+    }
+
+    // Transpose a block of w x h pixels: pixel x of source row y goes to pixel y of destination row x.
+    // The strides may be negative, which also flips the block on the way.
+
+    template <uint32_t Channels>
+    inline void transpose_scalar(const uint8_t *src, const int64_t src_stride, uint8_t *dst, const int64_t dst_stride,
+                                 const uint32_t x0, const uint32_t y0, const uint32_t x1, const uint32_t y1) {
+        // The pixels [x0, x1) of the source rows [y0, y1)
+        for (uint32_t x = x0; x < x1; ++x) {
+            uint8_t *out = dst + dst_stride * x;
+            for (uint32_t y = y0; y < y1; ++y) {
+                memcpy(out + Channels * y, src + src_stride * y + Channels * x, Channels);
+            }
+        }
+    }
+
+#if defined(BMP_KERNELS_X86)
+    template <uint32_t Channels>
+    __attribute__((target("sse2")))
+    inline void transpose_sse2(const uint8_t *src, const int64_t src_stride, uint8_t *dst, const int64_t dst_stride,
+                               const uint32_t w, const uint32_t h) {
+        // 4 x 4 BGRA pixels transposed in registers, the 3 bytes pixels have no SIMD path
+        uint32_t w4 = Channels == 4 ? w & ~3u : 0, h4 = Channels == 4 ? h & ~3u : 0;
+        for (uint32_t y = 0; y < h4; y += 4) {
+            const uint8_t *in = src + src_stride * y;
+            for (uint32_t x = 0; x < w4; x += 4) {
+                __m128i r0 = _mm_loadu_si128((const __m128i*)(in + 4 * x));
+                __m128i r1 = _mm_loadu_si128((const __m128i*)(in + src_stride + 4 * x));
+                __m128i r2 = _mm_loadu_si128((const __m128i*)(in + 2 * src_stride + 4 * x));
+                __m128i r3 = _mm_loadu_si128((const __m128i*)(in + 3 * src_stride + 4 * x));
+                __m128i t0 = _mm_unpacklo_epi32(r0, r1), t1 = _mm_unpackhi_epi32(r0, r1);
+                __m128i t2 = _mm_unpacklo_epi32(r2, r3), t3 = _mm_unpackhi_epi32(r2, r3);
+                uint8_t *out = dst + dst_stride * x + 4 * y;
+                _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi64(t0, t2));
+                _mm_storeu_si128((__m128i*)(out + dst_stride), _mm_unpackhi_epi64(t0, t2));
+                _mm_storeu_si128((__m128i*)(out + 2 * dst_stride), _mm_unpacklo_epi64(t1, t3));
+                _mm_storeu_si128((__m128i*)(out + 3 * dst_stride), _mm_unpackhi_epi64(t1, t3));
+            }
+        }
+        // The right columns, then the last rows of the left columns
+        transpose_scalar<Channels>(src, src_stride, dst, dst_stride, w4, 0, w, h);
+        transpose_scalar<Channels>(src, src_stride, dst, dst_stride, 0, h4, w4, h);
+    }
+#endif
+
+#if defined(BMP_KERNELS_NEON)
+    template <uint32_t Channels>
+    inline void transpose_neon(const uint8_t *src, const int64_t src_stride, uint8_t *dst, const int64_t dst_stride,
+                               const uint32_t w, const uint32_t h) {
+        uint32_t w4 = Channels == 4 ? w & ~3u : 0, h4 = Channels == 4 ? h & ~3u : 0;
+        for (uint32_t y = 0; y < h4; y += 4) {
+            const uint8_t *in = src + src_stride * y;
+            for (uint32_t x = 0; x < w4; x += 4) {
+                uint32x4x2_t p = vtrnq_u32(vld1q_u32((const uint32_t*)(in + 4 * x)),
+                                           vld1q_u32((const uint32_t*)(in + src_stride + 4 * x)));
+                uint32x4x2_t q = vtrnq_u32(vld1q_u32((const uint32_t*)(in + 2 * src_stride + 4 * x)),
+                                           vld1q_u32((const uint32_t*)(in + 3 * src_stride + 4 * x)));
+                uint8_t *out = dst + dst_stride * x + 4 * y;
+                vst1q_u32((uint32_t*)out, vcombine_u32(vget_low_u32(p.val[0]), vget_low_u32(q.val[0])));
+                vst1q_u32((uint32_t*)(out + dst_stride), vcombine_u32(vget_low_u32(p.val[1]), vget_low_u32(q.val[1])));
+                vst1q_u32((uint32_t*)(out + 2 * dst_stride), vcombine_u32(vget_high_u32(p.val[0]), vget_high_u32(q.val[0])));
+                vst1q_u32((uint32_t*)(out + 3 * dst_stride), vcombine_u32(vget_high_u32(p.val[1]), vget_high_u32(q.val[1])));
+            }
+        }
+        transpose_scalar<Channels>(src, src_stride, dst, dst_stride, w4, 0, w, h);
+        transpose_scalar<Channels>(src, src_stride, dst, dst_stride, 0, h4, w4, h);
+    }
+#endif
+
+    template <uint32_t Channels>
+    inline void transpose_portable(const uint8_t *src, const int64_t src_stride, uint8_t *dst, const int64_t dst_stride,
+                                   const uint32_t w, const uint32_t h) {
+        transpose_scalar<Channels>(src, src_stride, dst, dst_stride, 0, 0, w, h);
+    }
+
+    typedef void (*TransposeKernel)(const uint8_t *src, const int64_t src_stride, uint8_t *dst, const int64_t dst_stride,
+                                    const uint32_t w, const uint32_t h);
+
+    template <uint32_t Channels>
+    inline TransposeKernel select_transpose() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (Channels == 4 && __builtin_cpu_supports("sse2")) {
+            return transpose_sse2<Channels>;
+        }
+#elif defined(BMP_KERNELS_NEON)
+        if (Channels == 4) {
+            return transpose_neon<Channels>;
+        }
+#endif
+        return transpose_portable<Channels>;
+    }
+
+    // Transpose a block that fits in L1 with the best kernel available
+    template <uint32_t Channels>
+    inline void transpose(const uint8_t *src, const int64_t src_stride, uint8_t *dst, const int64_t dst_stride,
+                          const uint32_t w, const uint32_t h) {
+        static const TransposeKernel kernel = select_transpose<Channels>();
+        kernel(src, src_stride, dst, dst_stride, w, h);
+    }
+
+    // Resize, one separable pass per axis
+
+    // Fixed point weights of the resize filters, 1.0 is (1 << ResizeShift)
+    const int ResizeShift = 14;
+
+    // The source pixels each destination pixel is made of, every destination pixel has the same
+    // number of taps: weights[taps * i + k] is the weight of source pixel first[i] + k
+    struct ResizeTaps {
+        uint32_t taps{ 0 };
+        std::vector<uint32_t> first;
+        std::vector<int16_t> weights;
+    };
+
+    inline double resize_support(const Filter filter) {
+        return filter == Filter::Box ? 0.5 : filter == Filter::Bilinear ? 1.0 : 3.0;
+    }
+
+    inline double resize_weight(const Filter filter, double x) {
+        x = fabs(x);
+        if (filter == Filter::Box) {
+            return x < 0.5 ? 1.0 : 0.0;
+        }
+        if (filter == Filter::Bilinear) {
+            return x < 1.0 ? 1.0 - x : 0.0;
+        }
+        if (x >= 3.0) {
+            return 0.0;
+        }
+        if (x < 1e-8) {
+            return 1.0;
+        }
+        const double pi = 3.14159265358979323846;
+        return 3.0 * sin(pi * x) * sin(pi * x / 3.0) / (pi * pi * x * x);
+    }
+
+    // When shrinking the filter is stretched to cover all the source pixels under a destination pixel
+    inline ResizeTaps resize_taps(const uint32_t src_size, const uint32_t dst_size, const Filter filter) {
+        const double scale = (double)src_size / dst_size;
+        const double filter_scale = scale > 1.0 ? scale : 1.0;
+        const double support = resize_support(filter) * filter_scale;
+
+        std::vector<std::vector<double> > weights(dst_size);
+        std::vector<int64_t> first(dst_size);
+        ResizeTaps t;
+        for (uint32_t i = 0; i < dst_size; ++i) {
+            double center = (i + 0.5) * scale;
+            int64_t begin = std::max<int64_t>(0, (int64_t)floor(center - support + 0.5));
+            int64_t end = std::min<int64_t>(src_size, (int64_t)floor(center + support + 0.5));
+            double total = 0;
+            for (int64_t k = begin; k < end; ++k) {
+                weights[i].push_back(resize_weight(filter, (k - center + 0.5) / filter_scale));
+                total += weights[i].back();
+            }
+            if (total == 0) {  // Nothing under the filter, take the nearest pixel
+                begin = std::min<int64_t>((int64_t)center, src_size - 1);
+                weights[i].assign(1, 1.0);
+                total = 1.0;
+            }
+            for (size_t k = 0; k < weights[i].size(); ++k) {
+                weights[i][k] /= total;
+            }
+            first[i] = begin;
+            t.taps = std::max(t.taps, (uint32_t)weights[i].size());
+        }
+
+        // Windows near the right end are moved left so that all the taps are inside the source
+        t.taps = std::min(t.taps, src_size);
+        t.first.resize(dst_size);
+        t.weights.assign((size_t)dst_size * t.taps, 0);
+        for (uint32_t i = 0; i < dst_size; ++i) {
+            uint32_t start = (uint32_t)std::min<int64_t>(first[i], src_size - t.taps);
+            t.first[i] = start;
+            int16_t *w = &t.weights[(size_t)t.taps * i];
+            int32_t sum = 0, largest = 0;
+            for (size_t k = 0; k < weights[i].size(); ++k) {
+                uint32_t tap = (uint32_t)(first[i] - start + k);
+                w[tap] = (int16_t)lround(weights[i][k] * (1 << ResizeShift));
+                sum += w[tap];
+                if (abs(w[tap]) > abs(w[largest])) {
+                    largest = tap;
+                }
+            }
+            w[largest] += (1 << ResizeShift) - sum;    // The weights add up to exactly 1.0
+        }
+        return t;
+    }
+
+    inline uint8_t resize_round(const int32_t acc) {
+        int32_t v = (acc + (1 << (ResizeShift - 1))) >> ResizeShift;
+        return (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+    }
+
+    // Horizontal pass: a source row to a row of dst_width pixels
+
+    template <uint32_t Channels>
+    inline void resize_h_scalar(const uint8_t *src, uint8_t *dst, const uint32_t x0, const uint32_t dst_width, const ResizeTaps& t) {
+        for (uint32_t x = x0; x < dst_width; ++x) {
+            const uint8_t *in = src + Channels * t.first[x];
+            const int16_t *w = &t.weights[(size_t)t.taps * x];
+            int32_t acc[Channels] = {};
+            for (uint32_t k = 0; k < t.taps; ++k) {
+                for (uint32_t c = 0; c < Channels; ++c) {
+                    acc[c] += in[Channels * k + c] * w[k];
+                }
+            }
+            for (uint32_t c = 0; c < Channels; ++c) {
+                dst[Channels * x + c] = resize_round(acc[c]);
+            }
+        }
+    }
+
+    // Vertical pass: the rows of a destination row weighed byte by byte, the layout does not matter
+
+    inline void resize_v_scalar(const uint8_t *const *rows, const int16_t *w, const uint32_t taps, uint8_t *dst,
+                                const size_t x0, const size_t bytes) {
+        for (size_t x = x0; x < bytes; ++x) {
+            int32_t acc = 0;
+            for (uint32_t k = 0; k < taps; ++k) {
+                acc += rows[k][x] * w[k];
+            }
+            dst[x] = resize_round(acc);
+        }
+    }
+
+    // Exact average of Factor x Factor blocks, for the mip levels
+    template <uint32_t Channels, uint32_t Factor>
+    inline void box_down_scalar(const uint8_t *const *rows, uint8_t *dst, const uint32_t x0, const uint32_t dst_width) {
+        for (uint32_t x = x0; x < dst_width; ++x) {
+            for (uint32_t c = 0; c < Channels; ++c) {
+                uint32_t sum = Factor * Factor / 2;
+                for (uint32_t r = 0; r < Factor; ++r) {
+                    for (uint32_t k = 0; k < Factor; ++k) {
+                        sum += rows[r][Channels * (Factor * x + k) + c];
+                    }
+                }
+                dst[Channels * x + c] = (uint8_t)(sum / (Factor * Factor));
+            }
+        }
+    }
+
+#if defined(BMP_KERNELS_X86)
+    // Two neighbour pixels with their channels interleaved, widened and weighed with madd
+    template <uint32_t Channels>
+    __attribute__((target("sse4.1")))
+    inline void resize_h_sse41(const uint8_t *src, uint8_t *dst, const uint32_t src_width, const uint32_t dst_width,
+                               const ResizeTaps& t) {
+        const __m128i pairs = Channels == 4 ? _mm_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, -1, -1, -1, -1, -1, -1, -1, -1)
+                                            : _mm_setr_epi8(0, 3, 1, 4, 2, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        const __m128i round = _mm_set1_epi32(1 << (ResizeShift - 1));
+        uint32_t x = 0;
+        for (; x < dst_width; ++x) {
+            const uint32_t first = t.first[x];
+            // 3 bytes pixels load 8 bytes for 2 pixels, the last pixels of the row go to the scalar loop
+            if (Channels == 3 && first + t.taps + 1 > src_width) {
+                break;
+            }
+            const uint8_t *in = src + Channels * first;
+            const int16_t *w = &t.weights[(size_t)t.taps * x];
+            __m128i acc = _mm_setzero_si128();
+            uint32_t k = 0;
+            for (; k + 2 <= t.taps; k += 2) {
+                __m128i px = _mm_cvtepu8_epi16(_mm_shuffle_epi8(_mm_loadl_epi64((const __m128i*)(in + Channels * k)), pairs));
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32((uint16_t)w[k] | ((uint32_t)(uint16_t)w[k + 1] << 16))));
+            }
+            if (k < t.taps) {
+                uint32_t last = 0;
+                memcpy(&last, in + Channels * k, Channels);
+                __m128i px = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(last));
+                acc = _mm_add_epi32(acc, _mm_mullo_epi32(px, _mm_set1_epi32(w[k])));
+            }
+            acc = _mm_srai_epi32(_mm_add_epi32(acc, round), ResizeShift);
+            uint32_t out = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(acc, acc), acc));
+            memcpy(dst + Channels * x, &out, Channels);
+        }
+        resize_h_scalar<Channels>(src, dst, x, dst_width, t);
+    }
+
+    // 16 bytes of two rows interleaved and weighed with madd, in 4 sums of 4 bytes
+    __attribute__((target("sse4.1")))
+    inline void resize_v16_sse41(const __m128i a, const __m128i b, const __m128i w, __m128i *acc) {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i lo = _mm_unpacklo_epi8(a, b), hi = _mm_unpackhi_epi8(a, b);
+        acc[0] = _mm_add_epi32(acc[0], _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+        acc[1] = _mm_add_epi32(acc[1], _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+        acc[2] = _mm_add_epi32(acc[2], _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+        acc[3] = _mm_add_epi32(acc[3], _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+    }
+
+    __attribute__((target("sse4.1")))
+    inline __m128i resize_pack_sse41(const __m128i *acc) {
+        const __m128i round = _mm_set1_epi32(1 << (ResizeShift - 1));
+        __m128i v[4];
+        for (int i = 0; i < 4; ++i) {
+            v[i] = _mm_srai_epi32(_mm_add_epi32(acc[i], round), ResizeShift);
+        }
+        return _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+    }
+
+    __attribute__((target("sse4.1")))
+    inline void resize_v_sse41(const uint8_t *const *rows, const int16_t *w, const uint32_t taps, uint8_t *dst,
+                               const size_t bytes) {
+        size_t x = 0;
+        for (; x + 16 <= bytes; x += 16) {
+            __m128i acc[4] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+            uint32_t k = 0;
+            for (; k + 2 <= taps; k += 2) {
+                __m128i wk = _mm_set1_epi32((uint16_t)w[k] | ((uint32_t)(uint16_t)w[k + 1] << 16));
+                resize_v16_sse41(_mm_loadu_si128((const __m128i*)(rows[k] + x)),
+                                 _mm_loadu_si128((const __m128i*)(rows[k + 1] + x)), wk, acc);
+            }
+            if (k < taps) {
+                resize_v16_sse41(_mm_loadu_si128((const __m128i*)(rows[k] + x)), _mm_setzero_si128(),
+                                 _mm_set1_epi32((uint16_t)w[k]), acc);
+            }
+            _mm_storeu_si128((__m128i*)(dst + x), resize_pack_sse41(acc));
+        }
+        resize_v_scalar(rows, w, taps, dst, x, bytes);
+    }
+
+    // The 128 bits lanes of AVX2 each do what resize_v16_sse41 does
+    __attribute__((target("avx2")))
+    inline void resize_v_avx2(const uint8_t *const *rows, const int16_t *w, const uint32_t taps, uint8_t *dst,
+                              const size_t bytes) {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i round = _mm256_set1_epi32(1 << (ResizeShift - 1));
+        size_t x = 0;
+        for (; x + 32 <= bytes; x += 32) {
+            __m256i acc[4] = { zero, zero, zero, zero };
+            for (uint32_t k = 0; k < taps; k += 2) {
+                __m256i a = _mm256_loadu_si256((const __m256i*)(rows[k] + x));
+                __m256i b = k + 1 < taps ? _mm256_loadu_si256((const __m256i*)(rows[k + 1] + x)) : zero;
+                __m256i wk = _mm256_set1_epi32((uint16_t)w[k] | (k + 1 < taps ? (uint32_t)(uint16_t)w[k + 1] << 16 : 0));
+                __m256i lo = _mm256_unpacklo_epi8(a, b), hi = _mm256_unpackhi_epi8(a, b);
+                acc[0] = _mm256_add_epi32(acc[0], _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), wk));
+                acc[1] = _mm256_add_epi32(acc[1], _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), wk));
+                acc[2] = _mm256_add_epi32(acc[2], _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), wk));
+                acc[3] = _mm256_add_epi32(acc[3], _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), wk));
+            }
+            for (int i = 0; i < 4; ++i) {
+                acc[i] = _mm256_srai_epi32(_mm256_add_epi32(acc[i], round), ResizeShift);
+            }
+            __m256i out = _mm256_packus_epi16(_mm256_packs_epi32(acc[0], acc[1]), _mm256_packs_epi32(acc[2], acc[3]));
+            _mm256_storeu_si256((__m256i*)(dst + x), out);
+        }
+        resize_v_scalar(rows, w, taps, dst, x, bytes);
+    }
+
+    // 4 BGRA pixels of each row summed to 16 bits, then 2 pixels (Factor 2) or 1 pixel (Factor 4)
+    template <uint32_t Channels, uint32_t Factor>
+    __attribute__((target("sse4.1")))
+    inline void box_down_sse41(const uint8_t *const *rows, uint8_t *dst, const uint32_t dst_width) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i round = _mm_set1_epi16(Factor * Factor / 2);
+        uint32_t x = 0;
+        if (Channels == 4) {
+            const uint32_t step = 4 / Factor;
+            for (; x + step <= dst_width; x += step) {
+                __m128i lo = zero, hi = zero;
+                for (uint32_t r = 0; r < Factor; ++r) {
+                    __m128i v = _mm_loadu_si128((const __m128i*)(rows[r] + 4 * Factor * x));
+                    lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+                    hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+                }
+                __m128i sum;
+                if (Factor == 2) {
+                    sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+                } else {
+                    sum = _mm_add_epi16(lo, hi);
+                    sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+                }
+                sum = _mm_srli_epi16(_mm_add_epi16(sum, round), Factor == 2 ? 2 : 4);
+                __m128i out = _mm_packus_epi16(sum, sum);
+                if (Factor == 2) {
+                    _mm_storel_epi64((__m128i*)(dst + 4 * x), out);
+                } else {
+                    int32_t value = _mm_cvtsi128_si32(out);
+                    memcpy(dst + 4 * x, &value, 4);
+                }
+            }
+        }
+        box_down_scalar<Channels, Factor>(rows, dst, x, dst_width);
+    }
+#endif
+
+#if defined(BMP_KERNELS_NEON)
+    template <uint32_t Channels>
+    inline void resize_h_neon(const uint8_t *src, uint8_t *dst, const uint32_t src_width, const uint32_t dst_width,
+                              const ResizeTaps& t) {
+        if (Channels != 4) {
+            resize_h_scalar<Channels>(src, dst, 0, dst_width, t);
+            return;
+        }
+        for (uint32_t x = 0; x < dst_width; ++x) {
+            const uint8_t *in = src + 4 * t.first[x];
+            const int16_t *w = &t.weights[(size_t)t.taps * x];
+            int32x4_t acc = vdupq_n_s32(0);
+            for (uint32_t k = 0; k < t.taps; ++k) {
+                uint32_t px;
+                memcpy(&px, in + 4 * k, 4);
+                int16x4_t v = vreinterpret_s16_u16(vget_low_u16(vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(px)))));
+                acc = vmlal_n_s16(acc, v, w[k]);
+            }
+            uint8x8_t out = vqmovn_u16(vcombine_u16(vqrshrun_n_s32(acc, ResizeShift), vdup_n_u16(0)));
+            uint32_t value = vget_lane_u32(vreinterpret_u32_u8(out), 0);
+            memcpy(dst + 4 * x, &value, 4);
+        }
+        (void)src_width;
+    }
+
+    inline void resize_v_neon(const uint8_t *const *rows, const int16_t *w, const uint32_t taps, uint8_t *dst,
+                              const size_t bytes) {
+        size_t x = 0;
+        for (; x + 16 <= bytes; x += 16) {
+            int32x4_t acc[4] = { vdupq_n_s32(0), vdupq_n_s32(0), vdupq_n_s32(0), vdupq_n_s32(0) };
+            for (uint32_t k = 0; k < taps; ++k) {
+                uint8x16_t v = vld1q_u8(rows[k] + x);
+                int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v)));
+                int16x8_t hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v)));
+                acc[0] = vmlal_n_s16(acc[0], vget_low_s16(lo), w[k]);
+                acc[1] = vmlal_n_s16(acc[1], vget_high_s16(lo), w[k]);
+                acc[2] = vmlal_n_s16(acc[2], vget_low_s16(hi), w[k]);
+                acc[3] = vmlal_n_s16(acc[3], vget_high_s16(hi), w[k]);
+            }
+            uint8x8_t lo = vqmovn_u16(vcombine_u16(vqrshrun_n_s32(acc[0], ResizeShift), vqrshrun_n_s32(acc[1], ResizeShift)));
+            uint8x8_t hi = vqmovn_u16(vcombine_u16(vqrshrun_n_s32(acc[2], ResizeShift), vqrshrun_n_s32(acc[3], ResizeShift)));
+            vst1q_u8(dst + x, vcombine_u8(lo, hi));
+        }
+        resize_v_scalar(rows, w, taps, dst, x, bytes);
+    }
+#endif
+
+    template <uint32_t Channels>
+    inline void resize_h_portable(const uint8_t *src, uint8_t *dst, const uint32_t, const uint32_t dst_width,
+                                  const ResizeTaps& t) {
+        resize_h_scalar<Channels>(src, dst, 0, dst_width, t);
+    }
+
+    inline void resize_v_portable(const uint8_t *const *rows, const int16_t *w, const uint32_t taps, uint8_t *dst,
+                                  const size_t bytes) {
+        resize_v_scalar(rows, w, taps, dst, 0, bytes);
+    }
+
+    template <uint32_t Channels, uint32_t Factor>
+    inline void box_down_portable(const uint8_t *const *rows, uint8_t *dst, const uint32_t dst_width) {
+        box_down_scalar<Channels, Factor>(rows, dst, 0, dst_width);
+    }
+
+    typedef void (*ResizeHKernel)(const uint8_t *src, uint8_t *dst, const uint32_t src_width, const uint32_t dst_width,
+                                  const ResizeTaps& t);
+    typedef void (*ResizeVKernel)(const uint8_t *const *rows, const int16_t *w, const uint32_t taps, uint8_t *dst,
+                                  const size_t bytes);
+    typedef void (*BoxDownKernel)(const uint8_t *const *rows, uint8_t *dst, const uint32_t dst_width);
+
+    template <uint32_t Channels>
+    inline ResizeHKernel select_resize_h() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.1")) {
+            return resize_h_sse41<Channels>;
+        }
+#elif defined(BMP_KERNELS_NEON)
+        return resize_h_neon<Channels>;
+#endif
+        return resize_h_portable<Channels>;
+    }
+
+    inline ResizeVKernel select_resize_v() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return resize_v_avx2;
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return resize_v_sse41;
+        }
+#elif defined(BMP_KERNELS_NEON)
+        return resize_v_neon;
+#endif
+        return resize_v_portable;
+    }
+
+    template <uint32_t Channels, uint32_t Factor>
+    inline BoxDownKernel select_box_down() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.1")) {
+            return box_down_sse41<Channels, Factor>;
+        }
+#endif
+        return box_down_portable<Channels, Factor>;
+    }
+
+    // Resize a row horizontally with the best kernel available, src has src_width pixels
+    template <uint32_t Channels>
+    inline void resize_h(const uint8_t *src, uint8_t *dst, const uint32_t src_width, const uint32_t dst_width,
+                         const ResizeTaps& t) {
+        static const ResizeHKernel kernel = select_resize_h<Channels>();
+        kernel(src, dst, src_width, dst_width, t);
+    }
+
+    // Weigh taps rows into dst, bytes bytes of each
+    inline void resize_v(const uint8_t *const *rows, const int16_t *w, const uint32_t taps, uint8_t *dst,
+                         const size_t bytes) {
+        static const ResizeVKernel kernel = select_resize_v();
+        kernel(rows, w, taps, dst, bytes);
+    }
+
+    // Average Factor rows of Factor x dst_width pixels into dst_width pixels
+    template <uint32_t Channels, uint32_t Factor>
+    inline void box_down(const uint8_t *const *rows, uint8_t *dst, const uint32_t dst_width) {
+        static const BoxDownKernel kernel = select_box_down<Channels, Factor>();
+        kernel(rows, dst, dst_width);
+    }
+
+    // Convolution, on the interleaved bytes: a pixel tap is Channels bytes (step) away from the next one,
+    // so every byte is filtered with the same loop whatever the layout
+
+    inline void widen_scalar(const uint8_t *in, float *out, const size_t x0, const size_t n) {
+        for (size_t x = x0; x < n; ++x) {
+            out[x] = in[x];
+        }
+    }
+
+    // out[x] (+)= sum of w[k] * in[x + step * k]
+    inline void conv_h_scalar(const float *in, const float *w, const uint32_t taps, const uint32_t step, float *out,
+                              const size_t x0, const size_t n, const bool accumulate) {
+        for (size_t x = x0; x < n; ++x) {
+            float acc = accumulate ? out[x] : 0.0f;
+            for (uint32_t k = 0; k < taps; ++k) {
+                acc += w[k] * in[x + (size_t)step * k];
+            }
+            out[x] = acc;
+        }
+    }
+
+    inline uint8_t conv_round(const float v) {
+        return (uint8_t)(v <= 0.0f ? 0 : v >= 255.0f ? 255 : lrintf(v));
+    }
+
+    // out[x] = sum of w[k] * rows[k][x], rounded to bytes
+    inline void conv_v_scalar(const float *const *rows, const float *w, const uint32_t taps, uint8_t *out,
+                              const size_t x0, const size_t n) {
+        for (size_t x = x0; x < n; ++x) {
+            float acc = 0.0f;
+            for (uint32_t k = 0; k < taps; ++k) {
+                acc += w[k] * rows[k][x];
+            }
+            out[x] = conv_round(acc);
+        }
+    }
+
+#if defined(BMP_KERNELS_X86)
+    __attribute__((target("sse4.1")))
+    inline void widen_sse41(const uint8_t *in, float *out, const size_t n) {
+        size_t x = 0;
+        for (; x + 4 <= n; x += 4) {
+            int32_t v;
+            memcpy(&v, in + x, 4);
+            _mm_storeu_ps(out + x, _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v))));
+        }
+        widen_scalar(in, out, x, n);
+    }
+
+    __attribute__((target("sse4.1")))
+    inline void conv_h_sse41(const float *in, const float *w, const uint32_t taps, const uint32_t step, float *out,
+                             const size_t n, const bool accumulate) {
+        size_t x = 0;
+        for (; x + 4 <= n; x += 4) {
+            __m128 acc = accumulate ? _mm_loadu_ps(out + x) : _mm_setzero_ps();
+            for (uint32_t k = 0; k < taps; ++k) {
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(in + x + (size_t)step * k)));
+            }
+            _mm_storeu_ps(out + x, acc);
+        }
+        conv_h_scalar(in, w, taps, step, out, x, n, accumulate);
+    }
+
+    // Saturated to bytes by the packs, 4 bytes at a time
+    __attribute__((target("sse4.1")))
+    inline void conv_v_sse41(const float *const *rows, const float *w, const uint32_t taps, uint8_t *out, const size_t n) {
+        size_t x = 0;
+        for (; x + 4 <= n; x += 4) {
+            __m128 acc = _mm_setzero_ps();
+            for (uint32_t k = 0; k < taps; ++k) {
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(rows[k] + x)));
+            }
+            __m128i v = _mm_cvtps_epi32(acc);
+            int32_t bytes = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(v, v), v));
+            memcpy(out + x, &bytes, 4);
+        }
+        conv_v_scalar(rows, w, taps, out, x, n);
+    }
+
+    __attribute__((target("avx2")))
+    inline void widen_avx2(const uint8_t *in, float *out, const size_t n) {
+        size_t x = 0;
+        for (; x + 8 <= n; x += 8) {
+            __m128i v = _mm_loadl_epi64((const __m128i*)(in + x));
+            _mm256_storeu_ps(out + x, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)));
+        }
+        widen_scalar(in, out, x, n);
+    }
+
+    __attribute__((target("avx2")))
+    inline void conv_h_avx2(const float *in, const float *w, const uint32_t taps, const uint32_t step, float *out,
+                            const size_t n, const bool accumulate) {
+        size_t x = 0;
+        for (; x + 8 <= n; x += 8) {
+            __m256 acc = accumulate ? _mm256_loadu_ps(out + x) : _mm256_setzero_ps();
+            for (uint32_t k = 0; k < taps; ++k) {
+                acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(w[k]), _mm256_loadu_ps(in + x + (size_t)step * k)));
+            }
+            _mm256_storeu_ps(out + x, acc);
+        }
+        conv_h_scalar(in, w, taps, step, out, x, n, accumulate);
+    }
+
+    __attribute__((target("avx2")))
+    inline void conv_v_avx2(const float *const *rows, const float *w, const uint32_t taps, uint8_t *out, const size_t n) {
+        size_t x = 0;
+        for (; x + 8 <= n; x += 8) {
+            __m256 acc = _mm256_setzero_ps();
+            for (uint32_t k = 0; k < taps; ++k) {
+                acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(w[k]), _mm256_loadu_ps(rows[k] + x)));
+            }
+            __m256i v = _mm256_cvtps_epi32(acc);
+            __m128i v16 = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+            _mm_storel_epi64((__m128i*)(out + x), _mm_packus_epi16(v16, v16));
+        }
+        conv_v_scalar(rows, w, taps, out, x, n);
+    }
+#endif
+
+#if defined(BMP_KERNELS_NEON)
+    inline void widen_neon(const uint8_t *in, float *out, const size_t n) {
+        size_t x = 0;
+        for (; x + 8 <= n; x += 8) {
+            uint16x8_t v = vmovl_u8(vld1_u8(in + x));
+            vst1q_f32(out + x, vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))));
+            vst1q_f32(out + x + 4, vcvtq_f32_u32(vmovl_u16(vget_high_u16(v))));
+        }
+        widen_scalar(in, out, x, n);
+    }
+
+    inline void conv_h_neon(const float *in, const float *w, const uint32_t taps, const uint32_t step, float *out,
+                            const size_t n, const bool accumulate) {
+        size_t x = 0;
+        for (; x + 4 <= n; x += 4) {
+            float32x4_t acc = accumulate ? vld1q_f32(out + x) : vdupq_n_f32(0.0f);
+            for (uint32_t k = 0; k < taps; ++k) {
+                acc = vaddq_f32(acc, vmulq_n_f32(vld1q_f32(in + x + (size_t)step * k), w[k]));
+            }
+            vst1q_f32(out + x, acc);
+        }
+        conv_h_scalar(in, w, taps, step, out, x, n, accumulate);
+    }
+
+    // Rounded to nearest even and saturated, as conv_round does (the rounding conversion is AArch64 only)
+#if defined(__aarch64__)
+    inline void conv_v_neon(const float *const *rows, const float *w, const uint32_t taps, uint8_t *out, const size_t n) {
+        size_t x = 0;
+        for (; x + 8 <= n; x += 8) {
+            float32x4_t lo = vdupq_n_f32(0.0f), hi = vdupq_n_f32(0.0f);
+            for (uint32_t k = 0; k < taps; ++k) {
+                lo = vaddq_f32(lo, vmulq_n_f32(vld1q_f32(rows[k] + x), w[k]));
+                hi = vaddq_f32(hi, vmulq_n_f32(vld1q_f32(rows[k] + x + 4), w[k]));
+            }
+            int16x8_t v = vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(lo)), vqmovn_s32(vcvtnq_s32_f32(hi)));
+            vst1_u8(out + x, vqmovun_s16(v));
+        }
+        conv_v_scalar(rows, w, taps, out, x, n);
+    }
+#endif
+#endif
+
+    inline void widen_portable(const uint8_t *in, float *out, const size_t n) {
+        widen_scalar(in, out, 0, n);
+    }
+
+    inline void conv_h_portable(const float *in, const float *w, const uint32_t taps, const uint32_t step, float *out,
+                                const size_t n, const bool accumulate) {
+        conv_h_scalar(in, w, taps, step, out, 0, n, accumulate);
+    }
+
+    inline void conv_v_portable(const float *const *rows, const float *w, const uint32_t taps, uint8_t *out, const size_t n) {
+        conv_v_scalar(rows, w, taps, out, 0, n);
+    }
+
+    typedef void (*WidenKernel)(const uint8_t *in, float *out, const size_t n);
+    typedef void (*ConvHKernel)(const float *in, const float *w, const uint32_t taps, const uint32_t step, float *out,
+                                const size_t n, const bool accumulate);
+    typedef void (*ConvVKernel)(const float *const *rows, const float *w, const uint32_t taps, uint8_t *out, const size_t n);
+
+    inline WidenKernel select_widen() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return widen_avx2;
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return widen_sse41;
+        }
+#elif defined(BMP_KERNELS_NEON)
+        return widen_neon;
+#endif
+        return widen_portable;
+    }
+
+    inline ConvHKernel select_conv_h() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return conv_h_avx2;
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return conv_h_sse41;
+        }
+#elif defined(BMP_KERNELS_NEON)
+        return conv_h_neon;
+#endif
+        return conv_h_portable;
+    }
+
+    inline ConvVKernel select_conv_v() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return conv_v_avx2;
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return conv_v_sse41;
+        }
+#elif defined(BMP_KERNELS_NEON) && defined(__aarch64__)
+        return conv_v_neon;
+#endif
+        return conv_v_portable;
+    }
+
+    // Bytes to floats with the best kernel available
+    inline void widen(const uint8_t *in, float *out, const size_t n) {
+        static const WidenKernel kernel = select_widen();
+        kernel(in, out, n);
+    }
+
+    // Horizontal taps over n floats with the best kernel available, accumulated into out if asked
+    inline void conv_h(const float *in, const float *w, const uint32_t taps, const uint32_t step, float *out,
+                       const size_t n, const bool accumulate) {
+        static const ConvHKernel kernel = select_conv_h();
+        kernel(in, w, taps, step, out, n, accumulate);
+    }
+
+    // Vertical taps over n floats, rounded to bytes, with the best kernel available
+    inline void conv_v(const float *const *rows, const float *w, const uint32_t taps, uint8_t *out, const size_t n) {
+        static const ConvVKernel kernel = select_conv_v();
+        kernel(rows, w, taps, out, n);
+    }
+
+    // Box blur with running sums, O(1) per pixel whatever the radius
+
+    // The sums of 2 * radius + 1 pixels: in holds the column sums of a row with radius pixels
+    // of border on each side, out gets width sums per channel
+    template <uint32_t Channels>
+    inline void box_sums_scalar(const uint32_t *in, const uint32_t radius, const uint32_t width, uint32_t *out) {
+        uint32_t sum[Channels] = {};
+        for (uint32_t k = 0; k < 2 * radius + 1; ++k) {
+            for (uint32_t c = 0; c < Channels; ++c) {
+                sum[c] += in[Channels * k + c];
+            }
+        }
+        for (uint32_t x = 0; x < width; ++x) {
+            for (uint32_t c = 0; c < Channels; ++c) {
+                out[Channels * x + c] = sum[c];
+            }
+            if (x + 1 < width) {
+                const uint32_t *enter = in + Channels * (x + 2 * radius + 1), *leave = in + Channels * x;
+                for (uint32_t c = 0; c < Channels; ++c) {
+                    sum[c] += enter[c] - leave[c];
+                }
+            }
+        }
+    }
+
+    // The column sums follow the window down: cols[i] += enter[i] - leave[i]
+    inline void box_columns_scalar(uint32_t *cols, const uint8_t *enter, const uint8_t *leave, const size_t x0, const size_t n) {
+        for (size_t i = x0; i < n; ++i) {
+            cols[i] += enter[i] - leave[i];
+        }
+    }
+
+    // Rounded division by the window area as a multiply and a shift
+    inline void box_divide_scalar(const uint32_t *sums, uint8_t *out, const size_t x0, const size_t n, const uint32_t half,
+                                  const uint32_t inverse, const int shift) {
+        for (size_t i = x0; i < n; ++i) {
+            out[i] = (uint8_t)(((uint64_t)(sums[i] + half) * inverse) >> shift);
+        }
+    }
+
+#if defined(BMP_KERNELS_X86)
+    // The 4 channels of a BGRA pixel in one vector
+    template <uint32_t Channels>
+    __attribute__((target("sse4.1")))
+    inline void box_sums_sse41(const uint32_t *in, const uint32_t radius, const uint32_t width, uint32_t *out) {
+        if (Channels != 4) {
+            box_sums_scalar<Channels>(in, radius, width, out);
+            return;
+        }
+        __m128i sum = _mm_setzero_si128();
+        for (uint32_t k = 0; k < 2 * radius + 1; ++k) {
+            sum = _mm_add_epi32(sum, _mm_loadu_si128((const __m128i*)(in + 4 * k)));
+        }
+        for (uint32_t x = 0; x + 1 < width; ++x) {
+            _mm_storeu_si128((__m128i*)(out + 4 * x), sum);
+            __m128i enter = _mm_loadu_si128((const __m128i*)(in + 4 * (x + 2 * radius + 1)));
+            sum = _mm_add_epi32(sum, _mm_sub_epi32(enter, _mm_loadu_si128((const __m128i*)(in + 4 * x))));
+        }
+        _mm_storeu_si128((__m128i*)(out + 4 * (width - 1)), sum);
+    }
+
+    __attribute__((target("sse4.1")))
+    inline void box_columns_sse41(uint32_t *cols, const uint8_t *enter, const uint8_t *leave, const size_t n) {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            int32_t e, l;
+            memcpy(&e, enter + i, 4);
+            memcpy(&l, leave + i, 4);
+            __m128i d = _mm_sub_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(e)), _mm_cvtepu8_epi32(_mm_cvtsi32_si128(l)));
+            _mm_storeu_si128((__m128i*)(cols + i), _mm_add_epi32(_mm_loadu_si128((const __m128i*)(cols + i)), d));
+        }
+        box_columns_scalar(cols, enter, leave, i, n);
+    }
+
+    // The even and the odd lanes are multiplied to 64 bits separately
+    __attribute__((target("sse4.1")))
+    inline void box_divide_sse41(const uint32_t *sums, uint8_t *out, const size_t n, const uint32_t half,
+                                 const uint32_t inverse, const int shift) {
+        const __m128i h = _mm_set1_epi32(half), m = _mm_set1_epi32(inverse), count = _mm_cvtsi32_si128(shift);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m128i v = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(sums + i)), h);
+            __m128i even = _mm_srl_epi64(_mm_mul_epu32(v, m), count);
+            __m128i odd = _mm_srl_epi64(_mm_mul_epu32(_mm_srli_epi64(v, 32), m), count);
+            __m128i q = _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+            q = _mm_packus_epi16(_mm_packus_epi32(q, q), q);
+            int32_t bytes = _mm_cvtsi128_si32(q);
+            memcpy(out + i, &bytes, 4);
+        }
+        box_divide_scalar(sums, out, i, n, half, inverse, shift);
+    }
+
+    __attribute__((target("avx2")))
+    inline void box_columns_avx2(uint32_t *cols, const uint8_t *enter, const uint8_t *leave, const size_t n) {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256i e = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(enter + i)));
+            __m256i l = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(leave + i)));
+            __m256i *c = (__m256i*)(cols + i);
+            _mm256_storeu_si256(c, _mm256_add_epi32(_mm256_loadu_si256(c), _mm256_sub_epi32(e, l)));
+        }
+        box_columns_scalar(cols, enter, leave, i, n);
+    }
+
+    __attribute__((target("avx2")))
+    inline void box_divide_avx2(const uint32_t *sums, uint8_t *out, const size_t n, const uint32_t half,
+                                const uint32_t inverse, const int shift) {
+        const __m256i h = _mm256_set1_epi32(half), m = _mm256_set1_epi32(inverse);
+        const __m128i count = _mm_cvtsi32_si128(shift);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256i v = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(sums + i)), h);
+            __m256i even = _mm256_srl_epi64(_mm256_mul_epu32(v, m), count);
+            __m256i odd = _mm256_srl_epi64(_mm256_mul_epu32(_mm256_srli_epi64(v, 32), m), count);
+            __m256i q = _mm256_or_si256(even, _mm256_slli_epi64(odd, 32));
+            __m128i q16 = _mm_packus_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+            _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(q16, q16));
+        }
+        box_divide_scalar(sums, out, i, n, half, inverse, shift);
+    }
+#endif
+
+#if defined(BMP_KERNELS_NEON)
+    template <uint32_t Channels>
+    inline void box_sums_neon(const uint32_t *in, const uint32_t radius, const uint32_t width, uint32_t *out) {
+        if (Channels != 4) {
+            box_sums_scalar<Channels>(in, radius, width, out);
+            return;
+        }
+        uint32x4_t sum = vdupq_n_u32(0);
+        for (uint32_t k = 0; k < 2 * radius + 1; ++k) {
+            sum = vaddq_u32(sum, vld1q_u32(in + 4 * k));
+        }
+        for (uint32_t x = 0; x + 1 < width; ++x) {
+            vst1q_u32(out + 4 * x, sum);
+            sum = vaddq_u32(sum, vsubq_u32(vld1q_u32(in + 4 * (x + 2 * radius + 1)), vld1q_u32(in + 4 * x)));
+        }
+        vst1q_u32(out + 4 * (width - 1), sum);
+    }
+
+    inline void box_columns_neon(uint32_t *cols, const uint8_t *enter, const uint8_t *leave, const size_t n) {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            int16x8_t d = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(enter + i), vld1_u8(leave + i)));
+            uint32x4_t lo = vreinterpretq_u32_s32(vmovl_s16(vget_low_s16(d)));
+            uint32x4_t hi = vreinterpretq_u32_s32(vmovl_s16(vget_high_s16(d)));
+            vst1q_u32(cols + i, vaddq_u32(vld1q_u32(cols + i), lo));
+            vst1q_u32(cols + i + 4, vaddq_u32(vld1q_u32(cols + i + 4), hi));
+        }
+        box_columns_scalar(cols, enter, leave, i, n);
+    }
+
+    inline void box_divide_neon(const uint32_t *sums, uint8_t *out, const size_t n, const uint32_t half,
+                                const uint32_t inverse, const int shift) {
+        const int64x2_t count = vdupq_n_s64(-shift);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            uint32x4_t v = vaddq_u32(vld1q_u32(sums + i), vdupq_n_u32(half));
+            uint64x2_t lo = vshlq_u64(vmull_n_u32(vget_low_u32(v), inverse), count);
+            uint64x2_t hi = vshlq_u64(vmull_n_u32(vget_high_u32(v), inverse), count);
+            uint16x4_t q = vmovn_u32(vcombine_u32(vmovn_u64(lo), vmovn_u64(hi)));
+            uint8x8_t bytes = vmovn_u16(vcombine_u16(q, q));
+            uint32_t value = vget_lane_u32(vreinterpret_u32_u8(bytes), 0);
+            memcpy(out + i, &value, 4);
+        }
+        box_divide_scalar(sums, out, i, n, half, inverse, shift);
+    }
+#endif
+
+    template <uint32_t Channels>
+    inline void box_sums_portable(const uint32_t *in, const uint32_t radius, const uint32_t width, uint32_t *out) {
+        box_sums_scalar<Channels>(in, radius, width, out);
+    }
+
+    inline void box_columns_portable(uint32_t *cols, const uint8_t *enter, const uint8_t *leave, const size_t n) {
+        box_columns_scalar(cols, enter, leave, 0, n);
+    }
+
+    inline void box_divide_portable(const uint32_t *sums, uint8_t *out, const size_t n, const uint32_t half,
+                                    const uint32_t inverse, const int shift) {
+        box_divide_scalar(sums, out, 0, n, half, inverse, shift);
+    }
+
+    typedef void (*BoxSumsKernel)(const uint32_t *in, const uint32_t radius, const uint32_t width, uint32_t *out);
+    typedef void (*BoxColumnsKernel)(uint32_t *cols, const uint8_t *enter, const uint8_t *leave, const size_t n);
+    typedef void (*BoxDivideKernel)(const uint32_t *sums, uint8_t *out, const size_t n, const uint32_t half,
+                                    const uint32_t inverse, const int shift);
+
+    template <uint32_t Channels>
+    inline BoxSumsKernel select_box_sums() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.1")) {
+            return box_sums_sse41<Channels>;
+        }
+#elif defined(BMP_KERNELS_NEON)
+        return box_sums_neon<Channels>;
+#endif
+        return box_sums_portable<Channels>;
+    }
+
+    inline BoxColumnsKernel select_box_columns() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return box_columns_avx2;
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return box_columns_sse41;
+        }
+#elif defined(BMP_KERNELS_NEON)
+        return box_columns_neon;
+#endif
+        return box_columns_portable;
+    }
+
+    inline BoxDivideKernel select_box_divide() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return box_divide_avx2;
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return box_divide_sse41;
+        }
+#elif defined(BMP_KERNELS_NEON)
+        return box_divide_neon;
+#endif
+        return box_divide_portable;
+    }
+
+    // Window sums along a row with the best kernel available
+    template <uint32_t Channels>
+    inline void box_sums(const uint32_t *in, const uint32_t radius, const uint32_t width, uint32_t *out) {
+        static const BoxSumsKernel kernel = select_box_sums<Channels>();
+        kernel(in, radius, width, out);
+    }
+
+    // Move the column sums one row down with the best kernel available
+    inline void box_columns(uint32_t *cols, const uint8_t *enter, const uint8_t *leave, const size_t n) {
+        static const BoxColumnsKernel kernel = select_box_columns();
+        kernel(cols, enter, leave, n);
+    }
+
+    // Sums to rounded averages with the best kernel available
+    inline void box_divide(const uint32_t *sums, uint8_t *out, const size_t n, const uint32_t half,
+                           const uint32_t inverse, const int shift) {
+        static const BoxDivideKernel kernel = select_box_divide();
+        kernel(sums, out, n, half, inverse, shift);
+    }
+
+    // Split interleaved pixels into planes and back: byte c of pixel x is planes[c][x]
+
+    template <uint32_t Channels>
+    inline void deinterleave_scalar(const uint8_t *row, uint8_t *const *planes, const uint32_t x0, const uint32_t count) {
+        for (uint32_t x = x0; x < count; ++x) {
+            for (uint32_t c = 0; c < Channels; ++c) {
+                planes[c][x] = row[Channels * x + c];
+            }
+        }
+    }
+
+    template <uint32_t Channels>
+    inline void interleave_scalar(const uint8_t *const *planes, uint8_t *row, const uint32_t x0, const uint32_t count) {
+        for (uint32_t x = x0; x < count; ++x) {
+            for (uint32_t c = 0; c < Channels; ++c) {
+                row[Channels * x + c] = planes[c][x];
+            }
+        }
+    }
+
+#if defined(BMP_KERNELS_X86)
+    // Shuffle masks between 16 BGR pixels held in 3 vectors and their 3 planes:
+    // plane c takes from pixel vector v the bytes split[c][v], pixel vector k takes
+    // from plane p the bytes merge[k][p] (-1 for the bytes they do not give)
+    struct Planar3Masks {
+        int8_t split[3][3][16];
+        int8_t merge[3][3][16];
+
+        Planar3Masks() {
+            for (int k = 0; k < 3; ++k) {
+                for (int v = 0; v < 3; ++v) {
+                    for (int b = 0; b < 16; ++b) {
+                        int in = 3 * b + k;
+                        split[k][v][b] = (in / 16 == v) ? in % 16 : -1;
+                        int out = 16 * k + b;
+                        merge[k][v][b] = (out % 3 == v) ? out / 3 : -1;
+                    }
+                }
+            }
+        }
+    };
+
+    __attribute__((target("sse4.1")))
+    inline __m128i shuffle3_sse41(const __m128i *v, const int8_t (*masks)[16]) {
+        return _mm_or_si128(_mm_shuffle_epi8(v[0], _mm_loadu_si128((const __m128i*)masks[0])),
+               _mm_or_si128(_mm_shuffle_epi8(v[1], _mm_loadu_si128((const __m128i*)masks[1])),
+                            _mm_shuffle_epi8(v[2], _mm_loadu_si128((const __m128i*)masks[2]))));
+    }
+
+    template <uint32_t Channels>
+    __attribute__((target("sse4.1")))
+    inline void deinterleave_row_sse41(const uint8_t *row, uint8_t *const *planes, const uint32_t count) {
+        uint32_t x = 0;
+        if (Channels == 4) {
+            // The bytes of each channel gathered in one 32 bits lane per vector, then a 4x4 transpose of the lanes
+            const __m128i gather = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+            for (; x + 16 <= count; x += 16) {
+                const __m128i *in = (const __m128i*)(row + 4 * x);
+                __m128i v0 = _mm_shuffle_epi8(_mm_loadu_si128(in), gather);
+                __m128i v1 = _mm_shuffle_epi8(_mm_loadu_si128(in + 1), gather);
+                __m128i v2 = _mm_shuffle_epi8(_mm_loadu_si128(in + 2), gather);
+                __m128i v3 = _mm_shuffle_epi8(_mm_loadu_si128(in + 3), gather);
+                __m128i t0 = _mm_unpacklo_epi32(v0, v1), t1 = _mm_unpacklo_epi32(v2, v3);
+                __m128i t2 = _mm_unpackhi_epi32(v0, v1), t3 = _mm_unpackhi_epi32(v2, v3);
+                _mm_storeu_si128((__m128i*)(planes[0] + x), _mm_unpacklo_epi64(t0, t1));
+                _mm_storeu_si128((__m128i*)(planes[1] + x), _mm_unpackhi_epi64(t0, t1));
+                _mm_storeu_si128((__m128i*)(planes[2] + x), _mm_unpacklo_epi64(t2, t3));
+                _mm_storeu_si128((__m128i*)(planes[3] + x), _mm_unpackhi_epi64(t2, t3));
+            }
+        } else {
+            static const Planar3Masks masks;
+            for (; x + 16 <= count; x += 16) {
+                const __m128i *in = (const __m128i*)(row + 3 * x);
+                __m128i v[3] = { _mm_loadu_si128(in), _mm_loadu_si128(in + 1), _mm_loadu_si128(in + 2) };
+                for (int c = 0; c < 3; ++c) {
+                    _mm_storeu_si128((__m128i*)(planes[c] + x), shuffle3_sse41(v, masks.split[c]));
+                }
+            }
+        }
+        deinterleave_scalar<Channels>(row, planes, x, count);
+    }
+
+    template <uint32_t Channels>
+    __attribute__((target("sse4.1")))
+    inline void interleave_row_sse41(const uint8_t *const *planes, uint8_t *row, const uint32_t count) {
+        uint32_t x = 0;
+        if (Channels == 4) {
+            for (; x + 16 <= count; x += 16) {
+                __m128i b = _mm_loadu_si128((const __m128i*)(planes[0] + x));
+                __m128i g = _mm_loadu_si128((const __m128i*)(planes[1] + x));
+                __m128i r = _mm_loadu_si128((const __m128i*)(planes[2] + x));
+                __m128i a = _mm_loadu_si128((const __m128i*)(planes[3] + x));
+                __m128i bg_lo = _mm_unpacklo_epi8(b, g), bg_hi = _mm_unpackhi_epi8(b, g);
+                __m128i ra_lo = _mm_unpacklo_epi8(r, a), ra_hi = _mm_unpackhi_epi8(r, a);
+                __m128i *out = (__m128i*)(row + 4 * x);
+                _mm_storeu_si128(out, _mm_unpacklo_epi16(bg_lo, ra_lo));
+                _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(bg_lo, ra_lo));
+                _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(bg_hi, ra_hi));
+                _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(bg_hi, ra_hi));
+            }
+        } else {
+            static const Planar3Masks masks;
+            for (; x + 16 <= count; x += 16) {
+                __m128i p[3];
+                for (int c = 0; c < 3; ++c) {
+                    p[c] = _mm_loadu_si128((const __m128i*)(planes[c] + x));
+                }
+                __m128i *out = (__m128i*)(row + 3 * x);
+                for (int k = 0; k < 3; ++k) {
+                    _mm_storeu_si128(out + k, shuffle3_sse41(p, masks.merge[k]));
+                }
+            }
+        }
+        interleave_scalar<Channels>(planes, row, x, count);
+    }
+#endif
+
+#if defined(BMP_KERNELS_NEON)
+    template <uint32_t Channels>
+    inline void deinterleave_row_neon(const uint8_t *row, uint8_t *const *planes, const uint32_t count) {
+        uint32_t x = 0;
+        for (; x + 16 <= count; x += 16) {
+            if (Channels == 4) {
+                uint8x16x4_t v = vld4q_u8(row + 4 * x);
+                for (int c = 0; c < 4; ++c) {
+                    vst1q_u8(planes[c] + x, v.val[c]);
+                }
+            } else {
+                uint8x16x3_t v = vld3q_u8(row + 3 * x);
+                for (int c = 0; c < 3; ++c) {
+                    vst1q_u8(planes[c] + x, v.val[c]);
+                }
+            }
+        }
+        deinterleave_scalar<Channels>(row, planes, x, count);
+    }
+
+    template <uint32_t Channels>
+    inline void interleave_row_neon(const uint8_t *const *planes, uint8_t *row, const uint32_t count) {
+        uint32_t x = 0;
+        for (; x + 16 <= count; x += 16) {
+            if (Channels == 4) {
+                uint8x16x4_t v;
+                for (int c = 0; c < 4; ++c) {
+                    v.val[c] = vld1q_u8(planes[c] + x);
+                }
+                vst4q_u8(row + 4 * x, v);
+            } else {
+                uint8x16x3_t v;
+                for (int c = 0; c < 3; ++c) {
+                    v.val[c] = vld1q_u8(planes[c] + x);
+                }
+                vst3q_u8(row + 3 * x, v);
+            }
+        }
+        interleave_scalar<Channels>(planes, row, x, count);
+    }
+#endif
+
+    template <uint32_t Channels>
+    inline void deinterleave_row_portable(const uint8_t *row, uint8_t *const *planes, const uint32_t count) {
+        deinterleave_scalar<Channels>(row, planes, 0, count);
+    }
+
+    template <uint32_t Channels>
+    inline void interleave_row_portable(const uint8_t *const *planes, uint8_t *row, const uint32_t count) {
+        interleave_scalar<Channels>(planes, row, 0, count);
+    }
+
+    typedef void (*DeinterleaveRowKernel)(const uint8_t *row, uint8_t *const *planes, const uint32_t count);
+    typedef void (*InterleaveRowKernel)(const uint8_t *const *planes, uint8_t *row, const uint32_t count);
+
+    template <uint32_t Channels>
+    inline DeinterleaveRowKernel select_deinterleave_row() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.1")) {
+            return deinterleave_row_sse41<Channels>;
+        }
+#elif defined(BMP_KERNELS_NEON)
+        return deinterleave_row_neon<Channels>;
+#endif
+        return deinterleave_row_portable<Channels>;
+    }
+
+    template <uint32_t Channels>
+    inline InterleaveRowKernel select_interleave_row() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.1")) {
+            return interleave_row_sse41<Channels>;
+        }
+#elif defined(BMP_KERNELS_NEON)
+        return interleave_row_neon<Channels>;
+#endif
+        return interleave_row_portable<Channels>;
+    }
+
+    // Split a row of count pixels into Channels planes with the best kernel available
+    template <uint32_t Channels>
+    inline void deinterleave_row(const uint8_t *row, uint8_t *const *planes, const uint32_t count) {
+        static const DeinterleaveRowKernel kernel = select_deinterleave_row<Channels>();
+        kernel(row, planes, count);
+    }
+
+    // Gather count pixels from Channels planes into a row with the best kernel available
+    template <uint32_t Channels>
+    inline void interleave_row(const uint8_t *const *planes, uint8_t *row, const uint32_t count) {
+        static const InterleaveRowKernel kernel = select_interleave_row<Channels>();
+        kernel(planes, row, count);
+    }
+
+    // Premultiplied alpha: the color channels of BGRA pixels times alpha / 255, rounded as blend_byte.
+    // Going back divides by alpha with rounding, a pixel of alpha 0 stays black.
+
+    inline uint8_t premultiply_byte(const uint8_t c, const uint8_t a) {
+        uint32_t x = c * a + 128;
+        return (x + (x >> 8)) >> 8;
+    }
+
+    inline uint8_t unpremultiply_byte(const uint8_t c, const uint8_t a) {
+        if (a == 0) {
+            return 0;
+        }
+        uint32_t v = (c * 255u + a / 2) / a;
+        return v > 255 ? 255 : v;
+    }
+
+    inline void premultiply_scalar(uint8_t *row, const uint32_t x0, const uint32_t count) {
+        for (uint32_t x = x0; x < count; ++x) {
+            uint8_t *px = row + 4 * x;
+            for (int c = 0; c < 3; ++c) {
+                px[c] = premultiply_byte(px[c], px[3]);
+            }
+        }
+    }
+
+    inline void unpremultiply_scalar(uint8_t *row, const uint32_t x0, const uint32_t count) {
+        for (uint32_t x = x0; x < count; ++x) {
+            uint8_t *px = row + 4 * x;
+            for (int c = 0; c < 3; ++c) {
+                px[c] = unpremultiply_byte(px[c], px[3]);
+            }
+        }
+    }
+
+#if defined(BMP_KERNELS_X86)
+    __attribute__((target("sse4.1")))
+    inline void premultiply_row_sse41(uint8_t *row, const uint32_t count) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i round = _mm_set1_epi16(128), div = _mm_set1_epi16(257);
+        const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+        // The alpha of each pixel in its 4 words
+        const __m128i alpha_lo = _mm_setr_epi8(3, -1, 3, -1, 3, -1, 3, -1, 7, -1, 7, -1, 7, -1, 7, -1);
+        const __m128i alpha_hi = _mm_setr_epi8(11, -1, 11, -1, 11, -1, 11, -1, 15, -1, 15, -1, 15, -1, 15, -1);
+        uint32_t x = 0;
+        for (; x + 4 <= count; x += 4) {
+            __m128i *p = (__m128i*)(row + 4 * x);
+            __m128i v = _mm_loadu_si128(p);
+            __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), _mm_shuffle_epi8(v, alpha_lo)), round);
+            __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), _mm_shuffle_epi8(v, alpha_hi)), round);
+            __m128i out = _mm_packus_epi16(_mm_mulhi_epu16(lo, div), _mm_mulhi_epu16(hi, div));
+            _mm_storeu_si128(p, _mm_blendv_epi8(out, v, alpha));
+        }
+        premultiply_scalar(row, x, count);
+    }
+
+    __attribute__((target("sse4.1")))
+    inline __m128i unpremultiply_pixel_sse41(const __m128i px) {
+        // (c * 255 + a / 2) / a in floats, exact for the values a premultiplied pixel can hold
+        __m128i a = _mm_shuffle_epi32(px, 0xFF);
+        __m128i n = _mm_add_epi32(_mm_mullo_epi32(px, _mm_set1_epi32(255)), _mm_srli_epi32(a, 1));
+        __m128i q = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(n), _mm_cvtepi32_ps(a)));
+        return _mm_andnot_si128(_mm_cmpeq_epi32(a, _mm_setzero_si128()), q);
+    }
+
+    __attribute__((target("sse4.1")))
+    inline void unpremultiply_row_sse41(uint8_t *row, const uint32_t count) {
+        const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+        uint32_t x = 0;
+        for (; x + 4 <= count; x += 4) {
+            __m128i *p = (__m128i*)(row + 4 * x);
+            __m128i v = _mm_loadu_si128(p);
+            __m128i q0 = unpremultiply_pixel_sse41(_mm_cvtepu8_epi32(v));
+            __m128i q1 = unpremultiply_pixel_sse41(_mm_cvtepu8_epi32(_mm_srli_si128(v, 4)));
+            __m128i q2 = unpremultiply_pixel_sse41(_mm_cvtepu8_epi32(_mm_srli_si128(v, 8)));
+            __m128i q3 = unpremultiply_pixel_sse41(_mm_cvtepu8_epi32(_mm_srli_si128(v, 12)));
+            // Saturated to 255 on the way down to bytes
+            __m128i out = _mm_packus_epi16(_mm_packs_epi32(q0, q1), _mm_packs_epi32(q2, q3));
+            _mm_storeu_si128(p, _mm_blendv_epi8(out, v, alpha));
+        }
+        unpremultiply_scalar(row, x, count);
+    }
+#endif
+
+#if defined(BMP_KERNELS_NEON)
+    inline void premultiply_row_neon(uint8_t *row, const uint32_t count) {
+        const uint16x8_t round = vdupq_n_u16(128);
+        uint32_t x = 0;
+        for (; x + 16 <= count; x += 16) {
+            uint8x16x4_t v = vld4q_u8(row + 4 * x);
+            for (int c = 0; c < 3; ++c) {
+                uint16x8_t lo = vmlal_u8(round, vget_low_u8(v.val[c]), vget_low_u8(v.val[3]));
+                uint16x8_t hi = vmlal_u8(round, vget_high_u8(v.val[c]), vget_high_u8(v.val[3]));
+                v.val[c] = vcombine_u8(vshrn_n_u16(vsraq_n_u16(lo, lo, 8), 8), vshrn_n_u16(vsraq_n_u16(hi, hi, 8), 8));
+            }
+            vst4q_u8(row + 4 * x, v);
+        }
+        premultiply_scalar(row, x, count);
+    }
+#endif
+
+    inline void premultiply_row_portable(uint8_t *row, const uint32_t count) {
+        premultiply_scalar(row, 0, count);
+    }
+
+    inline void unpremultiply_row_portable(uint8_t *row, const uint32_t count) {
+        unpremultiply_scalar(row, 0, count);
+    }
+
+    typedef void (*AlphaRowKernel)(uint8_t *row, const uint32_t count);
+
+    inline AlphaRowKernel select_premultiply_row() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.1")) {
+            return premultiply_row_sse41;
+        }
+#elif defined(BMP_KERNELS_NEON)
+        return premultiply_row_neon;
+#endif
+        return premultiply_row_portable;
+    }
+
+    inline AlphaRowKernel select_unpremultiply_row() {
+#if defined(BMP_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.1")) {
+            return unpremultiply_row_sse41;
+        }
+#endif
+        return unpremultiply_row_portable;
+    }
+
+    // Premultiply a row of count BGRA pixels with the best kernel available
+    inline void premultiply_row(uint8_t *row, const uint32_t count) {
+        static const AlphaRowKernel kernel = select_premultiply_row();
+        kernel(row, count);
+    }
+
+    // Back to straight alpha with the best kernel available
+    inline void unpremultiply_row(uint8_t *row, const uint32_t count) {
+        static const AlphaRowKernel kernel = select_unpremultiply_row();
+        kernel(row, count);
+    }
+
+    // Decoding of the files with less than 24 bits per pixel: packed palette indices,
+    // 16 bits pixels with bit fields and the RLE compressions
+
+    // The indices packed in each byte, the first pixel in the high bits
+    struct UnpackTables {
+        uint8_t bits1[256][8];
+        uint8_t bits4[256][2];
+
+        UnpackTables() {
+            for (int v = 0; v < 256; ++v) {
+                for (int b = 0; b < 8; ++b) {
+                    bits1[v][b] = (v >> (7 - b)) & 1;
+                }
+                bits4[v][0] = v >> 4;
+                bits4[v][1] = v & 15;
+            }
+        }
+    };
+
+    // count indices packed in bits (1, 4 or 8) per pixel to one byte each
+    inline void unpack_indices(const uint8_t *src, const uint32_t bits, const uint32_t count, uint8_t *out) {
+        static const UnpackTables tables;
+        uint32_t x = 0;
+        if (bits == 8) {
+            memcpy(out, src, count);
+        } else if (bits == 4) {
+            for (; x + 2 <= count; x += 2) {
+                memcpy(out + x, tables.bits4[*src++], 2);
+            }
+            if (x < count) {
+                out[x] = *src >> 4;
+            }
+        } else {
+            for (; x + 8 <= count; x += 8) {
+                memcpy(out + x, tables.bits1[*src++], 8);
+            }
+            if (x < count) {
+                memcpy(out + x, tables.bits1[*src], count - x);
+            }
+        }
+    }
+
+    // The reverse: count indices of one byte each packed in bits per pixel, the last byte padded with 0
+    inline void pack_indices(const uint8_t *indices, const uint32_t bits, const uint32_t count, uint8_t *out) {
+        if (bits == 8) {
+            memcpy(out, indices, count);
+            return;
+        }
+        const uint32_t per_byte = 8 / bits, mask = (1 << bits) - 1;
+        for (uint32_t x = 0; x < count; x += per_byte) {
+            uint32_t v = 0;
+            for (uint32_t k = 0; k < per_byte; ++k) {
+                v = (v << bits) | (x + k < count ? indices[x + k] & mask : 0);
+            }
+            *out++ = v;
+        }
+    }
+
+    // Pixels of count indices through a palette of 256 BGRA entries
+    template <uint32_t Channels>
+    inline void palette_row(const uint8_t *indices, const uint32_t count, const uint8_t (*palette)[4], uint8_t *out) {
+        if (count == 0) {
+            return;
+        }
+        // 4 bytes stored for each pixel, the 4th is overwritten by the next 24 bits pixel
+        for (uint32_t x = 0; x + 1 < count; ++x, out += Channels) {
+            memcpy(out, palette[indices[x]], 4);
+        }
+        memcpy(out, palette[indices[count - 1]], Channels);
+    }
+
+    // The channels of 16 bits pixels as given by their masks, each field scaled to 8 bits
+    // through a table. The channels without a mask are 0, or 255 for the alpha.
+    struct BitFields {
+        uint32_t shift[4];
+        uint32_t limit[4];
+        uint8_t scale[4][256];
+        bool alpha;
+
+        BitFields(const uint32_t blue_mask, const uint32_t green_mask, const uint32_t red_mask, const uint32_t alpha_mask) {
+            const uint32_t masks[4] = { blue_mask & 0xFFFF, green_mask & 0xFFFF, red_mask & 0xFFFF, alpha_mask & 0xFFFF };
+            for (int c = 0; c < 4; ++c) {
+                uint32_t m = masks[c], s = 0, bits = 0;
+                while (m && !(m & 1)) {
+                    m >>= 1;
+                    ++s;
+                }
+                while (m & 1) {
+                    m >>= 1;
+                    ++bits;
+                }
+                if (bits > 8) { // Only the 8 high bits matter
+                    s += bits - 8;
+                    bits = 8;
+                }
+                shift[c] = s;
+                limit[c] = (1u << bits) - 1;
+                for (uint32_t v = 0; v <= limit[c]; ++v) {
+                    scale[c][v] = bits ? (v * 255 + limit[c] / 2) / limit[c] : (c == 3 ? 255 : 0);
+                }
+            }
+            alpha = masks[3] != 0;
+        }
+    };
+
+    template <uint32_t Channels>
+    inline void bitfields_row(const uint8_t *src, const uint32_t count, const BitFields& f, uint8_t *out) {
+        for (uint32_t x = 0; x < count; ++x, src += 2, out += Channels) {
+            uint32_t v = src[0] | (src[1] << 8);
+            for (uint32_t c = 0; c < Channels; ++c) {
+                out[c] = f.scale[c][(v >> f.shift[c]) & f.limit[c]];
+            }
+        }
+    }
+
+    // Indices of an RLE8 or RLE4 pixel array, one byte per pixel in rows of width from the bottom.
+    // The pixels skipped by a delta or an early end of line or bitmap are 0, the ones past the
+    // width are dropped. Returns false when the data ends before the end of the bitmap.
+    inline bool decode_rle(const uint8_t *src, const size_t size, const bool rle4, const uint32_t width,
+                           const uint32_t height, uint8_t *out) {
+        memset(out, 0, (size_t)width * height);
+        size_t i = 0;
+        uint32_t x = 0, y = 0;
+        while (y < height) {
+            if (i + 2 > size) {
+                return false;
+            }
+            const uint32_t n = src[i], v = src[i + 1];
+            i += 2;
+            uint8_t *row = out + (size_t)width * y;
+            if (n > 0) {                    // Run of n pixels, alternating the two nibbles in RLE4
+                const uint32_t k = std::min(n, width - x);
+                if (rle4) {
+                    for (uint32_t j = 0; j < k; ++j) {
+                        row[x + j] = (j & 1) ? v & 15 : v >> 4;
+                    }
+                } else {
+                    memset(row + x, v, k);
+                }
+                x += k;
+            } else if (v == 0) {            // End of line
+                x = 0;
+                ++y;
+            } else if (v == 1) {            // End of bitmap
+                return true;
+            } else if (v == 2) {            // Move right and up
+                if (i + 2 > size) {
+                    return false;
+                }
+                x = std::min(x + src[i], width);
+                y += src[i + 1];
+                i += 2;
+            } else {                        // v pixels as they are, padded to 16 bits
+                const size_t bytes = rle4 ? (v + 1) / 2 : v;
+                if (i + bytes > size) {
+                    return false;
+                }
+                const uint32_t k = std::min(v, width - x);
+                if (rle4) {
+                    for (uint32_t j = 0; j < k; ++j) {
+                        row[x + j] = (j & 1) ? src[i + j / 2] & 15 : src[i + j / 2] >> 4;
+                    }
+                } else {
+                    memcpy(row + x, src + i, k);
+                }
+                x += k;
+                i += (bytes + 1) & ~(size_t)1;
+            }
+        }
+        return true;
+    }
+
+    // Append a row of width indices in RLE8 or RLE4 to out, with its end of line. Runs of 2 equal
+    // pixels or more are encoded as runs, the pixels between them in the absolute mode (3 or more).
+    inline void encode_rle_row(const uint8_t *row, const uint32_t width, const bool rle4, std::vector<uint8_t>& out) {
+        uint32_t x = 0;
+        while (x < width) {
+            uint32_t run = 1;
+            while (x + run < width && run < 255 && row[x + run] == row[x]) {
+                ++run;
+            }
+            if (run >= 2) {
+                out.push_back(run);
+                out.push_back(rle4 ? (row[x] << 4) | row[x] : row[x]);
+                x += run;
+                continue;
+            }
+            uint32_t n = 1;
+            while (x + n < width && n < 255 && !(x + n + 1 < width && row[x + n] == row[x + n + 1])) {
+                ++n;
+            }
+            if (n < 3) {                    // The absolute mode needs 3 pixels at least
+                for (uint32_t j = 0; j < n; ++j) {
+                    out.push_back(1);
+                    out.push_back(rle4 ? row[x + j] << 4 : row[x + j]);
+                }
+            } else {
+                out.push_back(0);
+                out.push_back(n);
+                const size_t start = out.size();
+                if (rle4) {
+                    for (uint32_t j = 0; j < n; j += 2) {
+                        out.push_back((row[x + j] << 4) | (j + 1 < n ? row[x + j + 1] : 0));
+                    }
+                } else {
+                    out.insert(out.end(), row + x, row + x + n);
+                }
+                if ((out.size() - start) & 1) {
+                    out.push_back(0);
+                }
+            }
+            x += n;
+        }
+        out.push_back(0);
+        out.push_back(0);
+    }
+}
+
+// BMPThreadPool class
+// Runs the effects across cores in bands of rows. Small images, calls nested in a band
+// and calls made while the pool is busy with another image run on the calling thread.
+class BMPThreadPool {
+    public:
+        static const size_t BandBytes = 256 * 1024;     // Bytes per band, about what a core keeps in its L2 cache
+        static const size_t SerialBytes = 1024 * 1024;  // Images below that are not worth waking up the workers
+
+        static BMPThreadPool& instance() {
+            static BMPThreadPool pool;
+            return pool;
+        }
+
+        ~BMPThreadPool() {
+            stop();
+        }
+
+        // Number of threads an effect runs on, the calling thread included
+        void set_threads(const uint32_t n) {
+            std::lock_guard<std::mutex> run(run_mutex);
+            stop();
+            threads = n == 0 ? 1 : n;
+        }
+
+        uint32_t get_threads() const {
+            return threads;
+        }
+
+        // Call f(begin, end) on bands of rows that cover [0, rows), row_bytes being the bytes processed per row
+        template <typename F>
+        void for_rows(const uint32_t rows, const size_t row_bytes, F f) {
+            uint32_t band = std::max<size_t>(1, BandBytes / std::max<size_t>(1, row_bytes));
+            if (threads <= 1 || rows <= band || rows * row_bytes < SerialBytes || in_worker() || !run_mutex.try_lock()) {
+                f(0, rows);
+                return;
+            }
+            std::lock_guard<std::mutex> run(run_mutex, std::adopt_lock);
+            start();
+
+            std::function<void(uint32_t, uint32_t)> fn(f);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                job = &fn;
+                job_rows = rows;
+                job_band = band;
+                next_row = 0;
+                pending = workers.size();
+                ++generation;
+            }
+            wake.notify_all();
+
+            work();
+
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [this] { return pending == 0; });
+            job = nullptr;
+        }
+
+    private:
+        std::atomic<uint32_t> threads{ std::max(1u, std::thread::hardware_concurrency()) };
+        std::vector<std::thread> workers;
+        std::mutex run_mutex;                           // One image at a time
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+        bool stopping{ false };
+        uint64_t generation{ 0 };
+        size_t pending{ 0 };
+
+        std::function<void(uint32_t, uint32_t)> *job{ nullptr };
+        uint32_t job_rows{ 0 };
+        uint32_t job_band{ 0 };
+        std::atomic<uint32_t> next_row{ 0 };
+
+        BMPThreadPool() {}
+
+        static bool& in_worker() {
+            static thread_local bool flag = false;
+            return flag;
+        }
+
+        void start() {
+            if (workers.empty()) {
+                stopping = false;
+                for (uint32_t i = 1; i < threads; ++i) {
+                    workers.emplace_back([this] { worker_loop(); });
+                }
+            }
+        }
+
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (size_t i = 0; i < workers.size(); ++i) {
+                workers[i].join();
+            }
+            workers.clear();
+        }
+
+        void worker_loop() {
+            in_worker() = true;
+            uint64_t seen = 0;
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+
+                lock.unlock();
+                work();
+                lock.lock();
+
+                if (--pending == 0) {
+                    done.notify_one();
+                }
+            }
+        }
+
+        // Take bands until all the rows are done
+        void work() {
+            for (;;) {
+                uint32_t begin = next_row.fetch_add(job_band);
+                if (begin >= job_rows) {
+                    break;
+                }
+                (*job)(begin, std::min(begin + job_band, job_rows));
+            }
+        }
+};
+
+// Pixel layouts, the value is the number of channels
+enum class PixelFormat : uint32_t {
+    BGR24 = 3,
+    BGRA32 = 4
+};
+
+// BMPImage class
+// Typed view over the pixels of a BMP (see BMP::view and BMP::dispatch). The number of channels
+// is a compile time constant, so the loops written against it have no branch on the layout.
+template <PixelFormat Format>
+class BMPImage {
+    public:
+        static const uint32_t channels = (uint32_t)Format;
+
+        BMPImage(uint8_t *pixels_, const int64_t stride_, const int32_t width_, const int32_t height_) :
+            pixels(pixels_), stride(stride_), w(width_), h(height_) {}
+
+        int32_t width() const {
+            return w;
+        }
+
+        int32_t height() const {
+            return h;
+        }
+
+        uint32_t Channels() const {
+            return channels;
+        }
+
+        int64_t Stride() const {
+            return stride;
+        }
+
+        uint8_t *row_data(const uint32_t y) const {
+            assert(y < (uint32_t)h);
+            return pixels + stride * y;
+        }
+
+        uint8_t *pixel(const uint32_t x, const uint32_t y) const {
+            assert(x < (uint32_t)w && y < (uint32_t)h);
+            return pixels + stride * y + channels * x;
+        }
+
+        Color getPixel(const uint32_t x, const uint32_t y) const {
+            const uint8_t *px = pixel(x, y);
+            return Color(px[2], px[1], px[0], channels == 4 ? px[3] : 255);
+        }
+
+        void setPixel(const uint32_t x, const uint32_t y, const Color& c) const {
+            uint8_t *px = pixel(x, y);
+            px[0] = c.b;
+            px[1] = c.g;
+            px[2] = c.r;
+            if (channels == 4) {
+                px[3] = c.alpha;
+            }
+        }
+
+        // Call f(x, y, px) on every pixel, px pointing to its channels bytes
+        template <typename F>
+        void for_each_pixel(F f) const {
+            for (uint32_t y = 0; y < (uint32_t)h; ++y) {
+                uint8_t *px = row_data(y);
+                for (uint32_t x = 0; x < (uint32_t)w; ++x, px += channels) {
+                    f(x, y, px);
+                }
+            }
+        }
+
+    private:
+        uint8_t *pixels;
+        int64_t stride;
+        int32_t w;
+        int32_t h;
+};
+
+// BMPInstrumentation class
+// Counters per operation, built in when BMP_INSTRUMENT is defined. The I/O, the effects, the filters
+// and the drawers time each call and count the bytes and the pixels it goes through (update and the
+// drawers are timed only). The totals are kept by operation name, and a hook can get each call as it ends to
+// feed a metrics system. Only the outermost operation of a thread is counted: GaussianBlur, not the
+// box blurs it runs. Without BMP_INSTRUMENT the probes compile to nothing and the totals stay empty.
+
+// One call, or the totals of an operation
+struct BMPOpStats {
+    uint64_t calls{ 0 };
+    uint64_t nanoseconds{ 0 };
+    uint64_t bytes{ 0 };                // Bytes of pixels gone through
+    uint64_t pixels{ 0 };
+
+    double mpix_per_second() const {
+        return nanoseconds ? pixels * 1e3 / nanoseconds : 0.0;
+    }
+
+    double mb_per_second() const {
+        return nanoseconds ? bytes * 1e3 / nanoseconds : 0.0;
+    }
+};
+
+class BMPInstrumentation {
+    public:
+        // Called from the thread that ran the operation, right after it, with calls set to 1
+        typedef void (*Hook)(const char *op, const BMPOpStats& call, void *user);
+
+        static BMPInstrumentation& instance() {
+            static BMPInstrumentation instrumentation;
+            return instrumentation;
+        }
+
+        // nullptr removes the hook
+        void set_hook(const Hook f, void *user = nullptr) {
+            std::lock_guard<std::mutex> lock(mutex);
+            hook = f;
+            hook_user = user;
+        }
+
+        // Totals by operation since the start or the last reset
+        std::map<std::string, BMPOpStats> totals() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return std::map<std::string, BMPOpStats>(ops.begin(), ops.end());
+        }
+
+        void reset() {
+            std::lock_guard<std::mutex> lock(mutex);
+            ops.clear();
+        }
+
+        void record(const char *op, const uint64_t nanoseconds, const uint64_t bytes, const uint64_t pixels) {
+            BMPOpStats call;
+            call.calls = 1;
+            call.nanoseconds = nanoseconds;
+            call.bytes = bytes;
+            call.pixels = pixels;
+            Hook f;
+            void *user;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                BMPOpStats& total = ops[op];
+                total.calls++;
+                total.nanoseconds += nanoseconds;
+                total.bytes += bytes;
+                total.pixels += pixels;
+                f = hook;
+                user = hook_user;
+            }
+            if (f) {
+                f(op, call, user);
+            }
+        }
+
+        // Operations running in this thread, the nested ones are not counted
+        static uint32_t& depth() {
+            static thread_local uint32_t running = 0;
+            return running;
+        }
+
+    private:
+        struct NameLess {
+            bool operator()(const char *a, const char *b) const {
+                return strcmp(a, b) < 0;
+            }
+        };
+
+        std::mutex mutex;
+        std::map<const char*, BMPOpStats, NameLess> ops;    // The names are string literals
+        Hook hook{ nullptr };
+        void *hook_user{ nullptr };
+
+        BMPInstrumentation() {}
+};
+
+// Times the scope it is declared in as one call of op, see BMP_PROBE
+class BMPOpProbe {
+    public:
+        BMPOpProbe(const char *op_, const uint64_t bytes_, const uint64_t pixels_)
+            : op(op_), bytes(bytes_), pixels(pixels_), outer(BMPInstrumentation::depth()++ == 0) {
+            if (outer) {
+                start = std::chrono::steady_clock::now();
+            }
+        }
+
+        ~BMPOpProbe() {
+            --BMPInstrumentation::depth();
+            if (outer) {
+                const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                BMPInstrumentation::instance().record(op, ns, bytes, pixels);
+            }
+        }
+
+        // For the operations that know their sizes only at the end (read)
+        void count(const uint64_t bytes_, const uint64_t pixels_) {
+            bytes = bytes_;
+            pixels = pixels_;
+        }
+
+    private:
+        const char *op;
+        uint64_t bytes;
+        uint64_t pixels;
+        bool outer;
+        std::chrono::steady_clock::time_point start;
+};
+
+#ifdef BMP_INSTRUMENT
+#define BMP_PROBE(op, bytes, pixels) BMPOpProbe bmp_probe(op, bytes, pixels)
+#define BMP_PROBE_COUNT(bytes, pixels) bmp_probe.count(bytes, pixels)
+#else
+#define BMP_PROBE(op, bytes, pixels) ((void)0)
+#define BMP_PROBE_COUNT(bytes, pixels) ((void)0)
+#endif
+
+// BMPBufferPool class
+// Pixel arrays come from here, aligned to 64 bytes for the SIMD kernels. Freed arrays are kept
+// by size class and handed out again, so images of the same size created and destroyed in a loop
+// do not go back to the system allocator every time.
+class BMPBufferPool {
+    public:
+        static const size_t Alignment = 64;
+        static const size_t MinPooled = 64 * 1024;      // Smaller arrays are freed right away
+
+        static BMPBufferPool& instance() {
+            static BMPBufferPool pool;
+            return pool;
+        }
+
+        // Most bytes kept for reuse, 256 MB by default, 0 turns the pool off
+        void set_limit(const size_t bytes) {
+            std::lock_guard<std::mutex> lock(mutex);
+            limit = bytes;
+            trim_to(limit);
+        }
+
+        size_t get_limit() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return limit;
+        }
+
+        // Bytes kept for reuse right now
+        size_t cached() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return cached_bytes;
+        }
+
+        // Give all the kept arrays back to the system
+        void trim() {
+            std::lock_guard<std::mutex> lock(mutex);
+            trim_to(0);
+        }
+
+        void *acquire(const size_t bytes) {
+            const size_t size = size_class(bytes);
+            if (size >= MinPooled) {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::map<size_t, std::vector<void*> >::iterator it = free_lists.find(size);
+                if (it != free_lists.end() && !it->second.empty()) {
+                    void *p = it->second.back();
+                    it->second.pop_back();
+                    cached_bytes -= size;
+                    return p;
+                }
+            }
+            void *p = allocate_aligned(size);
+            if (!p) {
+                throw std::bad_alloc();
+            }
+            return p;
+        }
+
+        void release(void *p, const size_t bytes) {
+            const size_t size = size_class(bytes);
+            if (size >= MinPooled) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (cached_bytes + size <= limit) {
+                    free_lists[size].push_back(p);
+                    cached_bytes += size;
+                    return;
+                }
+            }
+            free_aligned(p);
+        }
+
+        // Sizes are rounded up to a quarter of their power of two, at most 25% is wasted
+        static size_t size_class(const size_t bytes) {
+            size_t top = Alignment;
+            while (top <= bytes / 2) {
+                top *= 2;
+            }
+            size_t step = top / 4 > Alignment ? top / 4 : (size_t)Alignment;
+            size_t size = (bytes + step - 1) / step * step;
+            return size > Alignment ? size : (size_t)Alignment;
+        }
+
+    private:
+        std::mutex mutex;
+        std::map<size_t, std::vector<void*> > free_lists;
+        size_t cached_bytes{ 0 };
+        size_t limit{ 256 << 20 };
+
+        BMPBufferPool() {}
+
+        ~BMPBufferPool() {
+            trim_to(0);
+        }
+
+        void trim_to(const size_t bytes) {
+            std::map<size_t, std::vector<void*> >::iterator it = free_lists.begin();
+            for (; it != free_lists.end() && cached_bytes > bytes; ++it) {
+                while (!it->second.empty() && cached_bytes > bytes) {
+                    free_aligned(it->second.back());
+                    it->second.pop_back();
+                    cached_bytes -= it->first;
+                }
+            }
+        }
+
+        static void *allocate_aligned(const size_t size) {
+#ifdef _WIN32
+            return _aligned_malloc(size, Alignment);
+#else
+            void *p = nullptr;
+            return posix_memalign(&p, Alignment, size) == 0 ? p : nullptr;
+#endif
+        }
+
+        static void free_aligned(void *p) {
+#ifdef _WIN32
+            _aligned_free(p);
+#else
+            free(p);
+#endif
+        }
+};
+
+// Allocator of the BMP pixel arrays, from BMPBufferPool. The elements are default initialized,
+// so resizing leaves the new pixels as they are: whoever resizes writes them right after.
+template <typename T>
+struct BMPPixelAllocator {
+    typedef T value_type;
+
+    BMPPixelAllocator() {}
+
+    template <typename U>
+    BMPPixelAllocator(const BMPPixelAllocator<U>&) {}
+
+    T *allocate(const size_t n) {
+        return (T*)BMPBufferPool::instance().acquire(n * sizeof(T));
+    }
+
+    void deallocate(T *p, const size_t n) {
+        BMPBufferPool::instance().release(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    void construct(U *p) {
+        ::new((void*)p) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U *p, Args&&... args) {
+        ::new((void*)p) U(std::forward<Args>(args)...);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const BMPPixelAllocator<T>&, const BMPPixelAllocator<U>&) {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const BMPPixelAllocator<T>&, const BMPPixelAllocator<U>&) {
+    return false;
+}
+
+// BMPIndexed class
+// An image of palette indices read from or written to a 1, 4 or 8 bits file, RLE compressed or not.
+// The indices take one byte per pixel in memory, rows from the bottom as in BMP, which reads the
+// same files expanded to 24 bits.
+class BMPIndexed {
+    public:
+        BMPIndexed(const char *fname) {
+            read(fname);
+        }
+
+        // A new image of indices 0, with a palette of 2^bits black entries
+        BMPIndexed(int32_t width, int32_t height, uint32_t bits = 8) {
+            if (width <= 0 || height <= 0) {
+                std::cerr << "The image width and height must be positive numbers.\n";
+                width = height = 0;
+            }
+            if (bits != 1 && bits != 4 && bits != 8) {
+                std::cerr << "BMPIndexed error: the bits per pixel must be 1, 4 or 8\n";
+                bits = 8;
+            }
+            bmp_info_header.width = width;
+            bmp_info_header.height = height;
+            bmp_info_header.bit_count = bits;
+            colors = 1 << bits;
+            data.assign((size_t)width * height, 0);
+        }
+
+        static BMPIndexed decode(const uint8_t *bytes, const size_t size) {
+            BMPIndexed image;
+            image.load(bytes, size, "(memory)");
+            return image;
+        }
+
+        // Returns false when the file cannot be opened or is not a whole 1, 4 or 8 bits BMP
+        bool read(const char *fname) {
+            std::ifstream inp{ fname, std::ios_base::binary };
+            if (!inp) {
+                std::cerr << "Unable to open the input image file.\n";
+                return false;
+            }
+            std::vector<uint8_t> file((std::istreambuf_iterator<char>(inp)), std::istreambuf_iterator<char>());
+            return load(file.data(), file.size(), fname);
+        }
+
+        // The whole file in out. With compress, the 8 and 4 bits images are RLE8 and RLE4 compressed.
+        void encode(std::vector<uint8_t>& out, const bool compress = true) const {
+            const uint32_t bits = bmp_info_header.bit_count, width = bmp_info_header.width;
+            const uint32_t headers = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + 4 * colors;
+            const bool rle = compress && bits != 1;
+            out.resize(headers);
+            if (rle) {
+                for (uint32_t y = 0; y < (uint32_t)bmp_info_header.height; ++y) {
+                    bmp_kernels::encode_rle_row(row_data(y), width, bits == 4, out);
+                }
+                out.back() = 1;             // The last end of line becomes the end of bitmap
+            } else {
+                const uint32_t file_stride = (width * bits + 31) / 32 * 4;
+                out.resize(headers + (size_t)file_stride * bmp_info_header.height, 0);
+                for (uint32_t y = 0; y < (uint32_t)bmp_info_header.height; ++y) {
+                    bmp_kernels::pack_indices(row_data(y), bits, width, &out[headers + (size_t)file_stride * y]);
+                }
+            }
+
+            BMPFileHeader file;
+            BMPInfoHeader info = bmp_info_header;
+            file.offset_data = headers;
+            file.file_size = out.size();
+            info.size = sizeof(BMPInfoHeader);
+            info.compression = rle ? (bits == 8 ? 1 : 2) : 0;
+            info.size_image = out.size() - headers;
+            info.colors_used = colors;
+            info.colors_important = 0;
+            memcpy(out.data(), &file, sizeof(file));
+            memcpy(out.data() + sizeof(file), &info, sizeof(info));
+            for (uint32_t i = 0; i < colors; ++i) {
+                uint8_t *entry = out.data() + sizeof(file) + sizeof(info) + 4 * i;
+                memcpy(entry, palette[i], 3);
+                entry[3] = 0;
+            }
+        }
+
+        // Returns false when the file could not be written
+        bool write(const char *fname, const bool compress = true) const {
+            std::vector<uint8_t> file;
+            encode(file, compress);
+            std::ofstream of{ fname, std::ios_base::binary };
+            if (!of || !of.write((const char*)file.data(), file.size())) {
+                std::cerr << "Unable to write the output image file.\n";
+                return false;
+            }
+            return true;
+        }
+
+        int32_t width() const {
+            return bmp_info_header.width;
+        }
+
+        int32_t height() const {
+            return bmp_info_header.height;
+        }
+
+        uint32_t Bits() const {
+            return bmp_info_header.bit_count;
+        }
+
+        // Entries of the palette, 2^Bits() at most
+        uint32_t Colors() const {
+            return colors;
+        }
+
+        Color getColor(const uint32_t i) const {
+            assert(i < colors);
+            return Color(palette[i][2], palette[i][1], palette[i][0]);
+        }
+
+        void setColor(const uint32_t i, const Color& c) {
+            assert(i < (1u << bmp_info_header.bit_count));
+            palette[i][0] = c.b;
+            palette[i][1] = c.g;
+            palette[i][2] = c.r;
+            colors = std::max(colors, i + 1);
+        }
+
+        // width() indices of row y, each below 2^Bits()
+        uint8_t *row_data(const uint32_t y) {
+            assert(y < (uint32_t)bmp_info_header.height);
+            return data.data() + (size_t)bmp_info_header.width * y;
+        }
+
+        const uint8_t *row_data(const uint32_t y) const {
+            assert(y < (uint32_t)bmp_info_header.height);
+            return data.data() + (size_t)bmp_info_header.width * y;
+        }
+
+        uint8_t getIndex(const uint32_t x, const uint32_t y) const {
+            assert(x < (uint32_t)bmp_info_header.width);
+            return row_data(y)[x];
+        }
+
+        void setIndex(const uint32_t x, const uint32_t y, const uint8_t i) {
+            assert(x < (uint32_t)bmp_info_header.width && i < (1u << bmp_info_header.bit_count));
+            row_data(y)[x] = i;
+        }
+
+    private:
+        friend class BMP;
+
+        BMPInfoHeader bmp_info_header;
+        uint8_t palette[256][4] = {};       // BGR and a 0 byte, as in the file; the entries past colors stay black
+        uint32_t colors{ 0 };
+        std::vector<uint8_t, BMPPixelAllocator<uint8_t> > data;
+
+        BMPIndexed() {}
+
+        // Decode a whole file held in memory, the image is left empty when it cannot be decoded
+        bool load(const uint8_t *bytes, const size_t size, const char *fname) {
+            BMPFileHeader file;
+            BMPInfoHeader info;
+            if (size < sizeof(file) + sizeof(info)) {
+                std::cerr << "Error! Unrecognized file format.\n";
+                return false;
+            }
+            memcpy(&file, bytes, sizeof(file));
+            memcpy(&info, bytes + sizeof(file), sizeof(info));
+            const uint32_t bits = info.bit_count;
+            const bool rle = (info.compression == 1 && bits == 8) || (info.compression == 2 && bits == 4);
+            if (file.file_type != 0x4D42 || info.size < sizeof(BMPInfoHeader)) {
+                std::cerr << "Error! Unrecognized file format.\n";
+                return false;
+            }
+            if ((bits != 1 && bits != 4 && bits != 8) || (info.compression != 0 && !rle)) {
+                std::cerr << "BMPIndexed error: the file \"" << fname << "\" is not an uncompressed 1, 4 or 8 bits or an RLE BMP\n";
+                return false;
+            }
+            // Rows from the top are only allowed without compression
+            const bool top_down = info.height < 0 && !rle;
+            const uint32_t width = info.width, height = top_down ? -(int64_t)info.height : info.height;
+            const uint32_t file_stride = (width * bits + 31) / 32 * 4;
+            const uint64_t palette_offset = sizeof(file) + (uint64_t)info.size;
+            const uint32_t count = info.colors_used && info.colors_used < (1u << bits) ? info.colors_used : 1u << bits;
+            if (info.width <= 0 || (info.height <= 0 && !top_down) || palette_offset + 4 * count > size ||
+                file.offset_data > size || (!rle && file.offset_data + (uint64_t)file_stride * height > size)) {
+                std::cerr << "Error! The file \"" << fname << "\" is truncated\n";
+                return false;
+            }
+
+            data.resize((size_t)width * height);
+            if (rle) {
+                if (!bmp_kernels::decode_rle(bytes + file.offset_data, size - file.offset_data, bits == 4, width, height, data.data())) {
+                    std::cerr << "Error! The file \"" << fname << "\" is truncated\n";
+                    data.clear();
+                    return false;
+                }
+            } else {
+                for (uint32_t y = 0; y < height; ++y) {
+                    const uint32_t file_row = top_down ? height - 1 - y : y;
+                    bmp_kernels::unpack_indices(bytes + file.offset_data + (size_t)file_stride * file_row, bits, width,
+                                                data.data() + (size_t)width * y);
+                }
+            }
+            memset(palette, 0, sizeof(palette));
+            memcpy(palette, bytes + palette_offset, 4 * count);
+            colors = count;
+            bmp_info_header = info;
+            bmp_info_header.height = height;
+            bmp_info_header.compression = 0;
+            return true;
+        }
+};
+
+// BMP class
+class BMP {
+    public:
+        BMP(const char *fname) {
+            read(fname);
+        }
+
+        BMP(int32_t width, int32_t height, bool has_alpha = true) {
+            create(width, height, has_alpha);
+        }
+
+        // The colors of an indexed image, 24 bits or 32 bits with an opaque alpha
+        explicit BMP(const BMPIndexed& image, bool has_alpha = false) {
+            expand(image, has_alpha);
+        }
+
+        // A new image with its pixels left uninitialized, for when all of them are written right away
+        static BMP uninitialized(int32_t width, int32_t height, bool has_alpha = true) {
+            BMP image;
+            image.create(width, height, has_alpha, false);
+            return image;
+        }
+
+        BMP(const BMP& other) : file_header(other.file_header), bmp_info_header(other.bmp_info_header),
+                                bmp_color_header(other.bmp_color_header), channels(other.channels), row_stride(other.row_stride),
+                                dirty_rows(other.dirty_rows), layout(other.layout), plane_stride(other.plane_stride),
+                                premultiplied(other.premultiplied) {
+            if (layout == PixelLayout::Planar) {    // Planes are always owned
+                data = other.data;
+                pixels = data.data();
+                stride = other.stride;
+                return;
+            }
+            // A copy always owns its pixels, even when the source is a mapped view
+            data.resize(row_stride * bmp_info_header.height);
+            pixels = data.data();
+            stride = row_stride;
+            copy_rows(other);
+        }
+
+        BMP(BMP&& other) : file_header(other.file_header), bmp_info_header(other.bmp_info_header),
+                           bmp_color_header(other.bmp_color_header), data(std::move(other.data)), pixels(other.pixels),
+                           channels(other.channels), row_stride(other.row_stride), stride(other.stride),
+                           mapping(other.mapping), mapping_size(other.mapping_size), dirty_rows(std::move(other.dirty_rows)),
+                           layout(other.layout), plane_stride(other.plane_stride), premultiplied(other.premultiplied) {
+            other.pixels = nullptr;
+            other.mapping = nullptr;
+            other.mapping_size = 0;
+        }
+
+        ~BMP() {
+            release_mapping();
+        }
+
+        BMP& operator=(const BMP& other) {
+            if (this != &other) {
+                BMP copy(other);
+                *this = std::move(copy);
+            }
+            return *this;
+        }
+
+        // Takes over the pixels of other, nothing is copied
+        BMP& operator=(BMP&& other) {
+            if (this != &other) {
+                release_mapping();
+                file_header = other.file_header;
+                bmp_info_header = other.bmp_info_header;
+                bmp_color_header = other.bmp_color_header;
+                data = std::move(other.data);
+                pixels = other.pixels;
+                channels = other.channels;
+                row_stride = other.row_stride;
+                stride = other.stride;
+                mapping = other.mapping;
+                mapping_size = other.mapping_size;
+                dirty_rows = std::move(other.dirty_rows);
+                layout = other.layout;
+                plane_stride = other.plane_stride;
+                premultiplied = other.premultiplied;
+                other.pixels = nullptr;
+                other.mapping = nullptr;
+                other.mapping_size = 0;
+            }
+            return *this;
+        }
+
+        // Map the file in memory and use its pixel array in place, no copy is made.
+        // Changes done through setPixel, the effects or the drawers are written straight to the file,
+        // unless read_only is set, then they are kept private to the process.
+        // A file that cannot be mapped or is not a whole BMP gives an empty image (width() is 0).
+        static BMP open_mapped(const char *fname, bool read_only = false) {
+            BMP image;
+#ifndef _WIN32
+            int fd = ::open(fname, read_only ? O_RDONLY : O_RDWR);
+            if (fd < 0) {
+                std::cerr << "Unable to open the input image file.\n";
+                return image;
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(BMPFileHeader) + sizeof(BMPInfoHeader)) {
+                std::cerr << "Error! Unrecognized file format.\n";
+                ::close(fd);
+                return image;
+            }
+
+            void *addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, read_only ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (addr == MAP_FAILED) {
+                std::cerr << "Unable to map the input image file.\n";
+                return image;
+            }
+            image.mapping = addr;
+            image.mapping_size = st.st_size;
+            image.attach((uint8_t*)addr, st.st_size, fname);   // Unmapped again when it fails
+#else
+            std::cerr << "open_mapped error: memory mapping is not supported on this platform\n";
+#endif
+            return image;
+        }
+
+        /// In-memory files
+
+        // Decode a whole BMP file held in memory into an image that owns its pixels.
+        // Bytes that are not a whole BMP give an empty image, its width() and height() are 0.
+        static BMP decode(const uint8_t *bytes, const size_t size) {
+            BMP_PROBE("decode", size, 0);
+            BMP image;
+            if (converted_format(bytes, size)) {
+                if (!image.load_converted(bytes, size, "(memory)")) {
+                    return BMP();
+                }
+                BMP_PROBE_COUNT(size, image.probe_pixels());
+                return image;
+            }
+            uint32_t offset_data;
+            bool top_down;
+            if (!image.parse(bytes, size, "(memory)", offset_data, top_down)) {
+                return BMP();
+            }
+            // One copy of the pixel array, the rows keep their padding and their order
+            const uint32_t file_stride = image.make_stride_aligned(4);
+            image.data.resize((size_t)file_stride * image.bmp_info_header.height);
+            memcpy(image.data.data(), bytes + offset_data, image.data.size());
+            image.set_rows(image.data.data(), file_stride, top_down);
+            BMP_PROBE_COUNT(size, image.probe_pixels());
+            return image;
+        }
+
+        // Decode without copying: the image uses the pixel array inside bytes with its padded stride,
+        // the buffer must outlive the image and the changes are made in it, as with open_mapped.
+        // Bytes that are not a whole BMP give an empty image, as with decode.
+        static BMP decode_view(uint8_t *bytes, const size_t size) {
+            BMP image;
+            image.attach(bytes, size, "(memory)");
+            return image;
+        }
+
+        // Bytes of the file encode produces
+        size_t encoded_size() {
+            return pack_headers_size() + (size_t)make_stride_aligned(4) * bmp_info_header.height;
+        }
+
+        // The whole file in out, resized to fit
+        void encode(std::vector<uint8_t>& out) {
+            out.resize(encoded_size());
+            encode_into(out.data(), out.size());
+        }
+
+        // The whole file in the size bytes at out. Returns the bytes used, 0 when they do not fit.
+        size_t encode_into(uint8_t *out, const size_t size) {
+            BMP_PROBE("encode", probe_bytes(), probe_pixels());
+            if (bmp_info_header.bit_count != 32 && bmp_info_header.bit_count != 24) {
+                std::cerr << "The program can treat only 24 or 32 bits per pixel BMP files\n";
+                return 0;
+            }
+            const size_t needed = encoded_size();
+            if (size < needed) {
+                std::cerr << "encode_into error: the buffer is too small\n";
+                return 0;
+            }
+            uint8_t *rows = out + pack_headers(out);
+            const uint32_t file_stride = make_stride_aligned(4);
+            BMPThreadPool::instance().for_rows(bmp_info_header.height, file_stride, [&](uint32_t begin, uint32_t end) {
+                pack_rows(rows + (size_t)file_stride * begin, begin, end);
+            });
+            return needed;
+        }
+
+#if __cplusplus >= 202002L
+        static BMP decode(std::span<const uint8_t> bytes) {
+            return decode(bytes.data(), bytes.size());
+        }
+
+        static BMP decode_view(std::span<uint8_t> bytes) {
+            return decode_view(bytes.data(), bytes.size());
+        }
+
+        size_t encode_into(std::span<uint8_t> out) {
+            return encode_into(out.data(), out.size());
+        }
+#endif
+
+        // Flush the changes done on a mapped image to the file
+        void sync() {
+#ifndef _WIN32
+            if (mapping) {
+                msync(mapping, mapping_size, MS_SYNC);
+            }
+#endif
+        }
+
+        bool is_mapped() const {
+            return mapping != nullptr;
+        }
+
+        // Number of threads the effects run on (see BMPThreadPool)
+        static void set_threads(const uint32_t n) {
+            BMPThreadPool::instance().set_threads(n);
+        }
+        
+        // Returns false when the file cannot be opened or is not a whole BMP. The 1, 4 and 8 bits files
+        // (RLE compressed or not) are expanded to 24 bits, the 16 bits ones to 24 or 32 bits.
+        bool read(const char *fname) {
+            BMP_PROBE("read", 0, 0);
+            std::ifstream inp{ fname, std::ios_base::binary };
+            if (inp) {
+                release_mapping();
+
+                // Parse the headers from a buffer large enough for all of them
+                uint8_t headers[sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader)];
+                inp.read((char*)headers, sizeof(headers));
+                if (converted_format(headers, inp.gcount())) {    // Decoded from the whole file
+                    inp.clear();
+                    inp.seekg(0, inp.beg);
+                    std::vector<uint8_t> file((std::istreambuf_iterator<char>(inp)), std::istreambuf_iterator<char>());
+                    const bool ok = load_converted(file.data(), file.size(), fname);
+                    BMP_PROBE_COUNT(file.size(), probe_pixels());
+                    return ok;
+                }
+                bool top_down;
+                uint32_t offset_data = read_headers(headers, inp.gcount(), fname, top_down);
+                inp.clear();
+
+                // Jump to the pixel data location
+                inp.seekg(offset_data, inp.beg);
+
+                // The pixel array in one read, the rows keep their padding and their order
+                const uint32_t file_stride = make_stride_aligned(4);
+                const uint32_t height = bmp_info_header.height > 0 ? bmp_info_header.height : 0;
+                data.resize((size_t)file_stride * height);
+                set_rows(data.data(), file_stride, top_down);
+                inp.read((char*)data.data(), data.size());
+                size_t read_bytes = inp.gcount();
+
+                // The pixels are not initialized, the ones a truncated file lacks are set to 0.
+                // The padding of the last row can be missing.
+                memset(data.data() + read_bytes, 0, data.size() - read_bytes);
+                BMP_PROBE_COUNT(read_bytes, probe_pixels());
+                return file_header.file_type == 0x4D42 && (channels == 3 || channels == 4) &&
+                       bmp_info_header.width > 0 && height > 0 && read_bytes + (file_stride - row_stride) >= data.size();
+            }
+            else {
+                std::cerr << "Unable to open the input image file.\n";
+                return false;
+            }
+        }
+
+        // Returns false when the file could not be written
+        bool write(const char *fname) {
+            std::vector<uint8_t> scratch;
+            return write(fname, scratch);
+        }
+
+        // Same as write, with scratch as the staging buffer so repeated writes reuse it.
+        // The padded rows are staged in large chunks and written with one call each, an unpadded
+        // image is written in a single call straight from its pixels. WriteHint::NoCache is meant
+        // for bulk exports, the file goes around the page cache (O_DIRECT) when the system allows it
+        // and its pages are dropped from the cache once written.
+        bool write(const char *fname, std::vector<uint8_t>& scratch, const WriteHint hint = WriteHint::Default) {
+            BMP_PROBE("write", probe_bytes(), probe_pixels());
+            if (bmp_info_header.bit_count != 32 && bmp_info_header.bit_count != 24) {
+                std::cerr << "The program can treat only 24 or 32 bits per pixel BMP files\n";
+                return false;
+            }
+
+#ifndef _WIN32
+            const int flags = O_WRONLY | O_CREAT | O_TRUNC;
+            int fd = -1;
+            bool direct = false;
+#ifdef O_DIRECT
+            if (hint == WriteHint::NoCache) {
+                fd = ::open(fname, flags | O_DIRECT, 0644);
+                direct = fd >= 0;
+            }
+#endif
+            if (fd < 0) {
+                fd = ::open(fname, flags, 0644);
+            }
+            if (fd < 0) {
+                std::cerr << "Unable to open the output image file.\n";
+                return false;
+            }
+
+            bool ok;
+            const uint32_t new_stride = make_stride_aligned(4);
+            if (!direct && (uint64_t)std::abs(stride) == new_stride && layout == PixelLayout::Interleaved && !premultiplied) {
+                // The rows are already laid out as in the file
+                uint8_t headers[sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader)];
+                struct iovec parts[2];
+                parts[0].iov_base = headers;
+                parts[0].iov_len = pack_headers(headers);
+                parts[1].iov_base = (void*)(stride < 0 ? row_data(bmp_info_header.height - 1) : pixels);
+                parts[1].iov_len = (size_t)new_stride * bmp_info_header.height;
+                ok = write_all(fd, parts, 2);
+            } else {
+                ok = stream_file(scratch, direct ? DirectAlign : 1, [&](const uint8_t *bytes, const size_t size, const bool last) {
+#ifdef O_DIRECT
+                    if (direct && last && size % DirectAlign != 0) { // The end of the file is not a whole block
+                        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                    }
+#else
+                    (void)last;
+#endif
+                    struct iovec part;
+                    part.iov_base = (void*)bytes;
+                    part.iov_len = size;
+                    return write_all(fd, &part, 1);
+                });
+            }
+            if (hint == WriteHint::NoCache) {
+                ok = fdatasync(fd) == 0 && ok;
+#ifdef POSIX_FADV_DONTNEED
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+            }
+            ok = ::close(fd) == 0 && ok;
+#else
+            (void)hint;
+            std::ofstream of{ fname, std::ios_base::binary };
+            if (!of) {
+                std::cerr << "Unable to open the output image file.\n";
+                return false;
+            }
+            bool ok = stream_file(scratch, 1, [&](const uint8_t *bytes, const size_t size, const bool) {
+                return (bool)of.write((const char*)bytes, size);
+            });
+#endif
+            if (ok) {
+                clearDirty();
+            } else {
+                std::cerr << "Unable to write the output image file.\n";
+            }
+            return ok;
+        }
+
+        // Rewrite only the rows changed since the image was read or written in fname, which must hold
+        // this image already (same size, format and row order). Any other file is written in full.
+        void update(const char *fname) {
+            BMP_PROBE("update", 0, 0);
+            std::fstream file{ fname, std::ios_base::binary | std::ios_base::in | std::ios_base::out };
+            BMPFileHeader file_header_on_disk;
+            BMPInfoHeader info_header_on_disk;
+            if (file) {
+                file.read((char*)&file_header_on_disk, sizeof(file_header_on_disk));
+                file.read((char*)&info_header_on_disk, sizeof(info_header_on_disk));
+            }
+            const bool top_down = stride < 0;
+            const int32_t height_on_disk = top_down ? -bmp_info_header.height : bmp_info_header.height;
+            if (!file || file_header_on_disk.file_type != 0x4D42 || info_header_on_disk.width != bmp_info_header.width ||
+                info_header_on_disk.height != height_on_disk || info_header_on_disk.bit_count != bmp_info_header.bit_count ||
+                info_header_on_disk.compression != bmp_info_header.compression) {
+                file.close();
+                write(fname);
+                return;
+            }
+
+            // Runs of dirty rows, each written with one call
+            const uint32_t new_stride = make_stride_aligned(4);
+            const uint32_t height = bmp_info_header.height;
+            std::vector<uint8_t> buffer;
+            for (uint32_t y = 0; y < height; ) {
+                if (!dirty_rows[y]) {
+                    ++y;
+                    continue;
+                }
+                uint32_t end = y;
+                while (end < height && dirty_rows[end] && (size_t)(end - y) * new_stride < BMPThreadPool::BandBytes) {
+                    ++end;
+                }
+                // Rows of the file in order: from the bottom, or from the top for a top-down file
+                const uint32_t file_row = top_down ? height - end : y;
+                buffer.assign((size_t)(end - y) * new_stride, 0);
+                for (uint32_t r = y; r < end; ++r) {
+                    uint32_t k = top_down ? end - 1 - r : r - y;
+                    export_row(r, &buffer[(size_t)k * new_stride]);
+                }
+                file.seekp(file_header_on_disk.offset_data + (uint64_t)file_row * new_stride);
+                file.write((const char*)buffer.data(), buffer.size());
+                y = end;
+            }
+            if (file) {
+                clearDirty();
+            } else {
+                std::cerr << "Unable to update the output image file.\n";
+            }
+        }
+
+        /// Dirty rows
+
+        // Rows changed through setPixel, the effects, blit and the drawers are tracked for update.
+        // Writes made through row_data, pixel_unchecked or a view are not, mark them with markDirty.
+        void markDirty(const uint32_t y_begin, const uint32_t y_end) {
+            uint32_t end = std::min<uint32_t>(y_end, dirty_rows.size());
+            if (y_begin < end) {
+                memset(&dirty_rows[y_begin], 1, end - y_begin);
+            }
+        }
+
+        bool isDirty(const uint32_t y) const {
+            return y < dirty_rows.size() && dirty_rows[y];
+        }
+
+        void clearDirty() {
+            std::fill(dirty_rows.begin(), dirty_rows.end(), 0);
+        }
+
+        int32_t width() const {
+            return bmp_info_header.width;
+        }
+
+        int32_t height() const {
+            return bmp_info_header.height;
+        }
+        
+        uint32_t Channels() const {
+            return channels;
+        }
+        
+        // Stride between two rows in bytes, negative when the rows are addressed from the top
+        int64_t Stride() const {
+            return stride;
+        }
+
+        bool inside(const uint32_t x, const uint32_t y) const {
+            return x < (uint32_t)bmp_info_header.width && y < (uint32_t)bmp_info_header.height;
+        }
+
+        /// Unchecked access, the coordinates are only checked by assertions in debug builds
+
+        // First byte of row y, the next row starts Stride() bytes further
+        uint8_t *row_data(const uint32_t y) {
+            assert(y < (uint32_t)bmp_info_header.height && layout == PixelLayout::Interleaved);
+            return pixels + stride * y;
+        }
+
+        const uint8_t *row_data(const uint32_t y) const {
+            assert(y < (uint32_t)bmp_info_header.height && layout == PixelLayout::Interleaved);
+            return pixels + stride * y;
+        }
+
+#if __cplusplus >= 202002L
+        // The width * Channels() bytes of row y, without the padding
+        std::span<uint8_t> row(const uint32_t y) {
+            return std::span<uint8_t>(row_data(y), row_stride);
+        }
+
+        std::span<const uint8_t> row(const uint32_t y) const {
+            return std::span<const uint8_t>(row_data(y), row_stride);
+        }
+#endif
+
+        // Channels() bytes of pixel (x, y), in BGR(A) order
+        uint8_t *pixel_unchecked(const uint32_t x, const uint32_t y) {
+            assert(inside(x, y) && layout == PixelLayout::Interleaved);
+            return pixels + stride * y + channels * x;
+        }
+
+        const uint8_t *pixel_unchecked(const uint32_t x, const uint32_t y) const {
+            assert(inside(x, y) && layout == PixelLayout::Interleaved);
+            return pixels + stride * y + channels * x;
+        }
+
+        // Typed view of the pixels, Format must match the number of channels of the image
+        template <PixelFormat Format>
+        BMPImage<Format> view() {
+            assert(channels == (uint32_t)Format);
+            SetLayout(PixelLayout::Interleaved);
+            return BMPImage<Format>(pixels, stride, bmp_info_header.width, bmp_info_header.height);
+        }
+
+        // Call f with the typed view matching the layout of the image,
+        // f must accept both a BMPImage<PixelFormat::BGR24> and a BMPImage<PixelFormat::BGRA32>
+        template <typename F>
+        void dispatch(F f) {
+            if (channels == 4) {
+                f(view<PixelFormat::BGRA32>());
+            } else {
+                f(view<PixelFormat::BGR24>());
+            }
+        }
+
+        // The colors are straight, they are converted on a premultiplied image
+        Color getPixel(const uint32_t x, const uint32_t y) const {
+            assert(inside(x, y));
+            uint8_t px[4] = { 0, 0, 0, 255 };
+            for (uint32_t c = 0; c < channels; ++c) {
+                px[c] = layout == PixelLayout::Planar ? plane_data(c, y)[x] : pixel_unchecked(x, y)[c];
+            }
+            if (premultiplied) {
+                for (uint32_t c = 0; c < 3; ++c) {
+                    px[c] = bmp_kernels::unpremultiply_byte(px[c], px[3]);
+                }
+            }
+            return Color(px[2], px[1], px[0], px[3]);
+        }
+
+        void setPixel(const uint32_t x, const uint32_t y, const Color& c) {
+            assert(inside(x, y));
+            dirty_rows[y] = 1;
+            uint8_t px[4] = { c.b, c.g, c.r, c.alpha };
+            if (premultiplied) {
+                for (uint32_t i = 0; i < 3; ++i) {
+                    px[i] = bmp_kernels::premultiply_byte(px[i], c.alpha);
+                }
+            }
+            for (uint32_t i = 0; i < channels; ++i) {
+                if (layout == PixelLayout::Planar) {
+                    plane_data(i, y)[x] = px[i];
+                } else {
+                    pixel_unchecked(x, y)[i] = px[i];
+                }
+            }
+        }
+
+        void clear(const uint8_t c) {
+            BMP_PROBE("clear", probe_bytes(), probe_pixels());
+            SetLayout(PixelLayout::Interleaved);
+            markDirty(0, bmp_info_header.height);
+            BMPThreadPool::instance().for_rows(bmp_info_header.height, row_stride, [&](uint32_t begin, uint32_t end) {
+                if (stride == row_stride) {
+                    memset(row_data(begin), c, (size_t)row_stride * (end - begin));
+                } else { // Leave the row padding untouched
+                    for (uint32_t y = begin; y < end; ++y) {
+                        memset(row_data(y), c, row_stride);
+                    }
+                }
+            });
+        }
+
+        void CopyFrom(BMP& image) {
+            if (image.channels == channels && image.height() == bmp_info_header.height && image.width() == bmp_info_header.width) { // Can copy
+                SetLayout(PixelLayout::Interleaved);
+                image.SetLayout(PixelLayout::Interleaved);
+                copy_rows(image);
+                markDirty(0, bmp_info_header.height);
+            } else {
+                std::cerr << "CopyFrom error!\n";
+            }
+        }
+
+        // Same as CopyFrom, but an image that owns its pixels just takes over the ones of image
+        void CopyFrom(BMP&& image) {
+            if (image.channels == channels && image.height() == bmp_info_header.height && image.width() == bmp_info_header.width) {
+                if (mapping || image.mapping) { // The pixels stay in the mapped file
+                    image.SetLayout(PixelLayout::Interleaved);
+                    copy_rows(image);
+                } else {
+                    *this = std::move(image);
+                }
+                markDirty(0, bmp_info_header.height);
+            } else {
+                std::cerr << "CopyFrom error!\n";
+            }
+        }
+
+        // Put the src_rect part of src at dst on this image, converting between 24 and 32 bits and between
+        // straight and premultiplied alpha (see Premultiply).
+        // Both rectangles are clipped to their images.
+        void blit(const BMP& src, const Rect& src_rect, const Point& dst, const BlendMode mode = BlendMode::Copy) {
+            BMP_PROBE("blit", 0, 0);
+            SetLayout(PixelLayout::Interleaved);
+            if (src.layout == PixelLayout::Planar) {    // Through an interleaved copy
+                BMP copy(src);
+                copy.SetLayout(PixelLayout::Interleaved);
+                blit(copy, src_rect, dst, mode);
+                return;
+            }
+            int64_t x0 = src_rect.x, y0 = src_rect.y;
+            int64_t w = std::min<int64_t>(src_rect.width, (int64_t)src.width() - x0);
+            int64_t h = std::min<int64_t>(src_rect.height, (int64_t)src.height() - y0);
+            w = std::min<int64_t>(w, (int64_t)width() - dst.x);
+            h = std::min<int64_t>(h, (int64_t)height() - dst.y);
+            if (w <= 0 || h <= 0) {
+                return;
+            }
+            BMP_PROBE_COUNT((uint64_t)w * h * channels, (uint64_t)w * h);
+
+            markDirty(dst.y, dst.y + h);
+            if (&src == this) { // The rectangles can overlap, go through a copy
+                BMP copy(w, h, src.channels == 4);
+                copy.blit(src, Rect(x0, y0, w, h), Point(0, 0));
+                blit(copy, Rect(0, 0, w, h), dst, mode);
+                return;
+            }
+
+            if (src.channels == 4) {
+                if (channels == 4) {
+                    blit_rows<4, 4>(src, x0, y0, w, h, dst, mode);
+                } else {
+                    blit_rows<4, 3>(src, x0, y0, w, h, dst, mode);
+                }
+            } else {
+                if (channels == 4) {
+                    blit_rows<3, 4>(src, x0, y0, w, h, dst, mode);
+                } else {
+                    blit_rows<3, 3>(src, x0, y0, w, h, dst, mode);
+                }
+            }
+        }
+
+        /// Pixel layout
+
+        // Planar keeps each channel in its own plane, for per channel math through plane_data.
+        // getPixel, setPixel and Histogram take both layouts, write, encode and update interleave the
+        // planes on the way out. The effects, the filters, blit, view and the drawers bring the image
+        // back to interleaved first; row_data and pixel_unchecked do not, they need it interleaved.
+        // A mapped image or a view keeps its pixels interleaved in place.
+        void SetLayout(const PixelLayout target) {
+            if (target == layout || bmp_info_header.width <= 0 || bmp_info_header.height <= 0) {
+                return;
+            }
+            BMP_PROBE("SetLayout", probe_bytes(), probe_pixels());
+            if (mapping || data.empty()) {
+                std::cerr << "SetLayout error: the pixels of a mapped image or view stay interleaved\n";
+                return;
+            }
+            if (channels == 4) {
+                change_layout<4>(target);
+            } else {
+                change_layout<3>(target);
+            }
+        }
+
+        PixelLayout Layout() const {
+            return layout;
+        }
+
+        // Bytes between two rows of a plane, 0 in the interleaved layout
+        uint32_t PlaneStride() const {
+            return plane_stride;
+        }
+
+        // First byte of row y of plane c (blue, green, red, alpha), in the planar layout
+        uint8_t *plane_data(const uint32_t c, const uint32_t y) {
+            assert(layout == PixelLayout::Planar && c < channels && y < (uint32_t)bmp_info_header.height);
+            return data.data() + ((size_t)c * bmp_info_header.height + y) * plane_stride;
+        }
+
+        const uint8_t *plane_data(const uint32_t c, const uint32_t y) const {
+            assert(layout == PixelLayout::Planar && c < channels && y < (uint32_t)bmp_info_header.height);
+            return data.data() + ((size_t)c * bmp_info_header.height + y) * plane_stride;
+        }
+
+        // Multiply the colors by alpha, so that filters and compositing do not bleed the color of
+        // transparent pixels. The image is written with straight alpha again, and getPixel, setPixel,
+        // blit and the drawers keep taking straight colors.
+        void Premultiply() {
+            BMP_PROBE("Premultiply", probe_bytes(), probe_pixels());
+            if (premultiplied) {
+                return;
+            }
+            if (channels != 4) {
+                std::cerr << "Premultiply error: the image has no alpha channel\n";
+                return;
+            }
+            if (mapping || data.empty()) {
+                std::cerr << "Premultiply error: the pixels of a mapped image or view stay as in the file\n";
+                return;
+            }
+            // Unpremultiplying does not give back the low alpha colors exactly
+            markDirty(0, bmp_info_header.height);
+            alpha_rows(true);
+            premultiplied = true;
+        }
+
+        void Unpremultiply() {
+            BMP_PROBE("Unpremultiply", probe_bytes(), probe_pixels());
+            if (premultiplied) {
+                alpha_rows(false);
+                premultiplied = false;
+            }
+        }
+
+        bool Premultiplied() const {
+            return premultiplied;
+        }
+
+        /// Effects
+
+        void BlackWhite(const float r = 0.33, const float g = 0.33, const float b = 0.33) {
+            BMP_PROBE("BlackWhite", probe_bytes(), probe_pixels());
+            if (r + g + b > 1) {
+                std::cerr << "BlackWhite error: Invalid grey scale\n";
+            }
+            if (r < 0 || g < 0 || b < 0 || r > 1 || g > 1 || b > 1) {
+                std::cerr << "BlackWhite error: The weights must be between 0 and 1\n";
+                return;
+            }
+
+            // Fixed point weights, the grey value stays within 1 of the float computation
+            bmp_kernels::GreyWeights w;
+            w.r = (uint16_t)lroundf(r * (1 << bmp_kernels::GreyShift));
+            w.g = (uint16_t)lroundf(g * (1 << bmp_kernels::GreyShift));
+            w.b = (uint16_t)lroundf(b * (1 << bmp_kernels::GreyShift));
+
+            SetLayout(PixelLayout::Interleaved);
+            markDirty(0, bmp_info_header.height);
+            if (channels == 4) {
+                black_white_rows<4>(w);
+            } else {
+                black_white_rows<3>(w);
+            }
+        }
+
+        void FlipX() {
+            BMP_PROBE("FlipX", probe_bytes(), probe_pixels());
+            SetLayout(PixelLayout::Interleaved);
+            markDirty(0, bmp_info_header.height);
+            if (channels == 4) {
+                flip_x_rows<4>();
+            } else {
+                flip_x_rows<3>();
+            }
+        }
+
+        // Swap whole rows through a small scratch buffer, each row is read and written sequentially once.
+        // A logical flip moves no pixel at all: the rows are addressed from the top and the image
+        // is written as top-down (negative height) the next time. A mapped file is left as it is.
+        void FlipY(const bool logical = false) {
+            BMP_PROBE("FlipY", probe_bytes(), probe_pixels());
+            SetLayout(PixelLayout::Interleaved);
+            markDirty(0, bmp_info_header.height);
+            if (logical) {
+                pixels = row_data(bmp_info_header.height - 1);
+                stride = -stride;
+                return;
+            }
+
+            // Bands of pairs of rows, both rows of a pair are processed
+            BMPThreadPool::instance().for_rows(bmp_info_header.height / 2, 2 * row_stride, [&](uint32_t begin, uint32_t end) {
+                uint8_t scratch[4096];
+                for (uint32_t y = begin; y < end; y++) {
+                    uint8_t *row1 = row_data(y);
+                    uint8_t *row2 = row_data(bmp_info_header.height - 1 - y);
+                    for (uint32_t pos = 0; pos < row_stride; pos += sizeof(scratch)) {
+                        uint32_t n = std::min((uint32_t)sizeof(scratch), row_stride - pos);
+                        memcpy(scratch, row1 + pos, n);
+                        memcpy(row1 + pos, row2 + pos, n);
+                        memcpy(row2 + pos, scratch, n);
+                    }
+                }
+            });
+        }
+
+        // The turns are clockwise as the image is displayed. Those that swap the width and the height
+        // go through a new pixel array, a mapped image becomes an owned one and its file is left as it is.
+        void Rotate90() {
+            BMP_PROBE("Rotate90", probe_bytes(), probe_pixels());
+            transform(true, false, true);
+        }
+
+        void Rotate180() {
+            BMP_PROBE("Rotate180", probe_bytes(), probe_pixels());
+            transform(false, true, true);
+        }
+
+        void Rotate270() {
+            BMP_PROBE("Rotate270", probe_bytes(), probe_pixels());
+            transform(true, true, false);
+        }
+
+        // Swap the rows and the columns, pixel (x, y) moves to (y, x)
+        void Transpose() {
+            BMP_PROBE("Transpose", probe_bytes(), probe_pixels());
+            transform(true, false, false);
+        }
+
+        // A copy of width x height pixels in the same layout (24 or 32 bits). The filter weights are
+        // computed once per axis, then a horizontal and a vertical pass run in bands of rows across
+        // the cores. Box shrinking by exactly 2 or 4 averages the blocks in one pass (mip levels).
+        BMP Resize(const int32_t width, const int32_t height, const Filter filter = Filter::Bilinear) const {
+            BMP_PROBE("Resize", probe_bytes(), probe_pixels());
+            if (width <= 0 || height <= 0 || bmp_info_header.width <= 0 || bmp_info_header.height <= 0) {
+                std::cerr << "Resize error: The image width and height must be positive numbers\n";
+                return BMP();
+            }
+            if (layout == PixelLayout::Planar) {    // Through an interleaved copy
+                BMP copy(*this);
+                copy.SetLayout(PixelLayout::Interleaved);
+                return copy.Resize(width, height, filter);
+            }
+            BMP image = uninitialized(width, height, channels == 4);
+            image.premultiplied = premultiplied;
+            if (channels == 4) {
+                resize_rows<4>(image, filter);
+            } else {
+                resize_rows<3>(image, filter);
+            }
+            return image;
+        }
+
+        // Counts of each value per channel, every band counts into its own tables which are merged at the end
+        BMPHistogram Histogram() const {
+            BMP_PROBE("Histogram", probe_bytes(), probe_pixels());
+            BMPHistogram histogram;
+            if (bmp_info_header.width <= 0 || bmp_info_header.height <= 0) {
+                return histogram;
+            }
+            if (channels == 4) {
+                histogram_rows<4>(histogram);
+            } else {
+                histogram_rows<3>(histogram);
+            }
+            return histogram;
+        }
+
+        // Map the red, green and blue values through one table, the alpha is left as it is
+        void ApplyLUT(const std::array<uint8_t, 256>& lut) {
+            ApplyLUT(lut, lut, lut);
+        }
+
+        // A table for each channel, the alpha one is used on 32 bits images only
+        void ApplyLUT(const std::array<uint8_t, 256>& r, const std::array<uint8_t, 256>& g, const std::array<uint8_t, 256>& b) {
+            BMP_PROBE("ApplyLUT", probe_bytes(), probe_pixels());
+            bmp_kernels::ChannelTables tables;
+            memcpy(tables.bytes[0], b.data(), 256);
+            memcpy(tables.bytes[1], g.data(), 256);
+            memcpy(tables.bytes[2], r.data(), 256);
+            tables.widen();
+            apply_tables(tables);
+        }
+
+        void ApplyLUT(const std::array<uint8_t, 256>& r, const std::array<uint8_t, 256>& g, const std::array<uint8_t, 256>& b,
+                      const std::array<uint8_t, 256>& alpha) {
+            BMP_PROBE("ApplyLUT", probe_bytes(), probe_pixels());
+            bmp_kernels::ChannelTables tables;
+            memcpy(tables.bytes[0], b.data(), 256);
+            memcpy(tables.bytes[1], g.data(), 256);
+            memcpy(tables.bytes[2], r.data(), 256);
+            memcpy(tables.bytes[3], alpha.data(), 256);
+            tables.widen();
+            apply_tables(tables);
+        }
+
+        // Stretch each color channel so that clip (0 to 0.5) of the pixels end up at 0 and at 255
+        void AutoLevels(const float clip = 0.005f) {
+            BMP_PROBE("AutoLevels", probe_bytes(), probe_pixels());
+            if (clip < 0 || clip >= 0.5f) {
+                std::cerr << "AutoLevels error: clip must be between 0 and 0.5\n";
+                return;
+            }
+            const BMPHistogram histogram = Histogram();
+            bmp_kernels::ChannelTables tables;
+            for (uint32_t c = 0; c < 3; ++c) {
+                int low = histogram.percentile(c, clip), high = 255;
+                for (uint64_t above = 0; high > 0; --high) {    // The same from the top
+                    above += histogram.count[c][high];
+                    if (above > clip * histogram.pixels) {
+                        break;
+                    }
+                }
+                if (high <= low) {
+                    continue;
+                }
+                for (int v = 0; v < 256; ++v) {
+                    int out = (int)lround((v - low) * 255.0 / (high - low));
+                    tables.bytes[c][v] = (uint8_t)(out < 0 ? 0 : out > 255 ? 255 : out);
+                }
+            }
+            tables.widen();
+            apply_tables(tables);
+        }
+
+        // Spread each color channel so that its values are used about as often as each other
+        void Equalize() {
+            BMP_PROBE("Equalize", probe_bytes(), probe_pixels());
+            const BMPHistogram histogram = Histogram();
+            bmp_kernels::ChannelTables tables;
+            for (uint32_t c = 0; c < 3; ++c) {
+                uint64_t first = 0, sum = 0;
+                for (int v = 0; v < 256 && !first; ++v) {
+                    first = histogram.count[c][v];
+                }
+                if (histogram.pixels == first) {    // A single value
+                    continue;
+                }
+                for (int v = 0; v < 256; ++v) {
+                    sum += histogram.count[c][v];
+                    double out = sum < first ? 0.0 : (double)(sum - first) * 255 / (histogram.pixels - first);
+                    tables.bytes[c][v] = (uint8_t)lround(out);
+                }
+            }
+            tables.widen();
+            apply_tables(tables);
+        }
+
+        // Filters. The kernels run on the interleaved bytes, in tiles that read the rows and columns
+        // their taps reach around them, the bands of tiles run across the cores.
+        // The blurs filter the alpha channel too, the other filters leave it as it is.
+
+        // A width x height kernel (odd sizes) given row by row and applied without flipping it.
+        // A kernel that is a column times a row goes through the separable passes.
+        void Convolve(const float *kernel, const uint32_t width, const uint32_t height,
+                      const BorderMode border = BorderMode::Clamp) {
+            BMP_PROBE("Convolve", probe_bytes(), probe_pixels());
+            if (width % 2 == 0 || height % 2 == 0) {
+                std::cerr << "Convolve error: The kernel width and height must be odd\n";
+                return;
+            }
+            size_t largest = 0;
+            for (size_t i = 0; i < (size_t)width * height; ++i) {
+                if (fabsf(kernel[i]) > fabsf(kernel[largest])) {
+                    largest = i;
+                }
+            }
+            const uint32_t p = (uint32_t)(largest / width), q = (uint32_t)(largest % width);
+            std::vector<float> kx(kernel + (size_t)width * p, kernel + (size_t)width * (p + 1)), ky(height, 1.0f);
+            bool separable = true;
+            for (uint32_t j = 0; j < height && kernel[largest] != 0; ++j) {
+                ky[j] = kernel[(size_t)width * j + q] / kernel[largest];
+                for (uint32_t i = 0; i < width; ++i) {
+                    float k = kernel[(size_t)width * j + i];
+                    separable = separable && fabsf(k - ky[j] * kx[i]) <= 1e-6f * (1.0f + fabsf(k));
+                }
+            }
+            if (separable) {
+                filter_separable(kx, ky, border, false);
+            } else {
+                filter_2d(kernel, width, height, border);
+            }
+        }
+
+        // The column ky (ny weights) times the row kx (nx weights), both odd sizes
+        void ConvolveSeparable(const float *kx, const uint32_t nx, const float *ky, const uint32_t ny,
+                               const BorderMode border = BorderMode::Clamp) {
+            BMP_PROBE("ConvolveSeparable", probe_bytes(), probe_pixels());
+            if (nx % 2 == 0 || ny % 2 == 0) {
+                std::cerr << "ConvolveSeparable error: The kernel sizes must be odd\n";
+                return;
+            }
+            filter_separable(std::vector<float>(kx, kx + nx), std::vector<float>(ky, ky + ny), border, false);
+        }
+
+        // Average of the (2 * radius + 1)^2 pixels around each pixel, with running sums:
+        // the cost per pixel does not depend on the radius
+        void BoxBlur(const uint32_t radius, const BorderMode border = BorderMode::Clamp) {
+            BMP_PROBE("BoxBlur", probe_bytes(), probe_pixels());
+            if (radius > 1000) {
+                std::cerr << "BoxBlur error: The radius must be at most 1000\n";  // The sums are kept in 32 bits
+                return;
+            }
+            if (radius == 0 || bmp_info_header.width <= 0 || bmp_info_header.height <= 0) {
+                return;
+            }
+            SetLayout(PixelLayout::Interleaved);
+            BMP image = uninitialized(bmp_info_header.width, bmp_info_header.height, channels == 4);
+            if (channels == 4) {
+                box_blur_rows<4>(image, radius, border);
+            } else {
+                box_blur_rows<3>(image, radius, border);
+            }
+            adopt_filtered(image, true);
+        }
+
+        // Exact separable kernel up to sigma 2, then three box blurs of the same variance
+        void GaussianBlur(const float sigma, const BorderMode border = BorderMode::Clamp) {
+            BMP_PROBE("GaussianBlur", probe_bytes(), probe_pixels());
+            if (sigma <= 0) {
+                std::cerr << "GaussianBlur error: sigma must be positive\n";
+                return;
+            }
+            if (sigma <= 2.0f) {
+                const int radius = (int)ceilf(3 * sigma);
+                std::vector<float> k(2 * radius + 1);
+                float total = 0;
+                for (int i = -radius; i <= radius; ++i) {
+                    k[i + radius] = expf(-(float)(i * i) / (2 * sigma * sigma));
+                    total += k[i + radius];
+                }
+                for (size_t i = 0; i < k.size(); ++i) {
+                    k[i] /= total;
+                }
+                filter_separable(k, k, border, true);
+                return;
+            }
+            const float variance = 12 * sigma * sigma;
+            int lower = (int)floorf(sqrtf(variance / 3 + 1));
+            if (lower % 2 == 0) {
+                lower--;
+            }
+            const int count = (int)lroundf((variance - 3 * lower * lower - 12 * lower - 9) / (-4.0f * lower - 4));
+            for (int i = 0; i < 3; ++i) {
+                int size = i < count ? lower : lower + 2;
+                BoxBlur((size - 1) / 2, border);
+            }
+        }
+
+        // Pixel minus amount times its 4 neighbours' difference to it
+        void Sharpen(const float amount = 1.0f) {
+            BMP_PROBE("Sharpen", probe_bytes(), probe_pixels());
+            const float k[9] = { 0, -amount, 0, -amount, 1 + 4 * amount, -amount, 0, -amount, 0 };
+            Convolve(k, 3, 3);
+        }
+
+        // Laplacian of the 8 neighbours, flat areas go black
+        void EdgeDetect() {
+            BMP_PROBE("EdgeDetect", probe_bytes(), probe_pixels());
+            const float k[9] = { -1, -1, -1, -1, 8, -1, -1, -1, -1 };
+            Convolve(k, 3, 3);
+        }
+
+    private:
+        friend class BMPRowReader;
+        friend class BMPRowWriter;
+        friend class EffectChain;
+
+        static const uint32_t TransposeBlock = 64;  // Pixels on the side of a block transposed in L1
+        static const uint32_t FilterTileWidth = 256; // Pixels of a filter tile, its floats stay in L2
+        static const uint32_t FilterTileRows = 32;
+
+        BMPFileHeader file_header;
+        BMPInfoHeader bmp_info_header;
+        BMPColorHeader bmp_color_header;
+        std::vector<uint8_t, BMPPixelAllocator<uint8_t> > data;
+        uint8_t *pixels{ nullptr };         // First byte of the pixel array, inside data or inside the mapped file
+
+        uint32_t channels{ 0 };
+
+        uint32_t row_stride{ 0 };           // Bytes of pixel data in a row (width * channels)
+        int64_t stride{ 0 };                // Bytes between the start of two consecutive rows in memory, with the
+                                            // padding of the file when read from one, negative when the rows
+                                            // are stored from the top (top-down files, FlipY)
+
+        void *mapping{ nullptr };           // Base address of the mapped file, when opened with open_mapped
+        size_t mapping_size{ 0 };
+
+        std::vector<uint8_t> dirty_rows;    // 1 for the rows changed since the image was read or written
+
+        PixelLayout layout{ PixelLayout::Interleaved };
+        uint32_t plane_stride{ 0 };         // Bytes between two rows of a plane, a multiple of 64 (planar layout)
+        bool premultiplied{ false };        // The colors are times alpha, undone when the image is written
+
+        BMP() {}
+
+        // Bytes and pixels of the whole image, for BMP_PROBE
+        uint64_t probe_bytes() const {
+            return bmp_info_header.height > 0 ? (uint64_t)row_stride * bmp_info_header.height : 0;
+        }
+
+        uint64_t probe_pixels() const {
+            return bmp_info_header.height > 0 ? (uint64_t)width() * bmp_info_header.height : 0;
+        }
+
+        // Set up the headers and an owned pixel array for a new image
+        void create(int32_t width, int32_t height, bool has_alpha, bool zero = true) {
+            release_mapping();
+
+            if (width <= 0 || height <= 0) {
+                std::cerr << "The image width and height must be positive numbers.\n";
+            }
+
+            bmp_info_header.width = width;
+            bmp_info_header.height = height;
+            if (has_alpha) {
+                bmp_info_header.size = sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
+                file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
+
+                bmp_info_header.bit_count = 32;
+                bmp_info_header.compression = 3;
+                row_stride = width * 4;
+                data.resize(row_stride * height);
+                file_header.file_size = file_header.offset_data + data.size();
+            }
+            else {
+                bmp_info_header.size = sizeof(BMPInfoHeader);
+                file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
+
+                bmp_info_header.bit_count = 24;
+                bmp_info_header.compression = 0;
+                row_stride = width * 3;
+                data.resize(row_stride * height);
+
+                uint32_t new_stride = make_stride_aligned(4);
+                file_header.file_size = file_header.offset_data + data.size() + bmp_info_header.height * (new_stride - row_stride);
+            }
+
+            channels = bmp_info_header.bit_count / 8;
+            pixels = data.data();
+            stride = row_stride;
+            layout = PixelLayout::Interleaved;
+            premultiplied = false;
+            if (zero) {
+                memset(pixels, 0, data.size());
+            }
+            dirty_rows.assign(height, 1);
+        }
+
+        // Move the pixels to the target layout in a new buffer, the rows keep their order
+        template <uint32_t Channels>
+        void change_layout(const PixelLayout target) {
+            const uint32_t width = bmp_info_header.width, height = bmp_info_header.height;
+            std::vector<uint8_t, BMPPixelAllocator<uint8_t> > out;
+            if (target == PixelLayout::Planar) {
+                const uint32_t aligned = (width + 63) / 64 * 64;
+                out.resize((size_t)aligned * height * Channels);
+                BMPThreadPool::instance().for_rows(height, row_stride, [&](uint32_t begin, uint32_t end) {
+                    for (uint32_t y = begin; y < end; ++y) {
+                        uint8_t *planes[Channels];
+                        for (uint32_t c = 0; c < Channels; ++c) {
+                            planes[c] = out.data() + ((size_t)c * height + y) * aligned;
+                        }
+                        bmp_kernels::deinterleave_row<Channels>(row_data(y), planes, width);
+                    }
+                });
+                stride = stride < 0 ? -(int64_t)row_stride : row_stride;  // Only the row order is kept
+                plane_stride = aligned;
+                data.swap(out);
+                pixels = data.data();
+            } else {
+                out.resize((size_t)row_stride * height);
+                uint8_t *first = stride < 0 ? out.data() + (size_t)row_stride * (height - 1) : out.data();
+                BMPThreadPool::instance().for_rows(height, row_stride, [&](uint32_t begin, uint32_t end) {
+                    for (uint32_t y = begin; y < end; ++y) {
+                        const uint8_t *planes[Channels];
+                        for (uint32_t c = 0; c < Channels; ++c) {
+                            planes[c] = plane_data(c, y);
+                        }
+                        bmp_kernels::interleave_row<Channels>(planes, first + stride * y, width);
+                    }
+                });
+                plane_stride = 0;
+                data.swap(out);
+                pixels = first;
+            }
+            layout = target;
+        }
+
+        // Premultiply or unpremultiply every pixel, in either layout
+        void alpha_rows(const bool multiply) {
+            const uint32_t width = bmp_info_header.width;
+            BMPThreadPool::instance().for_rows(bmp_info_header.height, row_stride, [&](uint32_t begin, uint32_t end) {
+                for (uint32_t y = begin; y < end; ++y) {
+                    if (layout == PixelLayout::Interleaved) {
+                        if (multiply) {
+                            bmp_kernels::premultiply_row(row_data(y), width);
+                        } else {
+                            bmp_kernels::unpremultiply_row(row_data(y), width);
+                        }
+                        continue;
+                    }
+                    const uint8_t *alpha = plane_data(3, y);
+                    for (uint32_t c = 0; c < 3; ++c) {
+                        uint8_t *p = plane_data(c, y);
+                        for (uint32_t x = 0; x < width; ++x) {
+                            p[x] = multiply ? bmp_kernels::premultiply_byte(p[x], alpha[x])
+                                            : bmp_kernels::unpremultiply_byte(p[x], alpha[x]);
+                        }
+                    }
+                }
+            });
+        }
+
+        // Row y as the file holds it: interleaved, with straight alpha
+        void export_row(const uint32_t y, uint8_t *out) const {
+            if (layout == PixelLayout::Planar) {
+                const uint8_t *planes[4];
+                for (uint32_t c = 0; c < channels; ++c) {
+                    planes[c] = plane_data(c, y);
+                }
+                if (channels == 4) {
+                    bmp_kernels::interleave_row<4>(planes, out, bmp_info_header.width);
+                } else {
+                    bmp_kernels::interleave_row<3>(planes, out, bmp_info_header.width);
+                }
+            } else {
+                memcpy(out, row_data(y), row_stride);
+            }
+            if (premultiplied) {
+                bmp_kernels::unpremultiply_row(out, bmp_info_header.width);
+            }
+        }
+
+        void copy_rows(const BMP& image) {
+            if (stride == row_stride && image.stride == row_stride) {
+                memcpy(pixels, image.pixels, (size_t)row_stride * bmp_info_header.height);
+            } else {
+                for (uint32_t y = 0; y < (uint32_t)bmp_info_header.height; ++y) {
+                    memcpy(row_data(y), image.row_data(y), row_stride);
+                }
+            }
+        }
+
+        // Effect kernels, stamped out for each number of channels
+
+        struct NoRowEffect {
+            void operator()(uint8_t*) const {}
+        };
+
+        // Transpose then flip, which covers all the turns and mirrors
+        void transform(const bool transpose, const bool flip_x, const bool flip_y) {
+            SetLayout(PixelLayout::Interleaved);
+            markDirty(0, bmp_info_header.height);
+            if (!transpose) {
+                if (flip_x && flip_y) {
+                    channels == 4 ? rotate_180_rows<4>() : rotate_180_rows<3>();
+                } else if (flip_x) {
+                    FlipX();
+                } else if (flip_y) {
+                    FlipY();
+                }
+                return;
+            }
+            BMP image = channels == 4 ? transposed<4>(flip_x, flip_y, NoRowEffect())
+                                      : transposed<3>(flip_x, flip_y, NoRowEffect());
+            *this = std::move(image);
+        }
+
+        // Halve the longer side until the block fits in L1, whatever the cache sizes are
+        template <uint32_t Channels>
+        static void transpose_blocks(const uint8_t *src, const int64_t src_stride, uint8_t *dst, const int64_t dst_stride,
+                                     const uint32_t w, const uint32_t h) {
+            if (w <= TransposeBlock && h <= TransposeBlock) {
+                bmp_kernels::transpose<Channels>(src, src_stride, dst, dst_stride, w, h);
+            } else if (w >= h) {
+                uint32_t half = (w / 2 + 3) & ~3u;
+                transpose_blocks<Channels>(src, src_stride, dst, dst_stride, half, h);
+                transpose_blocks<Channels>(src + Channels * half, src_stride, dst + dst_stride * half, dst_stride, w - half, h);
+            } else {
+                uint32_t half = (h / 2 + 3) & ~3u;
+                transpose_blocks<Channels>(src, src_stride, dst, dst_stride, w, half);
+                transpose_blocks<Channels>(src + src_stride * half, src_stride, dst + Channels * half, dst_stride, w, h - half);
+            }
+        }
+
+        // A transposed copy, flipped afterwards as asked. Each band of rows goes through process
+        // (one row at a time) just before it is transposed, while it is still in cache.
+        template <uint32_t Channels, typename F>
+        BMP transposed(const bool flip_x, const bool flip_y, F process) {
+            const uint32_t width = bmp_info_header.width, height = bmp_info_header.height;
+            BMP image = uninitialized(height, width, channels == 4);
+            image.bmp_info_header.x_pixels_per_meter = bmp_info_header.y_pixels_per_meter;
+            image.bmp_info_header.y_pixels_per_meter = bmp_info_header.x_pixels_per_meter;
+            image.premultiplied = premultiplied;    // The pixels are moved as they are
+
+            // The flips are done by walking the source rows or the destination rows backwards
+            uint8_t *src = flip_x ? row_data(height - 1) : row_data(0);
+            int64_t src_stride = flip_x ? -stride : stride;
+            uint8_t *dst = flip_y ? image.row_data(width - 1) : image.row_data(0);
+            int64_t dst_stride = flip_y ? -image.stride : image.stride;
+
+            BMPThreadPool::instance().for_rows(height, row_stride, [&](uint32_t begin, uint32_t end) {
+                for (uint32_t y = begin; y < end; ++y) {
+                    process(src + src_stride * y);
+                }
+                transpose_blocks<Channels>(src + src_stride * begin, src_stride, dst + Channels * begin, dst_stride,
+                                           width, end - begin);
+            });
+            return image;
+        }
+
+        template <uint32_t Channels, uint32_t Factor>
+        void box_down_rows(BMP& image) const {
+            BMPThreadPool::instance().for_rows(image.bmp_info_header.height, Factor * row_stride, [&](uint32_t begin, uint32_t end) {
+                const uint8_t *rows[Factor];
+                for (uint32_t y = begin; y < end; ++y) {
+                    for (uint32_t r = 0; r < Factor; ++r) {
+                        rows[r] = row_data(Factor * y + r);
+                    }
+                    bmp_kernels::box_down<Channels, Factor>(rows, image.row_data(y), image.bmp_info_header.width);
+                }
+            });
+        }
+
+        template <uint32_t Channels>
+        void resize_rows(BMP& image, const Filter filter) const {
+            const uint32_t src_width = bmp_info_header.width, src_height = bmp_info_header.height;
+            const uint32_t width = image.bmp_info_header.width, height = image.bmp_info_header.height;
+            if (filter == Filter::Box && src_width == 2 * width && src_height == 2 * height) {
+                box_down_rows<Channels, 2>(image);
+                return;
+            }
+            if (filter == Filter::Box && src_width == 4 * width && src_height == 4 * height) {
+                box_down_rows<Channels, 4>(image);
+                return;
+            }
+
+            // Horizontal pass, straight into the image when the height does not change
+            const size_t out_bytes = (size_t)Channels * width;
+            std::vector<uint8_t, BMPPixelAllocator<uint8_t> > columns;
+            const uint8_t *rows = row_data(0);
+            int64_t rows_stride = stride;
+            if (width != src_width || height == src_height) {
+                uint8_t *out = image.row_data(0);
+                int64_t out_stride = image.stride;
+                if (height != src_height) {
+                    columns.resize((size_t)src_height * out_bytes);
+                    out = columns.data();
+                    out_stride = out_bytes;
+                }
+                const bmp_kernels::ResizeTaps taps = bmp_kernels::resize_taps(src_width, width, filter);
+                BMPThreadPool::instance().for_rows(src_height, row_stride + out_bytes, [&](uint32_t begin, uint32_t end) {
+                    for (uint32_t y = begin; y < end; ++y) {
+                        bmp_kernels::resize_h<Channels>(row_data(y), out + out_stride * y, src_width, width, taps);
+                    }
+                });
+                if (height == src_height) {
+                    return;
+                }
+                rows = out;
+                rows_stride = out_stride;
+            }
+
+            // Vertical pass, the taps of the next destination row mostly overlap and stay in cache
+            const bmp_kernels::ResizeTaps taps = bmp_kernels::resize_taps(src_height, height, filter);
+            BMPThreadPool::instance().for_rows(height, out_bytes * (1 + taps.taps), [&](uint32_t begin, uint32_t end) {
+                std::vector<const uint8_t*> tap_rows(taps.taps);
+                for (uint32_t y = begin; y < end; ++y) {
+                    for (uint32_t k = 0; k < taps.taps; ++k) {
+                        tap_rows[k] = rows + rows_stride * (taps.first[y] + k);
+                    }
+                    bmp_kernels::resize_v(tap_rows.data(), &taps.weights[(size_t)taps.taps * y], taps.taps,
+                                          image.row_data(y), out_bytes);
+                }
+            });
+        }
+
+        // Where the filters read pixel i of a row (or row i) of n when it is outside
+        static int64_t border_index(int64_t i, const int64_t n, const BorderMode border) {
+            if (i >= 0 && i < n) {
+                return i;
+            }
+            if (border == BorderMode::Clamp || n == 1) {
+                return i < 0 ? 0 : n - 1;
+            }
+            const int64_t period = 2 * (n - 1);
+            i %= period;
+            if (i < 0) {
+                i += period;
+            }
+            return i < n ? i : period - i;
+        }
+
+        // count pixels of row y from pixel x0, which can start or end outside of the image
+        void load_span(const uint32_t y, const int64_t x0, const uint32_t count, const BorderMode border, float *out) const {
+            const int64_t width = bmp_info_header.width;
+            const uint8_t *row = row_data(y);
+            const int64_t inside0 = std::max<int64_t>(x0, 0), inside1 = std::min<int64_t>(x0 + count, width);
+            for (int64_t x = x0; x < x0 + count; ++x) {
+                if (x == inside0 && inside0 < inside1) {
+                    bmp_kernels::widen(row + channels * inside0, out + channels * (x - x0), (size_t)channels * (inside1 - inside0));
+                    x = inside1 - 1;
+                    continue;
+                }
+                const uint8_t *px = row + channels * border_index(x, width, border);
+                for (uint32_t c = 0; c < channels; ++c) {
+                    out[channels * (x - x0) + c] = px[c];
+                }
+            }
+        }
+
+        // Call tile(x0, x1, y0, y1, rows, scratch) for every tile of the image: rows[j] holds as floats
+        // the pixels [x0 - rx, x1 + rx) of row y0 - ry + j, scratch is kept by the thread between tiles
+        template <typename F>
+        void for_each_tile(const uint32_t rx, const uint32_t ry, const BorderMode border, F tile) const {
+            const uint32_t width = bmp_info_header.width, height = bmp_info_header.height;
+            const size_t span = (size_t)channels * (FilterTileWidth + 2 * rx);
+            BMPThreadPool::instance().for_rows(height, row_stride, [&](uint32_t begin, uint32_t end) {
+                std::vector<float> buffer(span * (FilterTileRows + 2 * ry)), scratch;
+                std::vector<const float*> rows(FilterTileRows + 2 * ry);
+                for (uint32_t y0 = begin; y0 < end; y0 += FilterTileRows) {
+                    uint32_t y1 = std::min(end, y0 + FilterTileRows);
+                    for (uint32_t x0 = 0; x0 < width; x0 += FilterTileWidth) {
+                        uint32_t x1 = std::min(width, x0 + FilterTileWidth);
+                        for (uint32_t j = 0; j < y1 - y0 + 2 * ry; ++j) {
+                            float *row = &buffer[span * j];
+                            load_span((uint32_t)border_index((int64_t)y0 - ry + j, height, border), (int64_t)x0 - rx,
+                                      x1 - x0 + 2 * rx, border, row);
+                            rows[j] = row;
+                        }
+                        tile(x0, x1, y0, y1, rows.data(), scratch);
+                    }
+                }
+            });
+        }
+
+        // The horizontal pass of a tile and its border rows, then the vertical pass
+        void filter_separable(const std::vector<float>& kx, const std::vector<float>& ky, const BorderMode border,
+                              const bool alpha) {
+            if (bmp_info_header.width <= 0 || bmp_info_header.height <= 0) {
+                return;
+            }
+            SetLayout(PixelLayout::Interleaved);
+            const uint32_t rx = (uint32_t)kx.size() / 2, ry = (uint32_t)ky.size() / 2;
+            BMP image = uninitialized(bmp_info_header.width, bmp_info_header.height, channels == 4);
+            for_each_tile(rx, ry, border, [&](uint32_t x0, uint32_t x1, uint32_t y0, uint32_t y1, const float *const *rows,
+                                              std::vector<float>& scratch) {
+                const size_t n = (size_t)channels * (x1 - x0);
+                const uint32_t count = y1 - y0 + 2 * ry;
+                scratch.resize(n * count);
+                std::vector<const float*> columns(count);
+                for (uint32_t j = 0; j < count; ++j) {
+                    bmp_kernels::conv_h(rows[j], kx.data(), (uint32_t)kx.size(), channels, &scratch[n * j], n, false);
+                    columns[j] = &scratch[n * j];
+                }
+                for (uint32_t y = y0; y < y1; ++y) {
+                    bmp_kernels::conv_v(&columns[y - y0], ky.data(), (uint32_t)ky.size(), image.row_data(y) + channels * x0, n);
+                }
+            });
+            adopt_filtered(image, alpha);
+        }
+
+        // Every row of the kernel on the rows it covers, summed
+        void filter_2d(const float *kernel, const uint32_t kw, const uint32_t kh, const BorderMode border) {
+            if (bmp_info_header.width <= 0 || bmp_info_header.height <= 0) {
+                return;
+            }
+            SetLayout(PixelLayout::Interleaved);
+            BMP image = uninitialized(bmp_info_header.width, bmp_info_header.height, channels == 4);
+            const float one = 1.0f;
+            for_each_tile(kw / 2, kh / 2, border, [&](uint32_t x0, uint32_t x1, uint32_t y0, uint32_t y1, const float *const *rows,
+                                                      std::vector<float>& scratch) {
+                const size_t n = (size_t)channels * (x1 - x0);
+                scratch.resize(n);
+                const float *sum = scratch.data();
+                for (uint32_t y = y0; y < y1; ++y) {
+                    for (uint32_t j = 0; j < kh; ++j) {
+                        bmp_kernels::conv_h(rows[y - y0 + j], kernel + (size_t)kw * j, kw, channels, scratch.data(), n, j > 0);
+                    }
+                    bmp_kernels::conv_v(&sum, &one, 1, image.row_data(y) + channels * x0, n);
+                }
+            });
+            adopt_filtered(image, false);
+        }
+
+        // The column sums over the window are updated with the row entering it and the row leaving it,
+        // then summed along the row with running sums too
+        template <uint32_t Channels>
+        void box_blur_rows(BMP& image, const uint32_t radius, const BorderMode border) const {
+            const uint32_t width = bmp_info_header.width, height = bmp_info_header.height;
+            // Rounded division by the window area as a multiply and a shift, exact for every sum
+            const uint32_t area = (2 * radius + 1) * (2 * radius + 1), half = area / 2;
+            int shift = 0;
+            while ((1ull << shift) < (255ull * area + half) * area) {
+                ++shift;
+            }
+            const uint32_t inverse = (uint32_t)(((1ull << shift) + area - 1) / area);
+            // Every band first sums the 2 * radius + 1 rows around its first row, bigger bands for bigger radii
+            BMPThreadPool::instance().for_rows(height, row_stride / (1 + radius / 2), [&](uint32_t begin, uint32_t end) {
+                std::vector<uint32_t> columns((size_t)Channels * (width + 2 * radius), 0), sums(row_stride);
+                uint32_t *inside = columns.data() + Channels * radius;
+                for (int64_t y = (int64_t)begin - radius; y <= (int64_t)begin + radius; ++y) {
+                    const uint8_t *row = row_data((uint32_t)border_index(y, height, border));
+                    for (size_t i = 0; i < row_stride; ++i) {
+                        inside[i] += row[i];
+                    }
+                }
+                for (uint32_t y = begin; y < end; ++y) {
+                    for (int64_t x = 1; x <= radius; ++x) {
+                        memcpy(inside - Channels * x, inside + Channels * border_index(-x, width, border), Channels * sizeof(uint32_t));
+                        memcpy(inside + Channels * (width - 1 + x), inside + Channels * border_index(width - 1 + x, width, border),
+                               Channels * sizeof(uint32_t));
+                    }
+                    bmp_kernels::box_sums<Channels>(columns.data(), radius, width, sums.data());
+                    bmp_kernels::box_divide(sums.data(), image.row_data(y), row_stride, half, inverse, shift);
+                    if (y + 1 < end) {
+                        const uint8_t *enter = row_data((uint32_t)border_index((int64_t)y + radius + 1, height, border));
+                        const uint8_t *leave = row_data((uint32_t)border_index((int64_t)y - radius, height, border));
+                        bmp_kernels::box_columns(inside, enter, leave, row_stride);
+                    }
+                }
+            });
+        }
+
+        // Take the filtered pixels, with the alpha of the image when it was not filtered
+        void adopt_filtered(BMP& image, const bool alpha) {
+            const uint32_t width = bmp_info_header.width, height = bmp_info_header.height;
+            if (!alpha && channels == 4) {
+                BMPThreadPool::instance().for_rows(height, 2 * row_stride, [&](uint32_t begin, uint32_t end) {
+                    for (uint32_t y = begin; y < end; ++y) {
+                        const uint8_t *in = row_data(y);
+                        uint8_t *out = image.row_data(y);
+                        for (uint32_t x = 0; x < width; ++x) {
+                            out[4 * x + 3] = in[4 * x + 3];
+                        }
+                    }
+                });
+            }
+            markDirty(0, height);
+            if (mapping || data.empty()) {  // The pixels stay where they are
+                copy_rows(image);
+                return;
+            }
+            data.swap(image.data);
+            pixels = data.data();
+            stride = row_stride;
+        }
+
+        template <uint32_t Channels>
+        void histogram_rows(BMPHistogram& histogram) const {
+            std::mutex merge;
+            BMPThreadPool::instance().for_rows(bmp_info_header.height, row_stride, [&](uint32_t begin, uint32_t end) {
+                // Counted by the band alone, then merged once
+                std::vector<uint32_t> buffer(4 * 2 * bmp_kernels::HistogramStride, 0);
+                uint32_t (*counts)[2][bmp_kernels::HistogramStride] = (uint32_t (*)[2][bmp_kernels::HistogramStride])buffer.data();
+                BMPHistogram local;
+                uint64_t counted = 0;
+                for (uint32_t y = begin; y < end; ++y) {
+                    if (layout == PixelLayout::Planar) {
+                        for (uint32_t c = 0; c < Channels; ++c) {
+                            bmp_kernels::histogram_row<1>(plane_data(c, y), bmp_info_header.width, counts + c);
+                        }
+                    } else {
+                        bmp_kernels::histogram_row<Channels>(row_data(y), bmp_info_header.width, counts);
+                    }
+                    counted += bmp_info_header.width;
+                    if (counted >= (1u << 31) || y + 1 == end) {    // Far from the 32 bits counts overflowing
+                        for (uint32_t c = 0; c < Channels; ++c) {
+                            for (int v = 0; v < 256; ++v) {
+                                local.count[c][v] += counts[c][0][v] + counts[c][1][v];
+                            }
+                        }
+                        std::fill(buffer.begin(), buffer.end(), 0);
+                        local.pixels += counted;
+                        counted = 0;
+                    }
+                }
+                std::lock_guard<std::mutex> lock(merge);
+                for (uint32_t c = 0; c < Channels; ++c) {
+                    for (int v = 0; v < 256; ++v) {
+                        histogram.count[c][v] += local.count[c][v];
+                    }
+                }
+                histogram.pixels += local.pixels;
+            });
+        }
+
+        template <uint32_t Channels>
+        void lut_rows(const bmp_kernels::ChannelTables& tables) {
+            BMPThreadPool::instance().for_rows(bmp_info_header.height, row_stride, [&](uint32_t begin, uint32_t end) {
+                for (uint32_t y = begin; y < end; ++y) {
+                    bmp_kernels::lut_row<Channels>(row_data(y), bmp_info_header.width, tables);
+                }
+            });
+        }
+
+        void apply_tables(const bmp_kernels::ChannelTables& tables) {
+            SetLayout(PixelLayout::Interleaved);
+            markDirty(0, bmp_info_header.height);
+            if (channels == 4) {
+                lut_rows<4>(tables);
+            } else {
+                lut_rows<3>(tables);
+            }
+        }
+
+        // Rows reversed and swapped in pairs, the middle row is only reversed
+        template <uint32_t Channels>
+        void rotate_180_rows() {
+            const uint32_t height = bmp_info_header.height;
+            BMPThreadPool::instance().for_rows((height + 1) / 2, 2 * row_stride, [&](uint32_t begin, uint32_t end) {
+                uint8_t scratch[4096];
+                for (uint32_t y = begin; y < end; ++y) {
+                    uint8_t *row1 = row_data(y);
+                    uint8_t *row2 = row_data(height - 1 - y);
+                    bmp_kernels::reverse_row<Channels>(row1, bmp_info_header.width);
+                    if (row2 == row1) {
+                        continue;
+                    }
+                    bmp_kernels::reverse_row<Channels>(row2, bmp_info_header.width);
+                    for (uint32_t pos = 0; pos < row_stride; pos += sizeof(scratch)) {
+                        uint32_t n = std::min((uint32_t)sizeof(scratch), row_stride - pos);
+                        memcpy(scratch, row1 + pos, n);
+                        memcpy(row1 + pos, row2 + pos, n);
+                        memcpy(row2 + pos, scratch, n);
+                    }
+                }
+            });
+        }
+
+        template <uint32_t Channels>
+        void black_white_rows(const bmp_kernels::GreyWeights& w) {
+            BMPThreadPool::instance().for_rows(bmp_info_header.height, row_stride, [&](uint32_t begin, uint32_t end) {
+                for (uint32_t y = begin; y < end; ++y) {
+                    bmp_kernels::grey_row<Channels>(row_data(y), bmp_info_header.width, w);
+                }
+            });
+        }
+
+        template <uint32_t Src, uint32_t Dst>
+        void blit_rows(const BMP& src, const uint32_t x0, const uint32_t y0, const uint32_t w, const uint32_t h,
+                       const Point& dst, const BlendMode mode) {
+            // A source with the other alpha convention is converted a row at a time
+            const bool convert = Src == 4 && src.premultiplied != premultiplied;
+            BMPThreadPool::instance().for_rows(h, (size_t)w * Dst, [&](uint32_t begin, uint32_t end) {
+                std::vector<uint8_t> scratch(convert ? (size_t)4 * w : 0);
+                for (uint32_t y = begin; y < end; ++y) {
+                    const uint8_t *in = src.row_data(y0 + y) + (size_t)Src * x0;
+                    if (convert) {
+                        memcpy(scratch.data(), in, scratch.size());
+                        if (premultiplied) {
+                            bmp_kernels::premultiply_row(scratch.data(), w);
+                        } else {
+                            bmp_kernels::unpremultiply_row(scratch.data(), w);
+                        }
+                        in = scratch.data();
+                    }
+                    bmp_kernels::blit_row<Src, Dst>(row_data(dst.y + y) + (size_t)Dst * dst.x, in, w, mode, premultiplied);
+                }
+            });
+        }
+
+        template <uint32_t Channels>
+        void flip_x_rows() {
+            BMPThreadPool::instance().for_rows(bmp_info_header.height, row_stride, [&](uint32_t begin, uint32_t end) {
+                for (uint32_t y = begin; y < end; y++) {
+                    bmp_kernels::reverse_row<Channels>(row_data(y), bmp_info_header.width);
+                }
+            });
+        }
+
+        void release_mapping() {
+#ifndef _WIN32
+            if (mapping) {
+                munmap(mapping, mapping_size);
+                mapping = nullptr;
+                mapping_size = 0;
+                pixels = nullptr;
+            }
+#endif
+        }
+
+        // Check an in-memory file and load its headers, offset_data is set to the position of the pixel data
+        bool parse(const uint8_t *bytes, const size_t size, const char *fname, uint32_t& offset_data, bool& top_down) {
+            if (size < sizeof(BMPFileHeader) + sizeof(BMPInfoHeader)) {
+                std::cerr << "Error! Unrecognized file format.\n";
+                return false;
+            }
+            offset_data = read_headers(bytes, size, fname, top_down);
+            if (file_header.file_type != 0x4D42) {
+                return false;
+            }
+            if (bmp_info_header.bit_count != 24 && bmp_info_header.bit_count != 32) {
+                std::cerr << "The program can treat only 24 or 32 bits per pixel BMP files\n";
+                return false;
+            }
+            // The row sizes are kept in 32 bits
+            if (bmp_info_header.width <= 0 || bmp_info_header.height <= 0 || bmp_info_header.width > (INT32_MAX - 3) / 4 ||
+                offset_data + (uint64_t)make_stride_aligned(4) * bmp_info_header.height > size) {
+                std::cerr << "Error! The file \"" << fname << "\" is truncated\n";
+                return false;
+            }
+            return true;
+        }
+
+        // Files with palette indices or 16 bits pixels, decoded to 24 or 32 bits instead of used as they are
+        static bool converted_format(const uint8_t *bytes, const size_t size) {
+            if (size < sizeof(BMPFileHeader) + sizeof(BMPInfoHeader)) {
+                return false;
+            }
+            BMPInfoHeader info;
+            memcpy(&info, bytes + sizeof(BMPFileHeader), sizeof(info));
+            return info.bit_count == 1 || info.bit_count == 4 || info.bit_count == 8 || info.bit_count == 16;
+        }
+
+        // Decode such a file: the indexed ones to 24 bits, the 16 bits ones to 24 bits,
+        // or to 32 bits when they have an alpha mask
+        bool load_converted(const uint8_t *bytes, const size_t size, const char *fname) {
+            BMPFileHeader file;
+            BMPInfoHeader info;
+            memcpy(&file, bytes, sizeof(file));
+            memcpy(&info, bytes + sizeof(file), sizeof(info));
+            if (info.bit_count != 16) {
+                BMPIndexed indexed;
+                if (!indexed.load(bytes, size, fname)) {
+                    return false;
+                }
+                expand(indexed, false);
+                dirty_rows.assign(bmp_info_header.height, 0);
+                return true;
+            }
+
+            // 5 bits per channel, or the masks after the 40 bytes of the info header
+            uint32_t masks[4] = { 0x7C00, 0x03E0, 0x001F, 0 };
+            const uint64_t masks_end = sizeof(file) + sizeof(info) + (info.size >= 56 || info.compression == 6 ? 16 : 12);
+            if (file.file_type != 0x4D42 || info.size < sizeof(BMPInfoHeader) ||
+                (info.compression != 0 && info.compression != 3 && info.compression != 6)) {
+                std::cerr << "Error! Unrecognized file format.\n";
+                return false;
+            }
+            if (info.compression != 0) {
+                if (masks_end > size) {
+                    std::cerr << "Error! The file \"" << fname << "\" does not seem to contain bit mask information\n";
+                    return false;
+                }
+                memcpy(masks, bytes + sizeof(file) + sizeof(info), masks_end - sizeof(file) - sizeof(info));
+            }
+            const bool top_down = info.height < 0;
+            const uint32_t height = top_down ? -(int64_t)info.height : info.height;
+            const uint32_t file_stride = ((uint32_t)info.width * 2 + 3) & ~3u;
+            if (info.width <= 0 || height == 0 || file.offset_data + (uint64_t)file_stride * height > size) {
+                std::cerr << "Error! The file \"" << fname << "\" is truncated\n";
+                return false;
+            }
+
+            // masks holds red, green, blue and alpha as in the file
+            const bmp_kernels::BitFields fields(masks[2], masks[1], masks[0], masks[3]);
+            create(info.width, height, fields.alpha, false);
+            bmp_info_header.x_pixels_per_meter = info.x_pixels_per_meter;
+            bmp_info_header.y_pixels_per_meter = info.y_pixels_per_meter;
+            dirty_rows.assign(height, 0);
+            const uint8_t *rows = bytes + file.offset_data;
+            BMPThreadPool::instance().for_rows(height, row_stride, [&](uint32_t begin, uint32_t end) {
+                for (uint32_t y = begin; y < end; ++y) {
+                    const uint8_t *src = rows + (size_t)file_stride * (top_down ? height - 1 - y : y);
+                    if (channels == 4) {
+                        bmp_kernels::bitfields_row<4>(src, info.width, fields, row_data(y));
+                    } else {
+                        bmp_kernels::bitfields_row<3>(src, info.width, fields, row_data(y));
+                    }
+                }
+            });
+            return true;
+        }
+
+        // Set up a 24 or 32 bits image with the colors of an indexed one
+        void expand(const BMPIndexed& image, const bool has_alpha) {
+            create(image.width(), image.height(), has_alpha, false);
+            bmp_info_header.x_pixels_per_meter = image.bmp_info_header.x_pixels_per_meter;
+            bmp_info_header.y_pixels_per_meter = image.bmp_info_header.y_pixels_per_meter;
+            uint8_t palette[256][4];
+            for (int i = 0; i < 256; ++i) {
+                memcpy(palette[i], image.palette[i], 3);
+                palette[i][3] = 255;
+            }
+            const uint32_t width = bmp_info_header.width;
+            BMPThreadPool::instance().for_rows(bmp_info_header.height, row_stride, [&](uint32_t begin, uint32_t end) {
+                for (uint32_t y = begin; y < end; ++y) {
+                    if (channels == 4) {
+                        bmp_kernels::palette_row<4>(image.row_data(y), width, palette, row_data(y));
+                    } else {
+                        bmp_kernels::palette_row<3>(image.row_data(y), width, palette, row_data(y));
+                    }
+                }
+            });
+        }
+
+        // Use the pixel array of an in-memory file in place, with the padded stride it has in the file
+        bool attach(uint8_t *bytes, const size_t size, const char *fname) {
+            uint32_t offset_data;
+            bool top_down;
+            if (!parse(bytes, size, fname, offset_data, top_down)) {
+                *this = BMP();      // Empty and unmapped, no header is left from bytes
+                return false;
+            }
+            set_rows(bytes + offset_data, make_stride_aligned(4), top_down);
+            return true;
+        }
+
+        // Address the rows stored from first, file_stride bytes apart, from the bottom row or from the top one
+        void set_rows(uint8_t *first, const uint32_t file_stride, const bool top_down) {
+            pixels = top_down ? first + (size_t)file_stride * (bmp_info_header.height - 1) : first;
+            stride = top_down ? -(int64_t)file_stride : (int64_t)file_stride;
+        }
+
+        // Load the headers from an in-memory file, returns the position of the pixel data.
+        // The height is made positive, top_down tells whether the rows are stored from the top.
+        uint32_t read_headers(const uint8_t *bytes, const size_t size, const char *fname, bool& top_down) {
+            memcpy(&file_header, bytes, sizeof(file_header));
+            if(file_header.file_type != 0x4D42) {
+                std::cerr << "Error! Unrecognized file format.\n";
+            }
+            memcpy(&bmp_info_header, bytes + sizeof(file_header), sizeof(bmp_info_header));
+            top_down = bmp_info_header.height < 0 && bmp_info_header.height != INT32_MIN;
+            if (top_down) {
+                bmp_info_header.height = -bmp_info_header.height;
+            }
+
+            // The BMPColorHeader is used only for transparent images
+            if(bmp_info_header.bit_count == 32) {
+                // Check if the file has bit mask color information
+                if(bmp_info_header.size >= (sizeof(BMPInfoHeader) + sizeof(BMPColorHeader)) &&
+                    size >= sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader)) {
+                    memcpy(&bmp_color_header, bytes + sizeof(file_header) + sizeof(bmp_info_header), sizeof(bmp_color_header));
+                    // Check if the pixel data is stored as BGRA and if the color space type is sRGB
+                    check_color_header(bmp_color_header);
+                } else {
+                    std::cerr << "Error! The file \"" << fname << "\" does not seem to contain bit mask information\n";
+                    std::cerr << "Error! Unrecognized file format.\n";
+                }
+            }
+
+            uint32_t offset_data = file_header.offset_data;
+            adjust_headers();
+
+            uint32_t new_stride = make_stride_aligned(4);
+            file_header.file_size += new_stride * bmp_info_header.height;
+
+            return offset_data;
+        }
+
+        // Adjust the header fields for output.
+        // Some editors will put extra info in the image file, we only save the headers and the data.
+        void adjust_headers() {
+            if(bmp_info_header.bit_count == 32) {
+                bmp_info_header.size = sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
+                file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
+            } else {
+                bmp_info_header.size = sizeof(BMPInfoHeader);
+                file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
+            }
+            file_header.file_size = file_header.offset_data;
+
+            channels = bmp_info_header.bit_count / 8;
+            row_stride = bmp_info_header.width * channels;
+            layout = PixelLayout::Interleaved;
+            premultiplied = false;
+            dirty_rows.assign(bmp_info_header.height > 0 ? bmp_info_header.height : 0, 0);
+        }
+
+        static const size_t WriteChunk = 1 << 20;     // Bytes staged per write call
+        static const size_t DirectAlign = 4096;       // Alignment of the buffers, offsets and sizes for O_DIRECT
+
+        uint32_t pack_headers_size() const {
+            return sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + (bmp_info_header.bit_count == 32 ? sizeof(BMPColorHeader) : 0);
+        }
+
+        // Copy the headers as they go in the file, rows stored from the top (logical FlipY)
+        // make a top-down image. Returns their size.
+        uint32_t pack_headers(uint8_t *out) {
+            BMPFileHeader file = file_header;
+            BMPInfoHeader info = bmp_info_header;
+            uint32_t size = pack_headers_size();
+            file.offset_data = size;
+            file.file_size = size + make_stride_aligned(4) * (uint64_t)info.height;
+            if (stride < 0) {
+                info.height = -info.height;
+            }
+            memcpy(out, &file, sizeof(file));
+            memcpy(out + sizeof(file), &info, sizeof(info));
+            if (info.bit_count == 32) {
+                memcpy(out + sizeof(file) + sizeof(info), &bmp_color_header, sizeof(bmp_color_header));
+            }
+            return size;
+        }
+
+        // File rows [begin, end) with their zeroed padding
+        void pack_rows(uint8_t *out, const uint32_t begin, const uint32_t end) {
+            const uint32_t new_stride = make_stride_aligned(4);
+            for (uint32_t k = begin; k < end; ++k, out += new_stride) {
+                export_row(stride < 0 ? bmp_info_header.height - 1 - k : k, out);
+                memset(out + row_stride, 0, new_stride - row_stride);
+            }
+        }
+
+        // Stage the whole file in scratch a chunk at a time and hand the chunks to sink(bytes, size, last).
+        // All the chunks but the last one are a multiple of align bytes, and start at an address aligned to it.
+        template <typename Sink>
+        bool stream_file(std::vector<uint8_t>& scratch, const size_t align, Sink sink) {
+            const uint32_t new_stride = make_stride_aligned(4);
+            const uint32_t height = bmp_info_header.height;
+            const uint32_t chunk_rows = std::max<size_t>(1, WriteChunk / new_stride);
+            const size_t capacity = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader) +
+                                    (size_t)chunk_rows * new_stride + align;
+            if (scratch.size() < capacity + align) {
+                scratch.resize(capacity + align);
+            }
+            uint8_t *buffer = scratch.data() + (align - (uintptr_t)scratch.data() % align) % align;
+
+            size_t used = pack_headers(buffer);
+            for (uint32_t k = 0; k < height; ) {
+                uint32_t n = std::min<uint32_t>(chunk_rows, height - k);
+                pack_rows(buffer + used, k, k + n);
+                used += (size_t)n * new_stride;
+                k += n;
+                if (k == height) {
+                    break;
+                }
+                // Hand over whole blocks, the rest moves to the front of the buffer
+                size_t ready = used - used % align;
+                if (!sink(buffer, ready, false)) {
+                    return false;
+                }
+                memmove(buffer, buffer + ready, used - ready);
+                used -= ready;
+            }
+            return sink(buffer, used, true);
+        }
+
+#ifndef _WIN32
+        static bool write_all(const int fd, struct iovec *parts, int count) {
+            while (count > 0) {
+                ssize_t n = ::writev(fd, parts, count);
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                // Skip what was written, a partial write ends in the middle of a part
+                while (count > 0 && (size_t)n >= parts->iov_len) {
+                    n -= parts->iov_len;
+                    ++parts;
+                    --count;
+                }
+                if (count > 0) {
+                    parts->iov_base = (uint8_t*)parts->iov_base + n;
+                    parts->iov_len -= n;
+                }
+            }
+            return true;
+        }
+#endif
+
+        void write_headers(std::ofstream &of) {
+            of.write((const char*)&file_header, sizeof(file_header));
+            of.write((const char*)&bmp_info_header, sizeof(bmp_info_header));
+            if(bmp_info_header.bit_count == 32) {
+                of.write((const char*)&bmp_color_header, sizeof(bmp_color_header));
+            }
+        }
+
+        // Add 1 to the row_stride until it is divisible with align_stride
+        uint32_t make_stride_aligned(uint32_t align_stride) {
+            uint32_t new_stride = row_stride;
+            while (new_stride % align_stride != 0) {
+                new_stride++;
+            }
+            return new_stride;
+        }
+
+        // Check if the pixel data is stored as BGRA and if the color space type is sRGB
+        void check_color_header(BMPColorHeader &bmp_color_header) {
+            BMPColorHeader expected_color_header;
+            if(expected_color_header.red_mask != bmp_color_header.red_mask ||
+                expected_color_header.blue_mask != bmp_color_header.blue_mask ||
+                expected_color_header.green_mask != bmp_color_header.green_mask ||
+                expected_color_header.alpha_mask != bmp_color_header.alpha_mask) {
+                    std::cerr << "Unexpected color mask format! The program expects the pixel data to be in the BGRA format\n";
+            }
+            if(expected_color_header.color_space_type != bmp_color_header.color_space_type) {
+                std::cerr << "Unexpected color space type! The program expects sRGB values\n";
+            }
+        }
+};
+
+// EffectChain class
+// A list of effects applied to an image in one pass. The per pixel effects (grey scale, channel
+// weights, clear, tint) go on a segment of a row at a time while it is in cache, the ones that
+// only change each channel are merged into one lookup table. The flips and rotations do not
+// depend on the pixel values, they are merged into one move of each row (or one blocked
+// transpose), done right after its pixels are processed. Each pixel is read and written
+// about once, whatever the length.
+class EffectChain {
+    public:
+        EffectChain() {
+            stages.push_back(Stage());
+        }
+
+        // Same weights and checks as BMP::BlackWhite
+        EffectChain& BlackWhite(const float r = 0.33, const float g = 0.33, const float b = 0.33) {
+            if (r + g + b > 1) {
+                std::cerr << "BlackWhite error: Invalid grey scale\n";
+            }
+            if (r < 0 || g < 0 || b < 0 || r > 1 || g > 1 || b > 1) {
+                std::cerr << "BlackWhite error: The weights must be between 0 and 1\n";
+                return *this;
+            }
+            Stage& stage = stages.back();
+            stage.grey = true;
+            stage.weights.r = (uint16_t)lroundf(r * (1 << bmp_kernels::GreyShift));
+            stage.weights.g = (uint16_t)lroundf(g * (1 << bmp_kernels::GreyShift));
+            stage.weights.b = (uint16_t)lroundf(b * (1 << bmp_kernels::GreyShift));
+            stages.push_back(Stage());
+            return *this;
+        }
+
+        // Multiply the channels, saturating at 255
+        EffectChain& ChannelWeights(const float r, const float g, const float b) {
+            if (r < 0 || g < 0 || b < 0) {
+                std::cerr << "ChannelWeights error: The weights must be positive\n";
+                return *this;
+            }
+            const float w[3] = { b, g, r };
+            for (int c = 0; c < 3; ++c) {
+                for (int v = 0; v < 256; ++v) {
+                    uint8_t& out = stages.back().lut.bytes[c][v];
+                    out = (uint8_t)std::min(255L, lroundf(out * w[c]));
+                }
+            }
+            stages.back().lut.widen();
+            return *this;
+        }
+
+        // Set every byte of the pixels to c, as BMP::clear does
+        EffectChain& Clear(const uint8_t c) {
+            memset(stages.back().lut.bytes, c, sizeof(stages.back().lut.bytes));
+            stages.back().lut.widen();
+            return *this;
+        }
+
+        // Move the colors amount of the way (0 to 1) towards c, the alpha is left as it is
+        EffectChain& Tint(const Color& c, const float amount) {
+            if (amount < 0 || amount > 1) {
+                std::cerr << "Tint error: The amount must be between 0 and 1\n";
+                return *this;
+            }
+            const uint8_t target[3] = { c.b, c.g, c.r };
+            for (int i = 0; i < 3; ++i) {
+                for (int v = 0; v < 256; ++v) {
+                    uint8_t& out = stages.back().lut.bytes[i][v];
+                    out = (uint8_t)lroundf(out + (target[i] - out) * amount);
+                }
+            }
+            stages.back().lut.widen();
+            return *this;
+        }
+
+        EffectChain& FlipX() {
+            flip_x = !flip_x;
+            return *this;
+        }
+
+        EffectChain& FlipY() {
+            flip_y = !flip_y;
+            return *this;
+        }
+
+        EffectChain& Rotate180() {
+            return FlipX().FlipY();
+        }
+
+        // The flips asked before are done before the transpose, which swaps their axes
+        EffectChain& Transpose() {
+            transpose = !transpose;
+            std::swap(flip_x, flip_y);
+            return *this;
+        }
+
+        EffectChain& Rotate90() {
+            return Transpose().FlipY();
+        }
+
+        EffectChain& Rotate270() {
+            return Transpose().FlipX();
+        }
+
+        void apply(BMP& image) const {
+            BMP_PROBE("EffectChain", image.probe_bytes(), image.probe_pixels());
+            if (image.width() <= 0 || image.height() <= 0) {
+                return;
+            }
+            image.SetLayout(PixelLayout::Interleaved);
+            image.markDirty(0, image.height());
+            if (image.Channels() == 4) {
+                apply_rows<4>(image);
+            } else {
+                apply_rows<3>(image);
+            }
+        }
+
+        // So a chain can be a BatchProcessor effect
+        void operator()(BMP& image) const {
+            apply(image);
+        }
+
+    private:
+        static const uint32_t SegmentPixels = 1024;    // Pixels processed by all the stages at once, they stay in L1
+
+        // A lookup table per channel, then an optional grey scale
+        struct Stage {
+            bmp_kernels::ChannelTables lut;
+            bool grey;
+            bmp_kernels::GreyWeights weights;
+
+            Stage() : grey(false) {}
+        };
+
+        std::vector<Stage> stages;
+        bool transpose{ false };            // Done first, then the flips
+        bool flip_x{ false };
+        bool flip_y{ false };
+
+        template <uint32_t Channels>
+        void process_row(uint8_t *row, const uint32_t width, const std::vector<char>& skip_lut, const bool reverse) const {
+            for (uint32_t x = 0; x < width; x += SegmentPixels) {
+                uint8_t *segment = row + (size_t)Channels * x;
+                uint32_t count = width - x < SegmentPixels ? width - x : SegmentPixels;
+                for (size_t s = 0; s < stages.size(); ++s) {
+                    if (!skip_lut[s]) {
+                        bmp_kernels::lut_row<Channels>(segment, count, stages[s].lut);
+                    }
+                    if (stages[s].grey) {
+                        bmp_kernels::grey_row<Channels>(segment, count, stages[s].weights);
+                    }
+                }
+            }
+            if (reverse) {
+                bmp_kernels::reverse_row<Channels>(row, width);
+            }
+        }
+
+        template <uint32_t Channels>
+        void apply_rows(BMP& image) const {
+            std::vector<char> skip_lut(stages.size());
+            for (size_t s = 0; s < stages.size(); ++s) {
+                skip_lut[s] = stages[s].lut.identity();
+            }
+            const uint32_t width = image.width(), height = image.height();
+            const size_t row_bytes = (size_t)Channels * width;
+
+            if (transpose) {
+                BMP result = image.transposed<Channels>(flip_x, flip_y, [&](uint8_t *row) {
+                    process_row<Channels>(row, width, skip_lut, false);
+                });
+                image = std::move(result);
+                return;
+            }
+
+            if (!flip_y) {
+                BMPThreadPool::instance().for_rows(height, row_bytes, [&](uint32_t begin, uint32_t end) {
+                    for (uint32_t y = begin; y < end; ++y) {
+                        process_row<Channels>(image.row_data(y), width, skip_lut, flip_x);
+                    }
+                });
+                return;
+            }
+
+            // Pairs of rows, both are processed while in cache and then swapped, the middle row stays
+            BMPThreadPool::instance().for_rows((height + 1) / 2, 2 * row_bytes, [&](uint32_t begin, uint32_t end) {
+                uint8_t scratch[4096];
+                for (uint32_t y = begin; y < end; ++y) {
+                    uint8_t *row1 = image.row_data(y);
+                    uint8_t *row2 = image.row_data(height - 1 - y);
+                    process_row<Channels>(row1, width, skip_lut, flip_x);
+                    if (row2 == row1) {
+                        continue;
+                    }
+                    process_row<Channels>(row2, width, skip_lut, flip_x);
+                    for (size_t pos = 0; pos < row_bytes; pos += sizeof(scratch)) {
+                        size_t n = std::min(sizeof(scratch), row_bytes - pos);
+                        memcpy(scratch, row1 + pos, n);
+                        memcpy(row1 + pos, row2 + pos, n);
+                        memcpy(row2 + pos, scratch, n);
+                    }
+                }
+            });
+        }
+};
+
+// BMPRowReader class
+// Reads an image in bands of rows, from the bottom row up, so only one band is kept in memory.
+// Each band is a BMP of band_rows rows (fewer for the last one) where the effects can be applied.
+class BMPRowReader {
+    public:
+        BMPRowReader(const char *fname, const uint32_t band_rows = 64) : inp(fname, std::ios_base::binary), band_rows(band_rows) {
+            if (inp) {
+                uint8_t headers[sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader)];
+                inp.read((char*)headers, sizeof(headers));
+                offset_data = header.read_headers(headers, inp.gcount(), fname, top_down);
+                inp.clear();
+                inp.seekg(offset_data, inp.beg);
+
+                if (header.bmp_info_header.bit_count != 24 && header.bmp_info_header.bit_count != 32) {
+                    std::cerr << "The program can treat only 24 or 32 bits per pixel BMP files\n";
+                    inp.close();
+                }
+                if (band_rows == 0) {
+                    std::cerr << "BMPRowReader error: a band must have at least one row\n";
+                    inp.close();
+                }
+                file_stride = header.make_stride_aligned(4);
+            }
+            else {
+                std::cerr << "Unable to open the input image file.\n";
+            }
+        }
+
+        // Read the next band of rows into band, returns false when all the rows have been read
+        bool read_band(BMP& band) {
+            BMP_PROBE("read_band", 0, 0);
+            if (!inp.is_open() || next_row >= (uint32_t)height()) {
+                return false;
+            }
+
+            uint32_t rows = std::min(band_rows, (uint32_t)height() - next_row);
+            if (band.width() != width() || band.height() != (int32_t)rows || band.Channels() != Channels() || band.is_mapped() ||
+                band.layout != PixelLayout::Interleaved || band.premultiplied) {
+                band.create(width(), rows, Channels() == 4, false);
+            }
+            band.bmp_color_header = header.bmp_color_header;
+
+            // One read for the whole band, the padding is dropped while copying the rows.
+            // The bands of a top-down file are read from its end, their rows in reverse.
+            if (top_down) {
+                inp.seekg(offset_data + (uint64_t)file_stride * (height() - next_row - rows), inp.beg);
+            }
+            if (file_stride == band.stride && !top_down) {
+                inp.read((char*)band.pixels, (size_t)file_stride * rows);
+            } else {
+                buffer.resize((size_t)file_stride * rows);
+                inp.read((char*)buffer.data(), buffer.size());
+                for (uint32_t y = 0; y < rows; ++y) {
+                    memcpy(band.row_data(top_down ? rows - 1 - y : y), buffer.data() + (size_t)file_stride * y, band.row_stride);
+                }
+            }
+            if (!inp) {
+                std::cerr << "BMPRowReader error: the file is truncated\n";
+                inp.close();
+                return false;
+            }
+
+            first_row = next_row;
+            next_row += rows;
+            BMP_PROBE_COUNT(band.probe_bytes(), band.probe_pixels());
+            return true;
+        }
+
+        int32_t width() const {
+            return header.width();
+        }
+
+        int32_t height() const {
+            return header.height();
+        }
+
+        uint32_t Channels() const {
+            return header.Channels();
+        }
+
+        // Row of the image where the last band read starts
+        uint32_t band_start() const {
+            return first_row;
+        }
+
+    private:
+        friend class BMPRowWriter;
+
+        std::ifstream inp;
+        BMP header;
+        uint32_t band_rows;
+        uint32_t offset_data{ 0 };
+        bool top_down{ false };             // Rows stored from the top in the file
+        uint32_t file_stride{ 0 };
+        uint32_t first_row{ 0 };
+        uint32_t next_row{ 0 };
+        std::vector<uint8_t> buffer;
+};
+
+// BMPRowWriter class
+// Writes an image band by band, from the bottom row up. The height is the number of rows written,
+// the headers are filled in when the stream is finalized.
+class BMPRowWriter {
+    public:
+        BMPRowWriter(const char *fname, int32_t width, bool has_alpha = true) : of(fname, std::ios_base::binary), header(width, 1, has_alpha) {
+            if (of) {
+                file_stride = header.make_stride_aligned(4);
+                // Room for the headers, rewritten by finalize
+                header.write_headers(of);
+            }
+            else {
+                std::cerr << "Unable to open the output image file.\n";
+            }
+        }
+
+        // Copy the headers (color masks, resolution) of the image being read
+        BMPRowWriter(const char *fname, const BMPRowReader& reader) : BMPRowWriter(fname, reader.width(), reader.Channels() == 4) {
+            header.bmp_info_header.x_pixels_per_meter = reader.header.bmp_info_header.x_pixels_per_meter;
+            header.bmp_info_header.y_pixels_per_meter = reader.header.bmp_info_header.y_pixels_per_meter;
+            header.bmp_color_header = reader.header.bmp_color_header;
+        }
+
+        ~BMPRowWriter() {
+            finalize();
+        }
+
+        // Append the rows of band on top of the rows already written
+        void write_band(const BMP& band) {
+            BMP_PROBE("write_band", band.probe_bytes(), band.probe_pixels());
+            if (!of.is_open()) {
+                return;
+            }
+            if (band.width() != header.width() || band.Channels() != header.Channels()) {
+                std::cerr << "BMPRowWriter error: the band does not match the image layout\n";
+                return;
+            }
+
+            uint32_t rows = band.height();
+            if (band.stride == file_stride && band.layout == PixelLayout::Interleaved && !band.premultiplied) {
+                of.write((const char*)band.pixels, (size_t)file_stride * rows);
+            } else {
+                // Build the padded rows in one buffer so the band goes out in a single write
+                buffer.assign((size_t)file_stride * rows, 0);
+                for (uint32_t y = 0; y < rows; ++y) {
+                    band.export_row(y, buffer.data() + (size_t)file_stride * y);
+                }
+                of.write((const char*)buffer.data(), buffer.size());
+            }
+            rows_written += rows;
+        }
+
+        // Fill in the height and the file size, and close the file
+        void finalize() {
+            if (!of.is_open()) {
+                return;
+            }
+            if (rows_written == 0) {
+                std::cerr << "BMPRowWriter error: no rows have been written\n";
+            }
+
+            header.bmp_info_header.height = rows_written;
+            header.file_header.file_size = header.file_header.offset_data + file_stride * rows_written;
+            of.seekp(0, of.beg);
+            header.write_headers(of);
+            of.close();
+        }
+
+    private:
+        std::ofstream of;
+        BMP header;
+        uint32_t file_stride{ 0 };
+        uint32_t rows_written{ 0 };
+        std::vector<uint8_t> buffer;
+};
+
+// BatchProcessor class
+// Runs a chain of effects over many files. Readers, workers and writers run at the same time and
+// hand the images over through queues, so the disk and the cores are busy together. At most
+// in_flight images are alive at once: the readers wait for a free one, and the images (with their
+// pixel arrays) are reused from one file to the next. The files ahead of the readers are announced
+// to the system (posix_fadvise) so they are read ahead while the current ones are processed.
+class BatchProcessor {
+    public:
+        typedef std::function<void(BMP&)> Effect;
+
+        BatchProcessor() {}
+
+        // Add an effect at the end of the chain
+        BatchProcessor& then(const Effect& effect) {
+            effects.push_back(effect);
+            return *this;
+        }
+
+        void set_workers(const uint32_t n) {
+            workers = std::max(1u, n);
+        }
+
+        void set_io_threads(const uint32_t n) {
+            io_threads = std::max(1u, n);
+        }
+
+        // Images alive at once, being read, processed, written or waiting for the next stage (0 for
+        // one per thread)
+        void set_in_flight(const uint32_t n) {
+            in_flight = n;
+        }
+
+        void set_write_hint(const WriteHint hint_) {
+            hint = hint_;
+        }
+
+        // Read inputs[i], run the chain on it and write it to outputs[i]. Returns the number of files that failed.
+        size_t run(const std::vector<std::string>& inputs, const std::vector<std::string>& outputs) {
+            if (inputs.size() != outputs.size()) {
+                std::cerr << "BatchProcessor error: there must be one output for each input\n";
+                return inputs.size();
+            }
+
+            const uint32_t slots = in_flight ? in_flight : workers + 2 * io_threads;
+            std::vector<BMP> images(slots, BMP(1, 1, false));
+            Queue free_images, loaded, processed;
+            for (uint32_t i = 0; i < slots; ++i) {
+                free_images.push(Job(0, &images[i]));
+            }
+
+            std::atomic<size_t> next{ 0 };
+            std::atomic<size_t> failures{ 0 };
+            std::atomic<uint32_t> readers_left{ io_threads };
+            std::atomic<uint32_t> workers_left{ workers };
+            std::vector<std::thread> threads;
+
+            for (uint32_t t = 0; t < io_threads; ++t) {
+                threads.push_back(std::thread([&]() {
+                    for (size_t i = next++; i < inputs.size(); i = next++) {
+                        prefetch(inputs, i + io_threads);   // The next files are being read by the other readers
+                        Job job(i, nullptr);
+                        free_images.pop(job);       // Waits while all the images are in use
+                        job.index = i;
+                        if (job.image->read(inputs[i].c_str())) {
+                            loaded.push(job);
+                        } else {
+                            std::cerr << "BatchProcessor error: unable to read \"" << inputs[i] << "\"\n";
+                            ++failures;
+                            free_images.push(job);
+                        }
+                    }
+                    if (--readers_left == 0) {
+                        loaded.close();
+                    }
+                }));
+            }
+
+            for (uint32_t t = 0; t < workers; ++t) {
+                threads.push_back(std::thread([&]() {
+                    Job job(0, nullptr);
+                    while (loaded.pop(job)) {
+                        try {
+                            for (size_t e = 0; e < effects.size(); ++e) {
+                                effects[e](*job.image);
+                            }
+                            processed.push(job);
+                        } catch (const std::exception& error) {
+                            std::cerr << "BatchProcessor error: \"" << inputs[job.index] << "\": " << error.what() << "\n";
+                            ++failures;
+                            free_images.push(job);
+                        }
+                    }
+                    if (--workers_left == 0) {
+                        processed.close();
+                    }
+                }));
+            }
+
+            for (uint32_t t = 0; t < io_threads; ++t) {
+                threads.push_back(std::thread([&]() {
+                    std::vector<uint8_t> scratch;   // Reused by all the writes of this thread
+                    Job job(0, nullptr);
+                    while (processed.pop(job)) {
+                        if (!job.image->write(outputs[job.index].c_str(), scratch, hint)) {
+                            ++failures;
+                        }
+                        free_images.push(job);
+                    }
+                }));
+            }
+
+            for (size_t t = 0; t < threads.size(); ++t) {
+                threads[t].join();
+            }
+            return failures;
+        }
+
+    private:
+        std::vector<Effect> effects;
+        uint32_t workers{ std::max(1u, std::thread::hardware_concurrency()) };
+        uint32_t io_threads{ 2 };
+        uint32_t in_flight{ 0 };
+        WriteHint hint{ WriteHint::Default };
+
+        struct Job {
+            size_t index;
+            BMP *image;
+
+            Job(const size_t index_, BMP *image_) : index(index_), image(image_) {}
+        };
+
+        // Hand over between two stages, pop waits for a job and returns false once closed and empty
+        class Queue {
+            public:
+                void push(const Job& job) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    jobs.push_back(job);
+                    ready.notify_one();
+                }
+
+                bool pop(Job& job) {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [this]() { return !jobs.empty() || closed; });
+                    if (jobs.empty()) {
+                        return false;
+                    }
+                    job = jobs.front();
+                    jobs.pop_front();
+                    return true;
+                }
+
+                void close() {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    closed = true;
+                    ready.notify_all();
+                }
+
+            private:
+                std::mutex mutex;
+                std::condition_variable ready;
+                std::deque<Job> jobs;
+                bool closed{ false };
+        };
+
+        // Ask the system to start reading a file that comes next
+        static void prefetch(const std::vector<std::string>& inputs, const size_t i) {
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+            if (i < inputs.size()) {
+                int fd = ::open(inputs[i].c_str(), O_RDONLY);
+                if (fd >= 0) {
+                    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+                    ::close(fd);
+                }
+            }
+#else
+            (void)inputs;
+            (void)i;
+#endif
+        }
+};
+
+// Which pixels of a self-intersecting polygon are inside
+enum class FillRule {
+    EvenOdd,                    // Inside when a ray from the pixel crosses the outline an odd number of times
+    NonZero                     // Inside when the outline winds around the pixel
+};
+
+// bmpDrawer class
+class bmpDrawer {
+    public:
+        bmpDrawer(BMP* image_) : image(image_) {}
+
+        // Restrict the drawing to a rectangle of the image, the pixels outside of it are skipped
+        void setClip(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h) {
+            clip_x = x;
+            clip_y = y;
+            clip_x_end = (uint32_t)std::min<uint64_t>((uint64_t)x + w, UINT32_MAX);
+            clip_y_end = (uint32_t)std::min<uint64_t>((uint64_t)y + h, UINT32_MAX);
+        }
+
+        void resetClip() {
+            setClip(0, 0, UINT32_MAX, UINT32_MAX);
+        }
+
+        // Pixel inside both the image and the clip rectangle
+        bool visible(const uint32_t x, const uint32_t y) const {
+            return x >= clip_x && x < clip_x_end && y >= clip_y && y < clip_y_end && image->inside(x, y);
+        }
+
+        /// Draw on image
+
+        // Pixels outside of the image or of the clip rectangle are skipped
+        void drawPixel(const uint32_t x, const uint32_t y, const Color& c) {
+            Edit edit(this);
+            touch(x, y, x, y);
+            if (visible(x,y)) {
+                image->setPixel(x,y,c);
+            }
+        }
+
+        void drawPixel(const pixel& px) {
+            drawPixel(px.x, px.y, px.color);
+        }
+
+        // Lines are clipped to the visible area before being rasterized, the pixels drawn are the ones
+        // of the whole line that fall inside of it. Like before, horizontal and vertical lines stop
+        // one pixel short of the second point.
+        void drawLine(int32_t x1, int32_t y1, int32_t x2, int32_t y2, const Color& c) {
+            BMP_PROBE("drawLine", 0, 0);
+            Edit edit(this);
+            touch(std::min(x1, x2), std::min(y1, y2), std::max(x1, x2), std::max(y1, y2));
+            uint8_t px[4];
+            colorBytes(c, px);
+            if (image->Channels() == 4) {
+                drawSegment<4>(x1, y1, x2, y2, px);
+            } else {
+                drawSegment<3>(x1, y1, x2, y2, px);
+            }
+        }
+
+        // Lines between consecutive points, the color and the channels dispatch are set up once for the chain
+        void drawPolyline(const std::vector<Point>& points, const Color& c) {
+            drawPolyline(points.data(), points.size(), c);
+        }
+
+        void drawPolyline(const Point* points, const size_t count, const Color& c) {
+            BMP_PROBE("drawPolyline", 0, 0);
+            Edit edit(this);
+            touchPoints(points, count, 0);
+            uint8_t px[4];
+            colorBytes(c, px);
+            if (image->Channels() == 4) {
+                drawPolylineSegments<4>(points, count, px);
+            } else {
+                drawPolylineSegments<3>(points, count, px);
+            }
+        }
+
+        // Antialiased line (Wu), each pixel is blended with the color at its coverage times c.alpha
+        void drawLineAA(int32_t x1, int32_t y1, int32_t x2, int32_t y2, const Color& c) {
+            BMP_PROBE("drawLineAA", 0, 0);
+            Edit edit(this);
+            touch((int64_t)std::min(x1, x2) - 1, (int64_t)std::min(y1, y2) - 1, (int64_t)std::max(x1, x2) + 1, (int64_t)std::max(y1, y2) + 1);
+            if (image->Channels() == 4) {
+                drawSegmentAA<4>(x1, y1, x2, y2, c);
+            } else {
+                drawSegmentAA<3>(x1, y1, x2, y2, c);
+            }
+        }
+
+        // Line of the given width in pixels with antialiased edges and flat ends, blended like drawLineAA.
+        // The pixels fully inside are blended a row span at a time.
+        void drawLine(int32_t x1, int32_t y1, int32_t x2, int32_t y2, const Color& c, const float width) {
+            BMP_PROBE("drawLine", 0, 0);
+            Edit edit(this);
+            const int64_t reach = (int64_t)ceil(std::max(width, 1.0f) / 2) + 1;
+            touch(std::min(x1, x2) - reach, std::min(y1, y2) - reach, std::max(x1, x2) + reach, std::max(y1, y2) + reach);
+            if (width <= 1.0f) {
+                drawLineAA(x1, y1, x2, y2, c);
+            } else if (image->Channels() == 4) {
+                drawThickSegment<4>(x1, y1, x2, y2, c, width);
+            } else {
+                drawThickSegment<3>(x1, y1, x2, y2, c, width);
+            }
+        }
+
+        // Blend c over the pixel with c.alpha
+        void blendPixel(const uint32_t x, const uint32_t y, const Color& c) {
+            Edit edit(this);
+            touch(x, y, x, y);
+            if (!visible(x, y)) {
+                return;
+            }
+            const uint8_t px[4] = { c.b, c.g, c.r, 255 };
+            bmp_kernels::blend_bytes_scalar(image->pixel_unchecked(x, y), image->Channels(), px, c.alpha);
+        }
+
+        void drawTriangle(uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2, uint32_t x3, uint32_t y3, const Color& c) {
+            BMP_PROBE("drawTriangle", 0, 0);
+            Edit edit(this);
+            drawLine(x1, y1, x2, y2, c);
+            drawLine(x2, y2, x3, y3, c);
+            drawLine(x3, y3, x1, y1, c);
+        }
+
+        // Filled shapes are sampled at the pixel centers (the integer coordinates), the top and left edges
+        // are included and the bottom and right ones are not, so shapes sharing an edge never overlap
+
+        void fillTriangle(uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2, uint32_t x3, uint32_t y3, const Color& c) {
+            BMP_PROBE("fillTriangle", 0, 0);
+            const Point points[3] = { Point(x1, y1), Point(x2, y2), Point(x3, y3) };
+            fillPolygon(points, 3, c, FillRule::NonZero);
+        }
+
+        void fillPolygon(const std::vector<Point>& points, const Color& c, const FillRule rule = FillRule::NonZero) {
+            fillPolygon(points.data(), points.size(), c, rule);
+        }
+
+        void fillPolygon(const Point *points, const size_t count, const Color& c, const FillRule rule = FillRule::NonZero) {
+            BMP_PROBE("fillPolygon", 0, 0);
+            if (count < 3) {
+                return;
+            }
+            Edit edit(this);
+            touchPoints(points, count, 0);
+
+            std::vector<Edge> edges;
+            edges.reserve(count);
+            int64_t y_min = INT64_MAX, y_max = INT64_MIN;
+            for (size_t i = 0; i < count; ++i) {
+                const Point& a = points[i];
+                const Point& b = points[(i + 1) % count];
+                if (a.y == b.y) { // Horizontal edges cross no row
+                    continue;
+                }
+                Edge e;
+                if (a.y < b.y) {
+                    e.x0 = a.x; e.y0 = a.y; e.x1 = b.x; e.y1 = b.y; e.winding = 1;
+                } else {
+                    e.x0 = b.x; e.y0 = b.y; e.x1 = a.x; e.y1 = a.y; e.winding = -1;
+                }
+                y_min = std::min(y_min, e.y0);
+                y_max = std::max(y_max, e.y1);
+                edges.push_back(e);
+            }
+
+            uint32_t y_begin = (uint32_t)std::max<int64_t>(y_min, clip_y);
+            uint32_t y_end = (uint32_t)std::min<int64_t>(y_max, std::min<uint32_t>(clip_y_end, image->height()));
+            if (edges.empty() || y_begin >= y_end) {
+                return;
+            }
+            std::sort(edges.begin(), edges.end(), [](const Edge& a, const Edge& b) { return a.y0 < b.y0; });
+
+            uint8_t px[4];
+            colorBytes(c, px);
+            if (image->Channels() == 4) {
+                fillSpans<4>(edges, y_begin, y_end, rule, px);
+            } else {
+                fillSpans<3>(edges, y_begin, y_end, rule, px);
+            }
+        }
+
+        // The circle is clipped once: it is skipped when it misses the visible area,
+        // and its points are written without any check when it lies inside of it
+        void drawCircle(const uint32_t x_center, const uint32_t y_center, int32_t radius, const Color& c) {
+            BMP_PROBE("drawCircle", 0, 0);
+            Edit edit(this);
+            touch((int64_t)x_center - radius, (int64_t)y_center - radius, (int64_t)x_center + radius, (int64_t)y_center + radius);
+            int64_t x_begin, y_begin, x_end, y_end;
+            visibleArea(x_begin, y_begin, x_end, y_end);
+
+            const int64_t xc = x_center, yc = y_center;
+            int64_t x = 0;
+            int64_t y = radius;
+            if (y < 0 || xc + y < x_begin || xc - y >= x_end || yc + y < y_begin || yc - y >= y_end) {
+                return;
+            }
+            const bool inside = xc - y >= x_begin && xc + y < x_end && yc - y >= y_begin && yc + y < y_end;
+            int64_t d = (1 - y) * 2;
+
+            while(y >= 0) {
+                const int64_t px[4] = { xc + x, xc + x, xc - x, xc - x };
+                const int64_t py[4] = { yc + y, yc - y, yc + y, yc - y };
+                for (int i = 0; i < 4; ++i) {
+                    if (inside || (px[i] >= x_begin && px[i] < x_end && py[i] >= y_begin && py[i] < y_end)) {
+                        image->setPixel(px[i], py[i], c);
+                    }
+                }
+
+                if ((d + y) > 0) {
+                    d -= ((--y) * 2) - 1;
+                }
+                if (x > d) {
+                    d += ((++x) * 2) + 1;
+                }
+            }
+        }
+
+        void fillCircle(const uint32_t x_center, const uint32_t y_center, int32_t radius, const Color& c) {
+            BMP_PROBE("fillCircle", 0, 0);
+            fillEllipse(x_center, y_center, radius, radius, c);
+        }
+
+        // Pixels (x, y) with ((x - x_center) / x_radius)^2 + ((y - y_center) / y_radius)^2 <= 1, one span per row
+        void fillEllipse(const uint32_t x_center, const uint32_t y_center, int32_t x_radius, int32_t y_radius, const Color& c) {
+            BMP_PROBE("fillEllipse", 0, 0);
+            Edit edit(this);
+            touch((int64_t)x_center - x_radius, (int64_t)y_center - y_radius, (int64_t)x_center + x_radius, (int64_t)y_center + y_radius);
+            int64_t x_begin, y_begin, x_end, y_end;
+            visibleArea(x_begin, y_begin, x_end, y_end);
+
+            const int64_t xc = x_center, yc = y_center;
+            y_begin = std::max<int64_t>(y_begin, yc - y_radius);
+            y_end = std::min<int64_t>(y_end, yc + y_radius + 1);
+            if (x_radius < 0 || y_radius < 0 || y_begin >= y_end || xc + x_radius < x_begin || xc - x_radius >= x_end) {
+                return;
+            }
+
+            uint8_t px[4];
+            colorBytes(c, px);
+            if (image->Channels() == 4) {
+                fillEllipseRows<4>(xc, yc, x_radius, y_radius, x_begin, y_begin, x_end, y_end, px);
+            } else {
+                fillEllipseRows<3>(xc, yc, x_radius, y_radius, x_begin, y_begin, x_end, y_end, px);
+            }
+        }
+
+        void drawRegion(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h, const Color& c) {
+            BMP_PROBE("drawRegion", 0, 0);
+            Edit edit(this);
+            uint8_t px[4];
+            colorBytes(c, px);
+            fillRegion(x, y, w, h, px);
         }
 
             /// 32 bits/pixel only
@@ -545,47 +6247,880 @@ class bmpDrawer {
         }
 
         void eraseRegion(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h) {
+            BMP_PROBE("eraseRegion", 0, 0);
             if (image->Channels() != 4) {
                 std::cerr << "erasePixel error: only for 32 bits/pixel\n";
             }
 
-            for (uint32_t yy = y; yy < y + h; ++yy) {
-                for (uint32_t xx = x; xx < x + w; ++xx) {
-                    drawPixel(xx,yy,Color(0,0,0,0));
-                }
-            }
+            Edit edit(this);
+            const uint8_t px[4] = { 0, 0, 0, 0 };
+            fillRegion(x, y, w, h, px);
         }
 
         void eraseRegion(const Point& p, const uint32_t w, const uint32_t h) {
             eraseRegion(p.x, p.y, w, h);
         }
 
-        /*
-        void undo() {
-            if (undoList.size() > 0) {
-                CopyFrom(undoList.back());
-                undoList.pop_back();
-            } else {
-                std::cout << "Nop" << undoList.size() << std::endl;
+        /// Undo and redo
+
+        static const size_t MaxList = 10;   // Default number of drawing calls that can be undone
+
+        // Keep what each drawing call changes so the last levels calls can be undone. Only the
+        // tiles of TileSize x TileSize pixels a call touches are saved, as they were before it.
+        // Changes made to the image through something else than this drawer are not tracked.
+        void enableUndo(const size_t levels = MaxList) {
+            undo_levels = levels;
+            trimHistory();
+        }
+
+        void disableUndo() {
+            enableUndo(0);
+        }
+
+        // Put back the tiles of the last drawing call, false if there is nothing to undo
+        bool undo() {
+            if (undoList.empty() || !sameGrid()) {
+                return false;
             }
+            swapTiles(undoList.back());
+            redoList.push_back(std::move(undoList.back()));
+            undoList.pop_back();
+            return true;
+        }
+
+        bool redo() {
+            if (redoList.empty() || !sameGrid()) {
+                return false;
+            }
+            swapTiles(redoList.back());
+            undoList.push_back(std::move(redoList.back()));
+            redoList.pop_back();
+            return true;
+        }
+
+        size_t undoCount() const {
+            return undoList.size();
+        }
+
+        size_t redoCount() const {
+            return redoList.size();
         }
-        */
+
     private:
         BMP* image;
-        /*
-        std::vector<BMP> undoList;
-        
-        void addItemChng(const bool isUndo) {
-            if (isUndo) {
-                if (undoList.size() < MaxList) {
-                    BMP aux = CreateCopy();
-                    undoList.push_back(aux);
+        uint32_t clip_x{ 0 };
+        uint32_t clip_y{ 0 };
+        uint32_t clip_x_end{ UINT32_MAX };
+        uint32_t clip_y_end{ UINT32_MAX };
+
+        // Area where the pixels are drawn: the clip rectangle inside the image
+        void visibleArea(int64_t& x_begin, int64_t& y_begin, int64_t& x_end, int64_t& y_end) const {
+            x_begin = clip_x;
+            y_begin = clip_y;
+            x_end = std::min<uint32_t>(clip_x_end, image->width());
+            y_end = std::min<uint32_t>(clip_y_end, image->height());
+        }
+
+        // Clip the rectangle to the image and the clip rectangle once, then fill it row by row with the pixel px (BGRA)
+        void fillRegion(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h, const uint8_t *px) {
+            int64_t x_begin, y_begin, x_end, y_end;
+            visibleArea(x_begin, y_begin, x_end, y_end);
+            x_begin = std::max<int64_t>(x, x_begin);
+            y_begin = std::max<int64_t>(y, y_begin);
+            x_end = std::min<int64_t>((int64_t)x + w, x_end);
+            y_end = std::min<int64_t>((int64_t)y + h, y_end);
+            if (x_begin >= x_end || y_begin >= y_end) {
+                return;
+            }
+            touch(x_begin, y_begin, x_end - 1, y_end - 1);
+
+            if (image->Channels() == 4) {
+                fillRows<4>(x_begin, y_begin, x_end - x_begin, y_end - y_begin, px);
+            } else {
+                fillRows<3>(x_begin, y_begin, x_end - x_begin, y_end - y_begin, px);
+            }
+        }
+
+        // Polygon edge, from top to bottom
+        struct Edge {
+            int64_t x0, y0, x1, y1;
+            int32_t winding;            // 1 if the outline goes down along the edge, -1 if it goes up
+        };
+
+        // Smallest integer x at or after the crossing of edge e with row y
+        static int64_t crossing(const Edge& e, const int64_t y) {
+            int64_t n = (y - e.y0) * (e.x1 - e.x0);
+            int64_t d = e.y1 - e.y0;
+            int64_t q = n / d;
+            if (n % d != 0 && n > 0) {
+                ++q;
+            }
+            return e.x0 + q;
+        }
+
+        // Scanline fill: the active edges of each row give the crossings, sorted they bound
+        // the runs of pixels inside the polygon that are filled as row spans
+        template <uint32_t Channels>
+        void fillSpans(const std::vector<Edge>& edges, const uint32_t y_begin, const uint32_t y_end, const FillRule rule, const uint8_t *px) {
+            const bmp_kernels::RowPattern pattern = bmp_kernels::make_row_pattern<Channels>(px);
+            const int64_t x_min = clip_x;
+            const int64_t x_max = std::min<uint32_t>(clip_x_end, image->width());
+
+            BMPThreadPool::instance().for_rows(y_end - y_begin, (size_t)Channels * (x_max - x_min), [&](uint32_t begin, uint32_t end) {
+                std::vector<const Edge*> active;
+                std::vector<std::pair<int64_t, int32_t> > crossings;
+                size_t next = 0;
+
+                for (uint32_t y = y_begin + begin; y < y_begin + end; ++y) {
+                    // Update the active edges, those with y0 <= y < y1
+                    for (; next < edges.size() && edges[next].y0 <= y; ++next) {
+                        active.push_back(&edges[next]);
+                    }
+                    crossings.clear();
+                    for (size_t i = 0; i < active.size();) {
+                        if (active[i]->y1 <= y) {
+                            active[i] = active.back();
+                            active.pop_back();
+                        } else {
+                            crossings.push_back(std::make_pair(crossing(*active[i], y), active[i]->winding));
+                            ++i;
+                        }
+                    }
+                    std::sort(crossings.begin(), crossings.end());
+
+                    int32_t winding = 0;
+                    for (size_t i = 0; i + 1 < crossings.size(); ++i) {
+                        winding += rule == FillRule::NonZero ? crossings[i].second : 1;
+                        bool inside = rule == FillRule::NonZero ? winding != 0 : (winding & 1) != 0;
+                        int64_t x0 = std::max(crossings[i].first, x_min);
+                        int64_t x1 = std::min(crossings[i + 1].first, x_max);
+                        if (inside && x0 < x1) {
+                            bmp_kernels::fill_row<Channels>(image->pixel_unchecked(x0, y), x1 - x0, pattern);
+                        }
+                    }
+                }
+            });
+        }
+
+        template <uint32_t Channels>
+        void drawPolylineSegments(const Point* points, const size_t count, const uint8_t *px) {
+            if (count == 1) {
+                drawSegment<Channels>(points[0].x, points[0].y, points[0].x, points[0].y, px);
+            }
+            for (size_t i = 1; i < count; ++i) {
+                drawSegment<Channels>(points[i - 1].x, points[i - 1].y, points[i].x, points[i].y, px);
+            }
+        }
+
+        // Minor axis steps done before the pixel i of a Bresenham line, floor((2 * dy * i + dx) / (2 * dx)),
+        // computed without overflowing for any 32 bits coordinates
+        static int64_t bresenhamSteps(const uint64_t dx, const uint64_t dy, const uint64_t i) {
+            uint64_t p = dy * i;
+            return p / dx + (2 * (p % dx) >= dx ? 1 : 0);
+        }
+
+        // First pixel i in [0, n] of a Bresenham line that has done at least k minor axis steps (n + 1 if none)
+        static int64_t bresenhamFirst(const uint64_t dx, const uint64_t dy, const int64_t n, const int64_t k) {
+            int64_t lo = 0, hi = n + 1;
+            while (lo < hi) {
+                int64_t mid = lo + (hi - lo) / 2;
+                if (bresenhamSteps(dx, dy, mid) >= k) {
+                    hi = mid;
+                } else {
+                    lo = mid + 1;
+                }
+            }
+            return lo;
+        }
+
+        template <uint32_t Channels>
+        void drawSegment(int64_t x1, int64_t y1, int64_t x2, int64_t y2, const uint8_t *px) {
+            int64_t x_begin, y_begin, x_end, y_end;
+            visibleArea(x_begin, y_begin, x_end, y_end);
+            if (x_begin >= x_end || y_begin >= y_end) {
+                return;
+            }
+
+            if (x1 == x2 && y1 == y2) { // One pixel
+                if (x1 >= x_begin && x1 < x_end && y1 >= y_begin && y1 < y_end) {
+                    memcpy(image->pixel_unchecked(x1, y1), px, Channels);
+                }
+            } else if (y1 == y2) { // Horizontal line, a row span
+                int64_t x0 = std::max(std::min(x1, x2), x_begin);
+                int64_t x3 = std::min(std::max(x1, x2), x_end);
+                if (y1 >= y_begin && y1 < y_end && x0 < x3) {
+                    bmp_kernels::fill_row<Channels>(image->pixel_unchecked(x0, y1), x3 - x0, bmp_kernels::make_row_pattern<Channels>(px));
+                }
+            } else if (x1 == x2) { // Vertical line
+                int64_t y0 = std::max(std::min(y1, y2), y_begin);
+                int64_t y3 = std::min(std::max(y1, y2), y_end);
+                if (x1 >= x_begin && x1 < x_end && y0 < y3) {
+                    uint8_t *p = image->pixel_unchecked(x1, y0);
+                    for (int64_t n = y3 - y0; n > 0; --n, p += image->Stride()) {
+                        memcpy(p, px, Channels);
+                    }
                 }
             } else {
-                if (redoList.size() < MaxList) {
-                    BMP aux = CreateCopy();
-                    redoList.push_back(aux);
+                // Bresenham, with x the major axis and y the minor one once swapped for steep lines
+                int64_t sx = (x2 > x1) ? 1 : -1;
+                int64_t sy = (y2 > y1) ? 1 : -1;
+                int64_t dx = std::abs(x2 - x1);
+                int64_t dy = std::abs(y2 - y1);
+                int64_t mx_begin = x_begin, mx_end = x_end, my_begin = y_begin, my_end = y_end;
+                int64_t major_inc = sx * Channels;
+                int64_t minor_inc = sy * image->Stride();
+                const bool steep = dy > dx;
+                if (steep) {
+                    std::swap(x1, y1);
+                    std::swap(dx, dy);
+                    std::swap(sx, sy);
+                    std::swap(major_inc, minor_inc);
+                    std::swap(mx_begin, my_begin);
+                    std::swap(mx_end, my_end);
+                }
+
+                // Pixel i is at (x1 + sx * i, y1 + sy * steps(i)) for i in [0, dx], keep the i inside the area
+                int64_t first = 0, last = dx;
+                if (sx > 0) {
+                    first = std::max(first, mx_begin - x1);
+                    last = std::min(last, mx_end - 1 - x1);
+                } else {
+                    first = std::max(first, x1 - (mx_end - 1));
+                    last = std::min(last, x1 - mx_begin);
+                }
+                int64_t k_min = sy > 0 ? my_begin - y1 : y1 - (my_end - 1);
+                int64_t k_max = sy > 0 ? my_end - 1 - y1 : y1 - my_begin;
+                if (first > last || k_max < 0 || k_min > dy) {
+                    return;
+                }
+                if (k_min > 0) {
+                    first = std::max(first, bresenhamFirst(dx, dy, dx, k_min));
+                }
+                if (k_max < dy) {
+                    last = std::min(last, bresenhamFirst(dx, dy, dx, k_max + 1) - 1);
+                }
+                if (first > last) {
+                    return;
+                }
+
+                // Error term at pixel first, e = 2 * dy * (i + 1) - dx - 2 * dx * steps(i)
+                int64_t k = bresenhamSteps(dx, dy, first);
+                int64_t e = 2 * (int64_t)((uint64_t)dy * (first + 1) - (uint64_t)dx * k) - dx;
+                int64_t major = x1 + sx * first, minor = y1 + sy * k;
+                uint8_t *p = steep ? image->pixel_unchecked(minor, major) : image->pixel_unchecked(major, minor);
+
+                // No branch per pixel: the minor step is added through a mask
+                const int64_t e_inc = 2 * dy, e_dec = 2 * dx;
+                for (int64_t n = last - first; ; --n) {
+                    memcpy(p, px, Channels);
+                    if (n == 0) {
+                        break;
+                    }
+                    int64_t step = -(int64_t)(e >= 0);
+                    p += major_inc + (minor_inc & step);
+                    e += e_inc - (e_dec & step);
+                }
+            }
+        }
+
+        // Coverage in [0, 1] scaled to the alpha of the color
+        static uint32_t coverageAlpha(const double coverage, const uint32_t alpha) {
+            uint32_t cov = (uint32_t)(std::min(std::max(coverage, 0.0), 1.0) * 255.0 + 0.5);
+            return (cov * alpha + 127) / 255;
+        }
+
+        template <uint32_t Channels>
+        void drawSegmentAA(int64_t x1, int64_t y1, int64_t x2, int64_t y2, const Color& c) {
+            int64_t x_begin, y_begin, x_end, y_end;
+            visibleArea(x_begin, y_begin, x_end, y_end);
+            if (x_begin >= x_end || y_begin >= y_end) {
+                return;
+            }
+            const uint8_t px[4] = { c.b, c.g, c.r, 255 };
+
+            // Walk the major axis, two pixels across the minor one share the coverage
+            const bool steep = std::abs(y2 - y1) > std::abs(x2 - x1);
+            if (steep) {
+                std::swap(x1, y1);
+                std::swap(x2, y2);
+                std::swap(x_begin, y_begin);
+                std::swap(x_end, y_end);
+            }
+            if (x1 > x2) {
+                std::swap(x1, x2);
+                std::swap(y1, y2);
+            }
+            const int64_t dx = x2 - x1, dy = y2 - y1;
+
+            // Steps i in [0, dx] with the major coordinate and one of the two pixels inside
+            int64_t first = std::max<int64_t>(0, x_begin - x1);
+            int64_t last = std::min<int64_t>(dx, x_end - 1 - x1);
+            if (dy != 0) {
+                double i0 = (double)(y_begin - 1 - y1) * dx / dy, i1 = (double)(y_end - y1) * dx / dy;
+                if (i0 > i1) {
+                    std::swap(i0, i1);
+                }
+                first = std::max<int64_t>(first, (int64_t)std::min(std::max(floor(i0) - 1, -1.0), dx + 1.0));
+                last = std::min<int64_t>(last, (int64_t)std::min(std::max(ceil(i1) + 1, -1.0), dx + 1.0));
+            }
+
+            for (int64_t i = first; i <= last; ++i) {
+                // From the start of the line every time, so a clipped line gets the same pixels
+                double y = y1 + (dx == 0 ? 0.0 : (double)dy * i / dx);
+                double y_floor = floor(y);
+                int64_t minor = (int64_t)y_floor;
+                int64_t major = x1 + i;
+                double frac = y - y_floor;
+                const uint32_t alpha[2] = { coverageAlpha(1.0 - frac, c.alpha), coverageAlpha(frac, c.alpha) };
+                for (int k = 0; k < 2; ++k) {
+                    if (alpha[k] == 0 || minor + k < y_begin || minor + k >= y_end) {
+                        continue;
+                    }
+                    uint8_t *p = steep ? image->pixel_unchecked(minor + k, major) : image->pixel_unchecked(major, minor + k);
+                    bmp_kernels::blend_pixel<Channels>(p, px, alpha[k]);
+                }
+            }
+        }
+
+        // x where lo <= a * x + b <= hi, false if there are none
+        static bool linearRange(const double a, const double b, const double lo, const double hi, double& x0, double& x1) {
+            if (a == 0.0) {
+                x0 = -HUGE_VAL;
+                x1 = HUGE_VAL;
+                return b >= lo && b <= hi;
+            }
+            x0 = (lo - b) / a;
+            x1 = (hi - b) / a;
+            if (x0 > x1) {
+                std::swap(x0, x1);
+            }
+            return true;
+        }
+
+        template <uint32_t Channels>
+        void drawThickSegment(const int64_t x1, const int64_t y1, const int64_t x2, const int64_t y2, const Color& c, const double width) {
+            int64_t x_begin, y_begin, x_end, y_end;
+            visibleArea(x_begin, y_begin, x_end, y_end);
+            if (x_begin >= x_end || y_begin >= y_end) {
+                return;
+            }
+            const uint8_t px[4] = { c.b, c.g, c.r, 255 };
+            const bmp_kernels::RowPattern pattern = bmp_kernels::make_row_pattern<Channels>(px);
+
+            // Pixel centers are at s along the line and d across it, the line covers [s0, s1] x [-h, h].
+            // A single point gives a square.
+            const double h = width / 2;
+            const double length = sqrt((double)(x2 - x1) * (x2 - x1) + (double)(y2 - y1) * (y2 - y1));
+            const double ux = length > 0 ? (x2 - x1) / length : 1.0;
+            const double uy = length > 0 ? (y2 - y1) / length : 0.0;
+            const double s0 = length > 0 ? 0.0 : -h;
+            const double s1 = length > 0 ? length : h;
+
+            const int64_t reach = (int64_t)ceil(h) + 1;
+            const int64_t y_first = std::max(y_begin, std::min(y1, y2) - reach);
+            const int64_t y_last = std::min(y_end - 1, std::max(y1, y2) + reach);
+            for (int64_t y = y_first; y <= y_last; ++y) {
+                // On this row s = ux * (x - x1) + s_row and d = -uy * (x - x1) + d_row
+                const double s_row = uy * (y - y1), d_row = ux * (y - y1);
+                double a0, a1, b0, b1;
+                if (!linearRange(ux, s_row, s0 - 0.5, s1 + 0.5, a0, a1) || !linearRange(-uy, d_row, -h - 0.5, h + 0.5, b0, b1)) {
+                    continue;
+                }
+                int64_t x_first = std::max<int64_t>(x_begin - x1, (int64_t)ceil(std::max(std::max(a0, b0), (double)INT32_MIN * 4)));
+                int64_t x_last = std::min<int64_t>(x_end - 1 - x1, (int64_t)floor(std::min(std::min(a1, b1), (double)INT32_MAX * 4)));
+                if (x_first > x_last) {
+                    continue;
+                }
+
+                // The pixels fully covered are one span
+                int64_t full_first = x_last + 1, full_last = x_last;
+                if (linearRange(ux, s_row, s0 + 0.5, s1 - 0.5, a0, a1) && linearRange(-uy, d_row, -h + 0.5, h - 0.5, b0, b1)) {
+                    full_first = std::max<int64_t>(x_first, (int64_t)ceil(std::max(std::max(a0, b0), (double)INT32_MIN * 4)));
+                    full_last = std::min<int64_t>(x_last, (int64_t)floor(std::min(std::min(a1, b1), (double)INT32_MAX * 4)));
+                    if (full_first > full_last) {
+                        full_first = x_last + 1;
+                        full_last = x_last;
+                    }
+                }
+
+                uint8_t *row = image->pixel_unchecked(0, y);
+                for (int64_t x = x_first; x <= x_last; ++x) {
+                    if (x == full_first) {
+                        bmp_kernels::blend_row<Channels>(row + Channels * (x1 + x), full_last - full_first + 1, pattern, c.alpha);
+                        x = full_last;
+                        continue;
+                    }
+                    const double s = ux * x + s_row, d = -uy * x + d_row;
+                    double across = std::min(std::max(h + 0.5 - std::abs(d), 0.0), 1.0);
+                    double along = std::min(std::max(std::min(s - s0, s1 - s) + 0.5, 0.0), 1.0);
+                    uint32_t alpha = coverageAlpha(across * along, c.alpha);
+                    if (alpha > 0) {
+                        bmp_kernels::blend_pixel<Channels>(row + Channels * (x1 + x), px, alpha);
+                    }
+                }
+            }
+        }
+
+        template <uint32_t Channels>
+        void fillEllipseRows(const int64_t xc, const int64_t yc, const int64_t x_radius, const int64_t y_radius,
+                             const int64_t x_begin, const int64_t y_begin, const int64_t x_end, const int64_t y_end, const uint8_t *px) {
+            const bmp_kernels::RowPattern pattern = bmp_kernels::make_row_pattern<Channels>(px);
+            BMPThreadPool::instance().for_rows(y_end - y_begin, (size_t)Channels * (2 * x_radius + 1), [&](uint32_t begin, uint32_t end) {
+                for (int64_t y = y_begin + begin; y < y_begin + end; ++y) {
+                    // Half width of the span of the row
+                    double dy = y_radius > 0 ? (double)(y - yc) / y_radius : 0;
+                    int64_t dx = (int64_t)floor(x_radius * sqrt(std::max(0.0, 1 - dy * dy)));
+                    int64_t x0 = std::max(xc - dx, x_begin);
+                    int64_t x1 = std::min(xc + dx + 1, x_end);
+                    if (x0 < x1) {
+                        bmp_kernels::fill_row<Channels>(image->pixel_unchecked(x0, y), x1 - x0, pattern);
+                    }
+                }
+            });
+        }
+
+        template <uint32_t Channels>
+        void fillRows(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h, const uint8_t *px) {
+            const bmp_kernels::RowPattern pattern = bmp_kernels::make_row_pattern<Channels>(px);
+            BMPThreadPool::instance().for_rows(h, (size_t)Channels * w, [&](uint32_t begin, uint32_t end) {
+                for (uint32_t yy = y + begin; yy < y + end; ++yy) {
+                    bmp_kernels::fill_row<Channels>(image->pixel_unchecked(x, yy), w, pattern);
+                }
+            });
+        }
+
+        // Undo history: a snapshot per drawing call with the tiles it changed
+        static const uint32_t TileSize = 64;
+
+        struct Tile {
+            uint32_t x, y, w, h;
+            std::vector<uint8_t> pixels;
+        };
+        typedef std::vector<Tile> Snapshot;
+
+        size_t undo_levels{ 0 };
+        std::vector<Snapshot> undoList;
+        std::vector<Snapshot> redoList;
+        std::vector<bool> saved_tiles;      // Tiles already in the snapshot of the current call
+        uint32_t grid_width{ 0 };           // Size of the image the history was taken on
+        uint32_t grid_height{ 0 };
+        uint32_t grid_channels{ 0 };
+        uint32_t edit_depth{ 0 };
+
+        // Turns the drawing calls made while alive into one undo step, the calls nest
+        class Edit {
+            public:
+                Edit(bmpDrawer *drawer_) : drawer(drawer_) {
+                    drawer->image->SetLayout(PixelLayout::Interleaved);
+                    if (drawer->edit_depth++ == 0) {
+                        drawer->beginSnapshot();
+                    }
+                }
+
+                ~Edit() {
+                    if (--drawer->edit_depth == 0) {
+                        drawer->endSnapshot();
+                    }
+                }
+
+            private:
+                bmpDrawer *drawer;
+        };
+
+        // The bytes the pixels drawn with c get, premultiplied on a premultiplied image.
+        // The blends need no conversion: c * alpha + pixel * (255 - alpha) is premultiplied already.
+        void colorBytes(const Color& c, uint8_t *px) const {
+            const bool premultiplied = image->Premultiplied();
+            px[0] = premultiplied ? bmp_kernels::premultiply_byte(c.b, c.alpha) : c.b;
+            px[1] = premultiplied ? bmp_kernels::premultiply_byte(c.g, c.alpha) : c.g;
+            px[2] = premultiplied ? bmp_kernels::premultiply_byte(c.r, c.alpha) : c.r;
+            px[3] = c.alpha;
+        }
+
+        bool sameGrid() const {
+            return grid_width == (uint32_t)image->width() && grid_height == (uint32_t)image->height() && grid_channels == image->Channels();
+        }
+
+        void beginSnapshot() {
+            if (undo_levels == 0) {
+                return;
+            }
+            if (!sameGrid()) { // The image changed size, the history is of no use
+                undoList.clear();
+                redoList.clear();
+                grid_width = image->width();
+                grid_height = image->height();
+                grid_channels = image->Channels();
+                saved_tiles.assign((size_t)((grid_width + TileSize - 1) / TileSize) * ((grid_height + TileSize - 1) / TileSize), false);
+            }
+            undoList.push_back(Snapshot());
+        }
+
+        void endSnapshot() {
+            if (undo_levels == 0) {
+                return;
+            }
+            Snapshot& snapshot = undoList.back();
+            const uint32_t tiles_x = (grid_width + TileSize - 1) / TileSize;
+            for (size_t i = 0; i < snapshot.size(); ++i) {
+                saved_tiles[(snapshot[i].y / TileSize) * tiles_x + snapshot[i].x / TileSize] = false;
+            }
+            if (snapshot.empty()) { // Nothing was drawn
+                undoList.pop_back();
+                return;
+            }
+            redoList.clear();
+            trimHistory();
+        }
+
+        void trimHistory() {
+            if (undoList.size() > undo_levels) {
+                undoList.erase(undoList.begin(), undoList.end() - undo_levels);
+            }
+            if (undo_levels == 0) {
+                redoList.clear();
+            }
+        }
+
+        // The rectangle [x0, x1] x [y0, y1] is about to change: mark its visible rows dirty
+        // and save the tiles it covers for undo
+        void touch(int64_t x0, int64_t y0, int64_t x1, int64_t y1) {
+            int64_t x_begin, y_begin, x_end, y_end;
+            visibleArea(x_begin, y_begin, x_end, y_end);
+            x0 = std::max(x0, x_begin);
+            y0 = std::max(y0, y_begin);
+            x1 = std::min(x1, x_end - 1);
+            y1 = std::min(y1, y_end - 1);
+            if (x0 > x1 || y0 > y1) {
+                return;
+            }
+            image->markDirty(y0, y1 + 1);
+            if (undo_levels == 0 || edit_depth == 0) {
+                return;
+            }
+
+            const uint32_t tiles_x = (grid_width + TileSize - 1) / TileSize;
+            const uint32_t channels = image->Channels();
+            Snapshot& snapshot = undoList.back();
+            for (int64_t ty = y0 / TileSize; ty <= y1 / TileSize; ++ty) {
+                for (int64_t tx = x0 / TileSize; tx <= x1 / TileSize; ++tx) {
+                    if (saved_tiles[ty * tiles_x + tx]) {
+                        continue;
+                    }
+                    saved_tiles[ty * tiles_x + tx] = true;
+                    Tile tile;
+                    tile.x = tx * TileSize;
+                    tile.y = ty * TileSize;
+                    tile.w = std::min(grid_width - tile.x, (uint32_t)TileSize);
+                    tile.h = std::min(grid_height - tile.y, (uint32_t)TileSize);
+                    tile.pixels.resize((size_t)tile.w * tile.h * channels);
+                    for (uint32_t r = 0; r < tile.h; ++r) {
+                        memcpy(&tile.pixels[(size_t)r * tile.w * channels], image->pixel_unchecked(tile.x, tile.y + r), (size_t)tile.w * channels);
+                    }
+                    snapshot.push_back(std::move(tile));
+                }
+            }
+        }
+
+        void touchPoints(const Point *points, const size_t count, const int64_t reach) {
+            if (count == 0) {
+                return;
+            }
+            int64_t x0 = INT64_MAX, y0 = INT64_MAX, x1 = INT64_MIN, y1 = INT64_MIN;
+            for (size_t i = 0; i < count; ++i) {
+                x0 = std::min<int64_t>(x0, points[i].x);
+                y0 = std::min<int64_t>(y0, points[i].y);
+                x1 = std::max<int64_t>(x1, points[i].x);
+                y1 = std::max<int64_t>(y1, points[i].y);
+            }
+            touch(x0 - reach, y0 - reach, x1 + reach, y1 + reach);
+        }
+
+        // Exchange the saved tiles with the image, what was there is what redo (or undo) puts back.
+        // The rows of the tiles are marked dirty for update.
+        void swapTiles(Snapshot& snapshot) {
+            image->SetLayout(PixelLayout::Interleaved);
+            const uint32_t channels = image->Channels();
+            for (size_t i = 0; i < snapshot.size(); ++i) {
+                Tile& tile = snapshot[i];
+                image->markDirty(tile.y, tile.y + tile.h);
+                for (uint32_t r = 0; r < tile.h; ++r) {
+                    uint8_t *row = image->pixel_unchecked(tile.x, tile.y + r);
+                    std::swap_ranges(row, row + (size_t)tile.w * channels, tile.pixels.begin() + (size_t)r * tile.w * channels);
+                }
+            }
+        }
+};
+
+// DrawList class
+// Records drawing commands and draws them all at once with flush. The image is split in tiles
+// of rows that are drawn one after another (and in parallel), each running the commands that
+// touch it in the order they were recorded, so a tile stays in cache and the result is
+// the same as drawing with bmpDrawer directly.
+class DrawList {
+    public:
+        DrawList(BMP* image_) : image(image_) {}
+
+        void drawPixel(const uint32_t x, const uint32_t y, const Color& c) {
+            add(Command::Pixel, c, x, y);
+        }
+
+        void drawPixel(const pixel& px) {
+            drawPixel(px.x, px.y, px.color);
+        }
+
+        void drawLine(int32_t x1, int32_t y1, int32_t x2, int32_t y2, const Color& c) {
+            add(Command::Line, c, x1, y1, x2, y2);
+        }
+
+        void drawLineAA(int32_t x1, int32_t y1, int32_t x2, int32_t y2, const Color& c) {
+            add(Command::LineAA, c, x1, y1, x2, y2);
+        }
+
+        void drawLine(int32_t x1, int32_t y1, int32_t x2, int32_t y2, const Color& c, const float width) {
+            // The width goes in the command as its bits
+            int32_t bits;
+            memcpy(&bits, &width, sizeof(bits));
+            add(Command::ThickLine, c, x1, y1, x2, y2, bits);
+        }
+
+        void drawPolyline(const std::vector<Point>& points, const Color& c) {
+            int64_t y_min, y_max;
+            yRange(points, y_min, y_max);
+            // The points are kept aside like for fillPolygon
+            add(Command::Polyline, c, polygon_points.size(), points.size(), 0, y_min, y_max);
+            polygon_points.insert(polygon_points.end(), points.begin(), points.end());
+        }
+
+        void drawTriangle(uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2, uint32_t x3, uint32_t y3, const Color& c) {
+            // Same conversion as bmpDrawer::drawTriangle does for drawLine
+            add(Command::Triangle, c, (int32_t)x1, (int32_t)y1, (int32_t)x2, (int32_t)y2, (int32_t)x3, (int32_t)y3);
+        }
+
+        void drawCircle(const uint32_t x_center, const uint32_t y_center, int32_t radius, const Color& c) {
+            add(Command::Circle, c, x_center, y_center, radius);
+        }
+
+        void fillTriangle(uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2, uint32_t x3, uint32_t y3, const Color& c) {
+            add(Command::FillTriangle, c, x1, y1, x2, y2, x3, y3);
+        }
+
+        void fillCircle(const uint32_t x_center, const uint32_t y_center, int32_t radius, const Color& c) {
+            fillEllipse(x_center, y_center, radius, radius, c);
+        }
+
+        void fillEllipse(const uint32_t x_center, const uint32_t y_center, int32_t x_radius, int32_t y_radius, const Color& c) {
+            add(Command::FillEllipse, c, x_center, y_center, x_radius, y_radius);
+        }
+
+        void fillPolygon(const std::vector<Point>& points, const Color& c, const FillRule rule = FillRule::NonZero) {
+            int64_t y_min, y_max;
+            yRange(points, y_min, y_max);
+            // The points are kept aside, the command refers to them
+            add(Command::FillPolygon, c, polygon_points.size(), points.size(), (int64_t)rule, y_min, y_max);
+            polygon_points.insert(polygon_points.end(), points.begin(), points.end());
+        }
+
+        void drawRegion(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h, const Color& c) {
+            add(Command::Region, c, x, y, w, h);
+        }
+
+            /// 32 bits/pixel only
+
+        void erasePixel(const uint32_t x, const uint32_t y) {
+            if (image->Channels() != 4) {
+                std::cerr << "erasePixel error: only for 32 bits/pixel\n";
+            }
+            drawPixel(x, y, Color(0,0,0,0));
+        }
+
+        void erasePixel(const Point& p) {
+            erasePixel(p.x, p.y);
+        }
+
+        void eraseRegion(const uint32_t x, const uint32_t y, const uint32_t w, const uint32_t h) {
+            if (image->Channels() != 4) {
+                std::cerr << "erasePixel error: only for 32 bits/pixel\n";
+            }
+            drawRegion(x, y, w, h, Color(0,0,0,0));
+        }
+
+        void eraseRegion(const Point& p, const uint32_t w, const uint32_t h) {
+            eraseRegion(p.x, p.y, w, h);
+        }
+
+        size_t size() const {
+            return commands.size();
+        }
+
+        // Forget the recorded commands without drawing them
+        void clear() {
+            commands.clear();
+            polygon_points.clear();
+        }
+
+        // Draw the recorded commands and empty the list
+        void flush() {
+            if (commands.empty()) {
+                return;
+            }
+
+            image->SetLayout(PixelLayout::Interleaved);    // Before the drawers run in parallel
+            const uint32_t height = image->height();
+            const size_t row_bytes = (size_t)image->width() * image->Channels();
+            const uint32_t tile_rows = std::max<size_t>(16, BMPThreadPool::BandBytes / std::max<size_t>(1, row_bytes));
+            const uint32_t tiles = (height + tile_rows - 1) / tile_rows;
+
+            // Bin the commands by the tiles their rows cover
+            std::vector<std::vector<uint32_t> > bins(tiles);
+            for (uint32_t i = 0; i < commands.size(); ++i) {
+                int64_t y_min, y_max;
+                rows(commands[i], y_min, y_max);
+                y_min = std::max<int64_t>(y_min, 0);
+                y_max = std::min<int64_t>(y_max, (int64_t)height - 1);
+                for (int64_t t = y_min / tile_rows; t <= y_max / tile_rows && y_min <= y_max; ++t) {
+                    bins[t].push_back(i);
+                }
+            }
+
+            BMPThreadPool::instance().for_rows(tiles, row_bytes * tile_rows, [&](uint32_t begin, uint32_t end) {
+                bmpDrawer drawer(image);
+                for (uint32_t t = begin; t < end; ++t) {
+                    drawer.setClip(0, t * tile_rows, UINT32_MAX, tile_rows);
+                    for (size_t i = 0; i < bins[t].size(); ++i) {
+                        draw(drawer, commands[bins[t][i]]);
+                    }
+                }
+            });
+
+            clear();
+        }
+
+    private:
+        struct Command {
+            enum Type { Pixel, Line, LineAA, ThickLine, Polyline, Triangle, Circle, Region, FillTriangle, FillPolygon, FillEllipse };
+
+            Type type;
+            Color color;
+            int64_t v[6];
+
+            Command(const Type type_, const Color& color_) : type(type_), color(color_) {}
+        };
+
+        BMP* image;
+        std::vector<Command> commands;
+        std::vector<Point> polygon_points;
+
+        void add(const Command::Type type, const Color& c, const int64_t v0, const int64_t v1,
+                 const int64_t v2 = 0, const int64_t v3 = 0, const int64_t v4 = 0, const int64_t v5 = 0) {
+            Command cmd(type, c);
+            cmd.v[0] = v0;
+            cmd.v[1] = v1;
+            cmd.v[2] = v2;
+            cmd.v[3] = v3;
+            cmd.v[4] = v4;
+            cmd.v[5] = v5;
+            commands.push_back(cmd);
+        }
+
+        static void yRange(const std::vector<Point>& points, int64_t& y_min, int64_t& y_max) {
+            y_min = INT64_MAX;
+            y_max = INT64_MIN;
+            for (size_t i = 0; i < points.size(); ++i) {
+                y_min = std::min<int64_t>(y_min, points[i].y);
+                y_max = std::max<int64_t>(y_max, points[i].y);
+            }
+        }
+
+        static float width(const Command& cmd) {
+            int32_t bits = (int32_t)cmd.v[4];
+            float width;
+            memcpy(&width, &bits, sizeof(width));
+            return width;
+        }
+
+        // Rows a command can draw on, before clipping to the image
+        static void rows(const Command& cmd, int64_t& y_min, int64_t& y_max) {
+            const int64_t *v = cmd.v;
+            switch (cmd.type) {
+                case Command::Pixel:
+                    y_min = y_max = v[1];
+                    break;
+                case Command::Line:
+                    y_min = std::min(v[1], v[3]);
+                    y_max = std::max(v[1], v[3]);
+                    break;
+                case Command::LineAA:
+                    y_min = std::min(v[1], v[3]);
+                    y_max = std::max(v[1], v[3]) + 1;
+                    break;
+                case Command::ThickLine: {
+                    int64_t reach = (int64_t)ceil(width(cmd) / 2) + 1;
+                    y_min = std::min(v[1], v[3]) - reach;
+                    y_max = std::max(v[1], v[3]) + reach;
+                    break;
                 }
-            }   
-        }*/
-};
\ No newline at end of file
+                case Command::Triangle:
+                case Command::FillTriangle:
+                    y_min = std::min(v[1], std::min(v[3], v[5]));
+                    y_max = std::max(v[1], std::max(v[3], v[5]));
+                    break;
+                case Command::Circle:
+                    y_min = v[1] - std::abs(v[2]);
+                    y_max = v[1] + std::abs(v[2]);
+                    break;
+                case Command::FillEllipse:
+                    y_min = v[1] - std::abs(v[3]);
+                    y_max = v[1] + std::abs(v[3]);
+                    break;
+                case Command::Region:
+                    y_min = v[1];
+                    y_max = v[1] + v[3] - 1;
+                    break;
+                case Command::Polyline:
+                case Command::FillPolygon:
+                    y_min = v[3];
+                    y_max = v[4];
+                    break;
+            }
+        }
+
+        void draw(bmpDrawer& drawer, const Command& cmd) const {
+            const int64_t *v = cmd.v;
+            switch (cmd.type) {
+                case Command::Pixel:
+                    drawer.drawPixel(v[0], v[1], cmd.color);
+                    break;
+                case Command::Line:
+                    drawer.drawLine(v[0], v[1], v[2], v[3], cmd.color);
+                    break;
+                case Command::LineAA:
+                    drawer.drawLineAA(v[0], v[1], v[2], v[3], cmd.color);
+                    break;
+                case Command::ThickLine:
+                    drawer.drawLine(v[0], v[1], v[2], v[3], cmd.color, width(cmd));
+                    break;
+                case Command::Polyline:
+                    drawer.drawPolyline(polygon_points.data() + v[0], v[1], cmd.color);
+                    break;
+                case Command::Triangle:
+                    drawer.drawTriangle(v[0], v[1], v[2], v[3], v[4], v[5], cmd.color);
+                    break;
+                case Command::Circle:
+                    drawer.drawCircle(v[0], v[1], v[2], cmd.color);
+                    break;
+                case Command::Region:
+                    drawer.drawRegion(v[0], v[1], v[2], v[3], cmd.color);
+                    break;
+                case Command::FillTriangle:
+                    drawer.fillTriangle(v[0], v[1], v[2], v[3], v[4], v[5], cmd.color);
+                    break;
+                case Command::FillEllipse:
+                    drawer.fillEllipse(v[0], v[1], v[2], v[3], cmd.color);
+                    break;
+                case Command::FillPolygon:
+                    drawer.fillPolygon(polygon_points.data() + v[0], v[1], cmd.color, (FillRule)v[2]);
+                    break;
+            }
+        }
+};